@@ -0,0 +1,889 @@
+#include "query.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*************************************************************//**
+ * allocation counting
+ ****************************************************************/
+static std::atomic<std::size_t> g_allocations(0);
+static std::atomic<std::size_t> g_allocated_bytes(0);
+
+// GCC warns when the free() in the deletes below is inlined next to a
+// new expression, not knowing operator new here allocates with malloc.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if(void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+    return ::operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+/*************************************************************//**
+ * harness
+ ****************************************************************/
+namespace {
+
+    // Keeps results observable so the optimizer cannot drop the work.
+    volatile long long g_sink;
+
+    const double min_seconds = 0.25;
+
+    struct measurement {
+        long long result;
+        double elements_per_second;
+        double allocations_per_run;
+        double bytes_per_run;
+    };
+
+    measurement measure(std::size_t elements, const std::function<long long()>& fn)
+    {
+        typedef std::chrono::steady_clock clock;
+
+        long long result = fn();  // warm up caches and lazy state
+        g_sink = result;
+
+        std::size_t runs = 0;
+        std::size_t allocations = g_allocations.load();
+        std::size_t bytes = g_allocated_bytes.load();
+        clock::time_point start = clock::now();
+        double elapsed = 0.0;
+        do {
+            g_sink = fn();
+            ++runs;
+            elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        } while(elapsed < min_seconds);
+
+        measurement m;
+        m.result = result;
+        m.elements_per_second = static_cast<double>(elements) * runs / elapsed;
+        m.allocations_per_run = static_cast<double>(g_allocations.load() - allocations) / runs;
+        m.bytes_per_run = static_cast<double>(g_allocated_bytes.load() - bytes) / runs;
+        return m;
+    }
+
+    // The first variant of a group is its reference; every other variant
+    // of the group must return the same result.
+    std::string g_group;
+    std::string g_reference;
+    long long g_expected;
+    int g_failures;
+
+    void report(const char* group, const char* variant, std::size_t elements,
+                const std::function<long long()>& fn)
+    {
+        measurement m = measure(elements, fn);
+        std::printf("%-12s %-22s %10.1f Melem/s %12.1f allocs/run %14.0f bytes/run\n",
+                    group, variant, m.elements_per_second / 1e6,
+                    m.allocations_per_run, m.bytes_per_run);
+        if(g_group != group) {
+            g_group = group;
+            g_reference = variant;
+            g_expected = m.result;
+        }
+        else if(m.result != g_expected) {
+            std::fprintf(stderr, "query_bench: %s: %s returned %lld, %s returned %lld\n",
+                         group, variant, m.result, g_reference.c_str(), g_expected);
+            ++g_failures;
+        }
+    }
+
+    // Order sensitive, so a misplaced value changes it as well as a wrong one.
+    template<typename Iterator, typename Function>
+    long long checksum(Iterator first, Iterator last, Function fn)
+    {
+        unsigned long long hash = 0;
+        for(; first != last; ++first)
+            hash = hash * 31 + static_cast<unsigned long long>(fn(*first));
+        return static_cast<long long>(hash);
+    }
+
+    template<typename Iterator>
+    long long checksum(Iterator first, Iterator last)
+    {
+        typedef typename std::iterator_traits<Iterator>::value_type value_type;
+        return checksum(first, last, [](const value_type &value) { return value; });
+    }
+
+    bool is_even(int i) { return (i & 1) == 0; }
+
+    int twice(int i) { return i * 2; }
+
+    bool less_int(int lhs, int rhs) { return lhs < rhs; }
+
+    struct record {
+        int id;
+        char payload[60];
+    };
+}
+
+int main(int argc, char** argv)
+{
+    std::size_t n = 1U << 20;
+    if(argc > 1)
+        n = static_cast<std::size_t>(std::strtoul(argv[1], 0, 10));
+
+    std::vector<int> values(n);
+    std::srand(42);
+    std::generate(values.begin(), values.end(), std::rand);
+
+    std::string text(n, ' ');
+    for(std::size_t i = 0; i < n; ++i)
+        text[i] = static_cast<char>('a' + values[i] % 26);
+
+    // For pipelines ending in sum(), whose int result must not overflow.
+    std::vector<int> small(n);
+    for(std::size_t i = 0; i < n; ++i)
+        small[i] = values[i] % 1024;
+
+    std::printf("query_bench: %lu elements\n", static_cast<unsigned long>(n));
+
+    /*************************************************************//**
+     * lift
+     ****************************************************************/
+    report("lift", "raw loop", n, [&]() {
+        long long sum = 0;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            sum += values[i];
+        return sum;
+    });
+    report("lift", "std::accumulate", n, [&]() {
+        return std::accumulate(values.begin(), values.end(), 0LL);
+    });
+    report("lift", "query", n, [&]() {
+        long long sum = 0;
+        auto q = lift(values.begin(), values.end());
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * where
+     ****************************************************************/
+    report("where", "raw loop", n, [&]() {
+        long long count = 0;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            if(is_even(values[i]))
+                ++count;
+        return count;
+    });
+    report("where", "std::count_if", n, [&]() {
+        return static_cast<long long>(std::count_if(values.begin(), values.end(), is_even));
+    });
+    report("where", "query", n, [&]() {
+        long long count = 0;
+        auto q = lift(values.begin(), values.end()) >> where(&is_even);
+        for(auto it = q.begin(); it != q.end(); ++it)
+            ++count;
+        return count;
+    });
+
+    /*************************************************************//**
+     * select
+     ****************************************************************/
+    report("select", "raw loop", n, [&]() {
+        long long sum = 0;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            sum += twice(values[i]);
+        return sum;
+    });
+    report("select", "std::transform", n, [&]() {
+        std::vector<int> out(values.size());
+        std::transform(values.begin(), values.end(), out.begin(), twice);
+        return std::accumulate(out.begin(), out.end(), 0LL);
+    });
+    report("select", "query", n, [&]() {
+        long long sum = 0;
+        auto q = lift(values.begin(), values.end()) >> select(&twice);
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * orderby
+     ****************************************************************/
+    report("orderby", "std::sort", n, [&]() {
+        std::vector<int> sorted(values);
+        std::sort(sorted.begin(), sorted.end(), less_int);
+        return checksum(sorted.begin(), sorted.end());
+    });
+    report("orderby", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int);
+        return checksum(q.begin(), q.end());
+    });
+
+    report("orderby", "query 1 MB budget", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int).with_memory_budget(1U << 20);
+        return checksum(q.begin(), q.end());
+    });
+
+    report("top_k(100)", "std::partial_sort", n, [&]() {
+        std::vector<int> sorted(values);
+        std::partial_sort(sorted.begin(), sorted.begin() + 100, sorted.end(), less_int);
+        return checksum(sorted.begin(), sorted.begin() + 100);
+    });
+    report("top_k(100)", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> top_k(100, less_int);
+        return checksum(q.begin(), q.end());
+    });
+    report("top_k(100)", "query orderby>>take", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int) >> take(100);
+        return checksum(q.begin(), q.end());
+    });
+
+    report("first(100)", "std::partial_sort", n, [&]() {
+        std::vector<int> sorted(values);
+        std::partial_sort(sorted.begin(), sorted.begin() + 100, sorted.end(), less_int);
+        return std::accumulate(sorted.begin(), sorted.begin() + 100, 0LL);
+    });
+    report("first(100)", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int);
+        long long sum = 0;
+        auto it = q.begin();
+        for(int i = 0; i < 100; ++i, ++it)
+            sum += *it;
+        return sum;
+    });
+    report("first(100)", "query lazy", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int).lazy();
+        long long sum = 0;
+        auto it = q.begin();
+        for(int i = 0; i < 100; ++i, ++it)
+            sum += *it;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * page
+     ****************************************************************/
+    auto even = [](int v) { return is_even(v); };
+    auto widen = [](int v) { return static_cast<long long>(v); };
+
+    report("page", "raw loop", n, [&]() {
+        long long sum = 0;
+        std::size_t matched = 0;
+        for(std::size_t i = 0; i < values.size() && matched < 1100; ++i) {
+            if(!is_even(values[i]))
+                continue;
+            if(matched++ >= 1000)
+                sum += values[i];
+        }
+        return sum;
+    });
+    report("page", "manual break", n, [&]() {
+        long long sum = 0;
+        std::size_t matched = 0;
+        auto q = lift(values.begin(), values.end()) >> where(even);
+        for(auto it = q.begin(); it != q.end(); ++it) {
+            if(matched++ < 1000)
+                continue;
+            sum += *it;
+            if(matched == 1100)
+                break;
+        }
+        return sum;
+    });
+    report("page", "query skip >> take", n, [&]() {
+        return static_cast<long long>(lift(values.begin(), values.end())
+                                      >> where(even) >> skip(1000) >> take(100) >> select(widen) >> sum());
+    });
+
+    auto low_bits_less = [](int lhs, int rhs) { return (lhs & 1023) < (rhs & 1023); };
+    auto high_bits_less = [](int lhs, int rhs) { return (lhs >> 10) < (rhs >> 10); };
+
+    report("two keys", "std::sort", n, [&]() {
+        std::vector<int> sorted(values);
+        std::sort(sorted.begin(), sorted.end(), [&](int lhs, int rhs) {
+            return low_bits_less(lhs, rhs) || (!low_bits_less(rhs, lhs) && high_bits_less(lhs, rhs));
+        });
+        return checksum(sorted.begin(), sorted.end());
+    });
+    report("two keys", "orderby >> orderby", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(high_bits_less) >> orderby(low_bits_less).stable();
+        return checksum(q.begin(), q.end());
+    });
+    report("two keys", "query then_by", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(low_bits_less).then_by(high_bits_less);
+        return checksum(q.begin(), q.end());
+    });
+    report("two keys", "query then_by stable", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(low_bits_less).then_by(high_bits_less).stable();
+        return checksum(q.begin(), q.end());
+    });
+
+    std::vector<record> records(n);
+    for(std::size_t i = 0; i < n; ++i) {
+        records[i].id = values[i];
+        std::memset(records[i].payload, static_cast<int>(i), sizeof(records[i].payload));
+    }
+    auto record_less = [](const record &lhs, const record &rhs) { return lhs.id < rhs.id; };
+    auto record_id = [](const record &r) { return r.id; };
+
+    report("orderby key", "std::sort", n, [&]() {
+        std::vector<record> sorted(records);
+        std::sort(sorted.begin(), sorted.end(), record_less);
+        return checksum(sorted.begin(), sorted.end(), record_id);
+    });
+    report("orderby key", "query orderby", n, [&]() {
+        auto q = lift(records.begin(), records.end()) >> orderby(record_less);
+        return checksum(q.begin(), q.end(), record_id);
+    });
+    report("orderby key", "query orderby_key", n, [&]() {
+        auto q = lift(records.begin(), records.end()) >> orderby_key(record_id);
+        return checksum(q.begin(), q.end(), record_id);
+    });
+
+    /*************************************************************//**
+     * strings
+     ****************************************************************/
+    std::vector<std::string> names(n / 4);
+    for(std::size_t i = 0; i < names.size(); ++i)
+        names[i] = "customer-record-" + std::to_string(values[i]);
+    auto long_name = [](const std::string &name) { return name.size() > 25; };
+
+    report("strings", "raw loop", names.size(), [&]() {
+        long long total = 0;
+        for(std::size_t i = 0; i < names.size(); ++i) {
+            if(long_name(names[i]))
+                total += static_cast<long long>(names[i].size());
+        }
+        return total;
+    });
+    report("strings", "query", names.size(), [&]() {
+        long long total = 0;
+        auto q = lift(names.begin(), names.end()) >> where(long_name);
+        for(auto it = q.begin(); it != q.end(); ++it)
+            total += static_cast<long long>((*it).size());
+        return total;
+    });
+    report("strings", "query orderby", names.size(), [&]() {
+        long long total = 0;
+        auto q = lift(names.begin(), names.end()) >> where(long_name) >> orderby([](const std::string &lhs, const std::string &rhs) {
+            return lhs < rhs;
+        });
+        for(auto it = q.begin(); it != q.end(); ++it)
+            total += static_cast<long long>((*it).size());
+        return total;
+    });
+
+    /*************************************************************//**
+     * distinct
+     ****************************************************************/
+    std::vector<int> repeated(n);
+    for(std::size_t i = 0; i < n; ++i)
+        repeated[i] = values[i] % 65536;
+
+    report("distinct", "orderby + skip", n, [&]() {
+        long long sum = 0;
+        auto q = lift(repeated.begin(), repeated.end()) >> orderby([](int lhs, int rhs) { return lhs < rhs; });
+        bool first = true;
+        int previous = 0;
+        for(auto it = q.begin(); it != q.end(); ++it) {
+            if(!first && *it == previous)
+                continue;
+            first = false;
+            previous = *it;
+            sum += previous;
+        }
+        return sum;
+    });
+    report("distinct", "std::unordered_set", n, [&]() {
+        long long sum = 0;
+        std::unordered_set<int> seen;
+        for(std::size_t i = 0; i < repeated.size(); ++i) {
+            if(seen.insert(repeated[i]).second)
+                sum += repeated[i];
+        }
+        return sum;
+    });
+    report("distinct", "query distinct", n, [&]() {
+        long long sum = 0;
+        auto q = lift(repeated.begin(), repeated.end()) >> distinct();
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * zip_with
+     ****************************************************************/
+    report("zip_with", "raw loop", n, [&]() {
+        long long sum = 0;
+        for(std::size_t i = 0; i < text.size(); ++i)
+            sum += text[i] * static_cast<long long>(i);
+        return sum;
+    });
+    report("zip_with", "query", n, [&]() {
+        long long sum = 0;
+        auto q = lift(text.begin(), text.end()) >> zip_with(from_range_infinite(0));
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += (*it).first * static_cast<long long>((*it).second);
+        return sum;
+    });
+    report("zip_with", "query int64", n, [&]() {
+        long long sum = 0;
+        auto q = lift(text.begin(), text.end()) >> zip_with(from_range_infinite(std::int64_t(0)));
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += (*it).first * (*it).second;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * chain
+     ****************************************************************/
+    report("chain", "raw loop", n, [&]() {
+        long long sum = 0;
+        for(std::size_t i = 0; i < small.size(); ++i) {
+            int v = small[i];
+            if(!is_even(v))
+                continue;
+            v = twice(v) + 1;
+            if(v % 3 == 0)
+                continue;
+            v = v / 2;
+            if(v < 0)
+                continue;
+            sum += v + 7;
+        }
+        return sum;
+    });
+    report("chain", "query", n, [&]() {
+        long long sum = 0;
+        auto q = lift(small.begin(), small.end())
+                 >> where(&is_even)
+                 >> select([](int v) { return twice(v) + 1; })
+                 >> where([](int v) { return v % 3 != 0; })
+                 >> select([](int v) { return v / 2; })
+                 >> where([](int v) { return v >= 0; })
+                 >> select([](int v) { return v + 7; });
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+
+    report("chain", "query batches", n, [&]() {
+        auto q = lift(small.begin(), small.end())
+                 >> where(&is_even)
+                 >> select([](int v) { return twice(v) + 1; })
+                 >> where([](int v) { return v % 3 != 0; })
+                 >> select([](int v) { return v / 2; })
+                 >> where([](int v) { return v >= 0; })
+                 >> select([](int v) { return v + 7; });
+        return static_cast<long long>(q >> sum());
+    });
+
+    report("chain+sort", "raw loop", n, [&]() {
+        std::vector<int> out;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            if(is_even(values[i]))
+                out.push_back(twice(values[i]));
+        std::sort(out.begin(), out.end(), less_int);
+        return checksum(out.begin(), out.end());
+    });
+    report("chain+sort", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end())
+                 >> where(&is_even)
+                 >> select(&twice)
+                 >> orderby(less_int);
+        return checksum(q.begin(), q.end());
+    });
+
+    report("deep chain", "raw loop", n, [&]() {
+        std::vector<int> sorted(values);
+        std::sort(sorted.begin(), sorted.end(), less_int);
+        long long sum = 0;
+        for(std::size_t i = 0; i < sorted.size(); ++i)
+            sum += sorted[i] + 10;
+        return sum;
+    });
+    report("deep chain", "query", n, [&]() {
+        auto inc = [](int v) { return v + 1; };
+        auto q = lift(values.begin(), values.end())
+                 >> orderby(less_int)
+                 >> select(inc) >> select(inc) >> select(inc) >> select(inc) >> select(inc)
+                 >> select(inc) >> select(inc) >> select(inc) >> select(inc) >> select(inc);
+        long long sum = 0;
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * group_by
+     ****************************************************************/
+    // Groups come out in different orders, so the result must not depend on it.
+    auto group_hash = [](int key, long long sum) {
+        return static_cast<unsigned long long>(key + 1) * static_cast<unsigned long long>(sum);
+    };
+    report("group_by", "std::unordered_map", n, [&]() {
+        std::unordered_map<int, long long> sums;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            sums[values[i] % 1024] += values[i];
+        unsigned long long hash = 0;
+        for(auto it = sums.begin(); it != sums.end(); ++it)
+            hash += group_hash(it->first, it->second);
+        return static_cast<long long>(hash);
+    });
+    report("group_by", "orderby + runs", n, [&]() {
+        auto q = lift(values.begin(), values.end())
+                 >> orderby([](int lhs, int rhs) { return lhs % 1024 < rhs % 1024; });
+        unsigned long long hash = 0;
+        long long sum = 0;
+        int previous = -1;
+        for(auto it = q.begin(); it != q.end(); ++it) {
+            if(*it % 1024 != previous) {
+                if(previous >= 0)
+                    hash += group_hash(previous, sum);
+                previous = *it % 1024;
+                sum = 0;
+            }
+            sum += *it;
+        }
+        if(previous >= 0)
+            hash += group_hash(previous, sum);
+        return static_cast<long long>(hash);
+    });
+    report("group_by", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end())
+                 >> group_by([](int v) { return v % 1024; },
+                             aggregate(0LL, [](long long sum, int v) { return sum + v; }));
+        unsigned long long hash = 0;
+        for(auto it = q.begin(); it != q.end(); ++it)
+            hash += group_hash(it->first, it->second);
+        return static_cast<long long>(hash);
+    });
+
+    /*************************************************************//**
+     * per request: many small materializing pipelines
+     ****************************************************************/
+    const std::size_t request_size = 256;
+    auto bucket = [](int v) { return v % 16; };
+    auto add = aggregate(0LL, [](long long sum, int v) { return sum + v; });
+
+    report("request", "std::allocator", n, [&]() {
+        long long total = 0;
+        for(std::size_t first = 0; first + request_size <= n; first += request_size) {
+            auto request = lift(values.begin() + first, values.begin() + first + request_size);
+            auto sorted = request >> orderby(less_int);
+            auto groups = request >> group_by(bucket, add);
+            total += *sorted.begin() + static_cast<long long>(groups.size());
+        }
+        return total;
+    });
+    report("request", "arena", n, [&]() {
+        long long total = 0;
+        query::monotonic_arena arena;
+        for(std::size_t first = 0; first + request_size <= n; first += request_size) {
+            {
+                auto request = lift(values.begin() + first, values.begin() + first + request_size);
+                auto sorted = request >> orderby(less_int).with_allocator(query::arena_allocator<int>(arena));
+                auto groups = request >> group_by(bucket, add).with_allocator(query::arena_allocator<int>(arena));
+                total += *sorted.begin() + static_cast<long long>(groups.size());
+            }
+            arena.reset();
+        }
+        return total;
+    });
+
+    /*************************************************************//**
+     * char filters
+     ****************************************************************/
+    report("find char", "raw loop", n, [&]() {
+        return static_cast<long long>(std::count(text.begin(), text.end(), 'q'));
+    });
+    report("find char", "query lambda", n, [&]() {
+        long long count = 0;
+        auto q = lift(text.begin(), text.end()) >> where([](char c) { return c == 'q'; });
+        for(auto it = q.begin(); it != q.end(); ++it)
+            ++count;
+        return count;
+    });
+    report("find char", "query char_equal", n, [&]() {
+        long long count = 0;
+        auto q = lift(text.begin(), text.end()) >> where(char_equal('q'));
+        for(auto it = q.begin(); it != q.end(); ++it)
+            ++count;
+        return count;
+    });
+    report("filter text", "raw loop", n, [&]() {
+        std::string out;
+        for(std::size_t i = 0; i < text.size(); ++i)
+            if(text[i] >= 'a' && text[i] <= 'm')
+                out.push_back(text[i]);
+        return checksum(out.begin(), out.end());
+    });
+    report("filter text", "query lambda", n, [&]() {
+        std::string out = lift(text.begin(), text.end())
+                          >> where([](char c) { return c >= 'a' && c <= 'm'; }) >> to_string();
+        return checksum(out.begin(), out.end());
+    });
+    report("filter text", "query char_in_range", n, [&]() {
+        std::string out = lift(text.begin(), text.end()) >> where(char_in_range('a', 'm')) >> to_string();
+        return checksum(out.begin(), out.end());
+    });
+    auto twice_inline = [](int v) { return twice(v); };
+    report("transform", "std::transform", n, [&]() {
+        std::vector<int> out(values.size());
+        std::transform(values.begin(), values.end(), out.begin(), twice_inline);
+        return checksum(out.begin(), out.end());
+    });
+    report("transform", "query to_vector", n, [&]() {
+        std::vector<int> out = lift(values.begin(), values.end()) >> select(twice_inline) >> to_vector();
+        return checksum(out.begin(), out.end());
+    });
+
+    /*************************************************************//**
+     * lines
+     ****************************************************************/
+    const char* lines_path = "query_bench_lines.txt";
+    {
+        std::ofstream file(lines_path, std::ios::binary);
+        for(std::size_t i = 0; i < n; ++i)
+            file.put(values[i] % 64 == 0 ? '\n' : text[i]);
+    }
+    report("lines", "std::getline", n, [&]() {
+        std::ifstream file(lines_path, std::ios::binary);
+        std::string line;
+        long long total = 0;
+        while(std::getline(file, line))
+            total += static_cast<long long>(line.size());
+        return total;
+    });
+    report("lines", "query", n, [&]() {
+        return static_cast<long long>(lines(lines_path)
+                                      >> select([](query::string_ref line) { return line.size(); })
+                                      >> sum());
+    });
+    std::remove(lines_path);
+
+    /*************************************************************//**
+     * words
+     ****************************************************************/
+    std::string sentence(text);
+    for(std::size_t i = 0; i < n; ++i)
+        if(values[i] % 6 == 0)
+            sentence[i] = ' ';
+    report("words", "std::istringstream", n, [&]() {
+        std::istringstream stream(sentence);
+        std::string word;
+        long long total = 0;
+        while(stream >> word)
+            total += static_cast<long long>(word.size());
+        return total;
+    });
+    report("words", "query", n, [&]() {
+        return static_cast<long long>(lift(sentence.begin(), sentence.end())
+                                      >> words()
+                                      >> select([](query::string_ref word) { return word.size(); })
+                                      >> sum());
+    });
+
+    /*************************************************************//**
+     * aggregates
+     ****************************************************************/
+    report("count where", "std::count_if", n, [&]() {
+        return static_cast<long long>(std::count_if(values.begin(), values.end(), is_even));
+    });
+    report("count where", "query iterate", n, [&]() {
+        long long count = 0;
+        auto q = lift(values.begin(), values.end()) >> where(&is_even);
+        for(auto it = q.begin(); it != q.end(); ++it)
+            ++count;
+        return count;
+    });
+    report("count where", "query count", n, [&]() {
+        return static_cast<long long>(lift(values.begin(), values.end()) >> where(&is_even) >> count());
+    });
+    report("sum", "std::accumulate", n, [&]() {
+        return std::accumulate(small.begin(), small.end(), 0LL);
+    });
+    report("sum", "query", n, [&]() {
+        return static_cast<long long>(lift(small.begin(), small.end()) >> sum());
+    });
+    report("minimum", "std::min_element", n, [&]() {
+        return static_cast<long long>(*std::min_element(values.begin(), values.end()));
+    });
+    report("minimum", "query", n, [&]() {
+        return static_cast<long long>(lift(values.begin(), values.end()) >> minimum());
+    });
+    report("average", "std::accumulate", n, [&]() {
+        double total = static_cast<double>(std::accumulate(values.begin(), values.end(), 0LL));
+        return static_cast<long long>(total / static_cast<double>(values.size()));
+    });
+    report("average", "query", n, [&]() {
+        return static_cast<long long>(lift(values.begin(), values.end()) >> average());
+    });
+
+    /*************************************************************//**
+     * join
+     ****************************************************************/
+    std::size_t probes = n / 16;
+    std::vector<int> dimension(1024);
+    for(std::size_t i = 0; i < dimension.size(); ++i)
+        dimension[i] = static_cast<int>(i * 3);
+    auto probe_key = [](int v) { return v % 3072; };
+    auto build_key = [](int v) { return v; };
+    auto combine = [](int lhs, int rhs) { return static_cast<long long>(lhs) + rhs; };
+
+    report("join", "nested loops", probes, [&]() {
+        long long sum = 0;
+        for(std::size_t i = 0; i < probes; ++i)
+            for(std::size_t j = 0; j < dimension.size(); ++j)
+                if(probe_key(values[i]) == build_key(dimension[j]))
+                    sum += combine(values[i], dimension[j]);
+        return sum;
+    });
+    report("join", "query hash", probes, [&]() {
+        auto q = lift(values.begin(), values.begin() + probes)
+                 >> join(lift(dimension.begin(), dimension.end()), probe_key, build_key, combine);
+        long long sum = 0;
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+    report("join", "query merge", probes, [&]() {
+        auto q = lift(values.begin(), values.begin() + probes)
+                 >> orderby([&](int lhs, int rhs) { return probe_key(lhs) < probe_key(rhs); })
+                 >> merge_join(lift(dimension.begin(), dimension.end()) >> orderby(less_int),
+                               probe_key, build_key, combine);
+        long long sum = 0;
+        for(auto it = q.begin(); it != q.end(); ++it)
+            sum += *it;
+        return sum;
+    });
+
+    /*************************************************************//**
+     * sinks
+     ****************************************************************/
+    report("to_vector", "raw loop", n, [&]() {
+        std::vector<int> out;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            if(is_even(values[i]))
+                out.push_back(twice(values[i]));
+        return checksum(out.begin(), out.end());
+    });
+    report("to_vector", "iterator pair", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> where(&is_even) >> select(&twice);
+        std::vector<int> out(q.begin(), q.end());
+        return checksum(out.begin(), out.end());
+    });
+    report("to_vector", "query", n, [&]() {
+        std::vector<int> out = lift(values.begin(), values.end()) >> where(&is_even) >> select(&twice) >> to_vector();
+        return checksum(out.begin(), out.end());
+    });
+    std::vector<int> reused;
+    report("to_vector", "query into", n, [&]() {
+        reused.clear();
+        lift(values.begin(), values.end()) >> where(&is_even) >> select(&twice) >> into(reused);
+        return checksum(reused.begin(), reused.end());
+    });
+    report("sorted vec", "std::sort", n, [&]() {
+        std::vector<int> out(values);
+        std::sort(out.begin(), out.end(), less_int);
+        return checksum(out.begin(), out.end());
+    });
+    report("sorted vec", "query orderby", n, [&]() {
+        std::vector<int> out = lift(values.begin(), values.end()) >> orderby(less_int) >> to_vector();
+        return checksum(out.begin(), out.end());
+    });
+
+    /*************************************************************//**
+     * parallel
+     ****************************************************************/
+    report("parallel", "sequential", n, [&]() {
+        auto q = lift(values.begin(), values.end())
+                 >> where(&is_even)
+                 >> select(&twice);
+        std::vector<int> out(q.begin(), q.end());
+        return checksum(out.begin(), out.end());
+    });
+    report("parallel", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end())
+                 >> where(&is_even)
+                 >> select(&twice)
+                 >> parallel();
+        return checksum(q.begin(), q.end());
+    });
+    report("parallel sort", "sequential", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int);
+        return checksum(q.begin(), q.end());
+    });
+    report("parallel sort", "query", n, [&]() {
+        auto q = lift(values.begin(), values.end()) >> orderby(less_int) >> parallel();
+        return checksum(q.begin(), q.end());
+    });
+
+    if(g_failures != 0) {
+        std::fprintf(stderr, "query_bench: %d results differ from their reference\n", g_failures);
+        return 1;
+    }
+    return 0;
+}
@@ -27,7 +27,7 @@ int main() {
 		>> orderby(sort_pairs, false)
 		>> select([](std::pair<char, int> item){return item.first; });
 
-	std::string rev(q.begin(), q.end());
+	std::string rev = q >> to_string();
     std::cout << hello << std::endl;
     std::cout << rev << std::endl;
 
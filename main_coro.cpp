@@ -0,0 +1,46 @@
+#include <iostream>
+#include <future>
+#include "query_coro.h"
+
+// Stands in for a reader that gets one record per network or disk read.
+query::generator<std::string> read_records(int count)
+{
+    for(int i = 0; i < count; ++i)
+        co_yield "record-" + std::to_string(i);
+}
+
+// Smallest coroutine type that starts eagerly and can co_await.
+struct task {
+    struct promise_type {
+        task get_return_object() { return task(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+task count_long_records(std::promise<std::size_t> &result)
+{
+    std::size_t total = 0;
+    co_await (from_generator(read_records(1000))
+              >> where([](const std::string &s) { return s.size() > 9; })
+              >> select([](const std::string &s) { return s.size(); })
+              >> async_for_each([&total](std::size_t n) { total += n; }));
+    result.set_value(total);
+}
+
+int main()
+{
+    std::promise<std::size_t> result;
+    std::future<std::size_t> total = result.get_future();
+    count_long_records(result);
+    // The pipeline runs on its own thread; this one is free until get().
+    std::cout << "chars in long records: " << total.get() << std::endl;
+
+    auto words = from_generator(read_records(5)) >> select([](const std::string &s) { return s.substr(7); });
+    for(const auto &w : words)
+        std::cout << w << " ";
+    std::cout << std::endl;
+    return 0;
+}
@@ -2,10 +2,183 @@
 #include <iterator>
 #include <cassert>
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <cstring>
+#include <cstdio>
+#include <iosfwd>
+#include <system_error>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if !defined(QUERY_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define QUERY_SIMD_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUERY_SIMD_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
 
 #define CMAKE_TYPENAME
 
+namespace query {
+
+	/*************************************************************//**
+	 * string_ref
+	 *
+	 * Non-owning view of a run of chars, as yielded by the file and
+	 * splitting sources. It stays valid as long as the query it came
+	 * from (or the string it points into).
+	 ****************************************************************/
+    class string_ref {
+    public:
+        typedef char value_type;
+        typedef const char* iterator;
+        typedef const char* const_iterator;
+        typedef std::size_t size_type;
+
+        string_ref()
+                : _data(0), _size(0)
+        {
+        }
+
+        string_ref(const char *data, std::size_t size)
+                : _data(data), _size(size)
+        {
+        }
+
+        string_ref(const char *text)
+                : _data(text), _size(std::strlen(text))
+        {
+        }
+
+        string_ref(const std::string &text)
+                : _data(text.data()), _size(text.size())
+        {
+        }
+
+        const char *data() const {
+            return _data;
+        }
+
+        std::size_t size() const {
+            return _size;
+        }
+
+        bool empty() const {
+            return _size == 0;
+        }
+
+        const char *begin() const {
+            return _data;
+        }
+
+        const char *end() const {
+            return _data + _size;
+        }
+
+        char operator[](std::size_t n) const {
+            return _data[n];
+        }
+
+        std::string str() const {
+            return std::string(_data, _size);
+        }
+
+        int compare(const string_ref &other) const {
+            int result = std::memcmp(_data, other._data, std::min(_size, other._size));
+            if(result != 0)
+                return result;
+            return _size < other._size ? -1 : (_size > other._size ? 1 : 0);
+        }
+
+        bool operator==(const string_ref &other) const {
+            return _size == other._size && std::memcmp(_data, other._data, _size) == 0;
+        }
+
+        bool operator!=(const string_ref &other) const {
+            return !(*this == other);
+        }
+
+        bool operator<(const string_ref &other) const {
+            return compare(other) < 0;
+        }
+
+        bool operator>(const string_ref &other) const {
+            return other < *this;
+        }
+
+        bool operator<=(const string_ref &other) const {
+            return !(other < *this);
+        }
+
+        bool operator>=(const string_ref &other) const {
+            return !(*this < other);
+        }
+
+    private:
+        const char *_data;
+        std::size_t _size;
+    };
+
+    template<typename CharT, typename Traits>
+    std::basic_ostream<CharT, Traits> &operator<<(std::basic_ostream<CharT, Traits> &os, const string_ref &text)
+    {
+        return os.write(text.data(), static_cast<std::streamsize>(text.size()));
+    }
+
+}
+
+namespace std {
+
+    // FNV-1a, so string_ref keys hash without building a std::string.
+    template<>
+    struct hash<query::string_ref>
+    {
+        std::size_t operator()(const query::string_ref &text) const {
+            std::uint64_t h = 14695981039346656037ULL;
+            for(std::size_t i = 0; i < text.size(); ++i) {
+                h ^= static_cast<unsigned char>(text[i]);
+                h *= 1099511628211ULL;
+            }
+            return static_cast<std::size_t>(h);
+        }
+    };
+
+}
+
 namespace query {
 
 	/*************************************************************//**
@@ -32,590 +205,690 @@ namespace query {
     };
 
 	/*************************************************************//**
-	 * base_query
+	 * is_partitionable
+	 *
+	 * True when a query can be cut into independent pieces by source
+	 * position through source_size() and slice(first, last).
 	 ****************************************************************/
-    class base_query
+    template<typename Query>
+    struct is_partitionable : std::false_type
     {
-    protected:
-        base_query() {}
-        base_query(const base_query &) {}
-        base_query(base_query&&) {}
-        ~base_query() {}
     };
 
 	/*************************************************************//**
-	 * base_query_builder
+	 * is_position_aligned
+	 *
+	 * True when the n-th value of a query comes from the n-th source
+	 * position, so two such queries can be sliced in lockstep.
 	 ****************************************************************/
-    class base_query_builder
+    template<typename Query>
+    struct is_position_aligned : std::false_type
     {
-    protected:
-        base_query_builder() {}
-        base_query_builder(const base_query_builder &) {}
-        base_query_builder(base_query_builder&&) {}
-        ~base_query_builder() {}
     };
 
-
 	/*************************************************************//**
-	 * simple_query
+	 * size_bounds
+	 *
+	 * Lower and upper bound on the number of values a query produces,
+	 * as returned by size_hint(). An unknown upper bound is unbounded().
 	 ****************************************************************/
-    template<typename InputIterator, class A = std::allocator<typename InputIterator::value_type> >
-    class simple_query {
-    public:
-        typedef A allocator_type;
-        typedef typename A::value_type value_type;
-        typedef typename A::reference reference;
-        typedef typename A::const_reference const_reference;
-        typedef typename A::difference_type difference_type;
-        typedef typename A::size_type size_type;
-
-        typedef simple_query<InputIterator, A> this_type;
-
-        class iterator {
-        public:
-            typedef typename A::value_type value_type;
-            typedef typename A::difference_type difference_type;
-            typedef typename A::reference reference;
-            typedef typename A::pointer pointer;
-            typedef std::input_iterator_tag iterator_category;
-
-            iterator(const InputIterator& current)
-                    : _current(current) {
-            }
-
-            iterator(const iterator &other)
-                    : _current(other._current) {
-            }
-
-            bool operator==(const iterator &other) const {
-                return _current == other._current;
-            }
-
-            bool operator!=(const iterator &other) const {
-                return _current != other._current;
-            }
-
-            iterator &operator++() {
-                ++_current;
-                return *this;
-            }
-
-            value_type operator*() const {
-                return *_current;
-            }
-
-            pointer operator->() const {
-                return _current.operator->();
-            }
-
-        private:
-            InputIterator _current;
-        };
+    struct size_bounds
+    {
+        std::size_t lower;
+        std::size_t upper;
 
-        simple_query(
-                const InputIterator &first,
-                const InputIterator &last)
-                : _first(first), _last(last) {
+        static std::size_t unbounded() {
+            return std::numeric_limits<std::size_t>::max();
         }
 
-        simple_query(const simple_query &other)
-                : _first(other._first), _last(other._last) {
+        static size_bounds exact(std::size_t size) {
+            size_bounds bounds = { size, size };
+            return bounds;
         }
 
-        ~simple_query() {
+        static size_bounds between(std::size_t lower, std::size_t upper) {
+            size_bounds bounds = { lower, upper };
+            return bounds;
         }
 
-        simple_query &operator=(const simple_query &);
-
-        bool operator==(const simple_query &) const;
-
-        bool operator!=(const simple_query &) const;
+        bool is_exact() const {
+            return lower == upper;
+        }
 
-        iterator begin() const {
-            return iterator(_first);
+        // What a sink should reserve: the exact size when known, else the
+        // lower bound, and never more than limit.
+        std::size_t reserve_size(std::size_t limit = unbounded()) const {
+            return std::min(is_exact() ? upper : lower, limit);
         }
+    };
 
-        iterator end() const {
-            return iterator(_last);
+	/*************************************************************//**
+	 * lazy_state
+	 *
+	 * Base of the state a materializing query fills in on first use and
+	 * shares with its copies. ensure() fills it exactly once even when
+	 * copies start reading on several threads at once; a fill that throws
+	 * is retried by the next caller.
+	 ****************************************************************/
+    class lazy_state {
+    public:
+        lazy_state()
+                : _ready(false)
+        {
         }
 
-        void swap(simple_query &other) {
-            std::swap(_first, other._first);
-            std::swap(_last, other._last);
+        bool ready() const {
+            return _ready.load(std::memory_order_acquire);
         }
 
-        bool empty() const {
-            return _first == _last;
+        template<typename Fill>
+        void ensure(Fill fill) {
+            if(ready())
+                return;
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_ready.load(std::memory_order_relaxed))
+                return;
+            fill();
+            _ready.store(true, std::memory_order_release);
         }
 
-        template<typename QueryBuilder>
-        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(const QueryBuilder& qb) const {
-            return qb.build(*this);
+        // For state filled before any copy can see it.
+        void set_ready() {
+            _ready.store(true, std::memory_order_release);
         }
 
     private:
-        InputIterator _first;
-        InputIterator _last;
+        lazy_state(const lazy_state &);
+
+        lazy_state &operator=(const lazy_state &);
+
+        std::mutex _mutex;
+        std::atomic<bool> _ready;
     };
 
+    // Whether ptr is the only owner left, so its object may be moved from.
+    // The fence orders that after whatever the other owners did before
+    // letting go, which use_count() alone does not.
+    template<typename T>
+    bool sole_owner(const std::shared_ptr<T> &ptr) {
+        if(ptr.use_count() != 1)
+            return false;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
 	/*************************************************************//**
-	 * simple_query_builder
+	 * iterator_category_of
+	 *
+	 * The strongest category a stage can offer on top of an upstream
+	 * iterator, capped at Cap.
 	 ****************************************************************/
-    class simple_query_builder {
-    public:
+    template<typename Iterator, typename Cap = std::random_access_iterator_tag>
+    struct iterator_category_of
+    {
+        typedef typename std::common_type<
+                typename std::iterator_traits<Iterator>::iterator_category, Cap>::type type;
+    };
 
-        template<typename Query>
-        simple_query<typename Query::iterator> build(const Query& query) const {
-            return simple_query<typename Query::iterator>(query.begin(), query.end());
+	/*************************************************************//**
+	 * value_reference
+	 *
+	 * What a stage that passes values through unchanged returns from
+	 * operator*: a const reference when the upstream iterator refers to
+	 * a stored Value, so nothing is copied, else a Value.
+	 ****************************************************************/
+    template<typename Iterator, typename Value>
+    struct value_reference
+    {
+        typedef typename std::iterator_traits<Iterator>::reference upstream;
 
-        }
+        typedef typename std::conditional<
+                std::is_lvalue_reference<upstream>::value &&
+                std::is_same<typename std::decay<upstream>::type, Value>::value,
+                const Value&, Value>::type type;
     };
 
-
 	/*************************************************************//**
-	 * int_query
+	 * batch cursors
+	 *
+	 * A batch cursor walks a query once and hands out its values in
+	 * blocks: next_batch(out, capacity) writes up to capacity values to
+	 * out and returns how many, fewer than capacity only once the query
+	 * is exhausted. Stages with native_batches run whole blocks through
+	 * their predicate or generator; every other query is read through
+	 * its iterators by iterator_batch_cursor. Cursors refer to their
+	 * query, which must outlive them.
 	 ****************************************************************/
-    class int_query {
-    public:
-        typedef std::allocator<int> A;
-        typedef A allocator_type;
-		typedef CMAKE_TYPENAME A::value_type value_type;
-		typedef CMAKE_TYPENAME A::reference reference;
-		typedef CMAKE_TYPENAME A::const_reference const_reference;
-		typedef CMAKE_TYPENAME A::difference_type difference_type;
-		typedef CMAKE_TYPENAME A::size_type size_type;
+    const std::size_t batch_size = 256;
 
-        typedef int_query this_type;
+    template<typename Query>
+    struct native_batches : std::false_type
+    {
+    };
 
-        class iterator {
-        public:
-			typedef CMAKE_TYPENAME A::value_type value_type;
-			typedef CMAKE_TYPENAME A::difference_type difference_type;
-			typedef CMAKE_TYPENAME A::reference reference;
-			typedef CMAKE_TYPENAME A::pointer pointer;
-            typedef std::input_iterator_tag iterator_category;
+    template<typename Query>
+    class iterator_batch_cursor {
+    public:
+        typedef typename Query::value_type value_type;
+        typedef typename Query::iterator iterator;
 
-            iterator(int current)
-                    : _current(current) {
-            }
+        explicit iterator_batch_cursor(const Query &query)
+                : _current(query.begin())
+                , _last(query.end())
+        {
+        }
 
-            iterator(const iterator &other)
-                    : _current(other._current) {
-            }
+        std::size_t next_batch(value_type *out, std::size_t capacity) {
+            std::size_t count = 0;
+            for(; count < capacity && _current != _last; ++_current)
+                out[count++] = *_current;
+            return count;
+        }
 
-            bool operator==(const iterator &other) const {
-                return _current == other._current;
-            }
+    private:
+        iterator _current;
+        iterator _last;
+    };
 
-            bool operator!=(const iterator &other) const {
-                return _current != other._current;
-            }
+    template<typename Query, bool Native = native_batches<Query>::value>
+    struct batch_cursor_of
+    {
+        typedef iterator_batch_cursor<Query> type;
 
-            iterator &operator++() {
-                ++_current;
-                return *this;
-            }
+        static type make(const Query &query) {
+            return type(query);
+        }
+    };
 
-            value_type operator*() const {
-                return _current;
-            }
+    template<typename Query>
+    struct batch_cursor_of<Query, true>
+    {
+        typedef typename Query::batch_cursor type;
 
-            pointer operator->() const {
-                assert(false);
-            }
+        static type make(const Query &query) {
+            return query.batches();
+        }
+    };
 
-        private:
-            int _current;
-        };
+	/*************************************************************//**
+	 * is_contiguous_iterator
+	 *
+	 * True for iterators known to walk contiguous storage: pointers and
+	 * the iterators of std::vector and std::basic_string.
+	 ****************************************************************/
+    template<typename Iterator>
+    struct is_contiguous_iterator
+    {
+        typedef typename std::iterator_traits<Iterator>::value_type value_type;
+
+        static const bool value = std::is_pointer<Iterator>::value ||
+                (!std::is_same<value_type, bool>::value &&
+                 (std::is_same<Iterator, typename std::vector<value_type>::iterator>::value ||
+                  std::is_same<Iterator, typename std::vector<value_type>::const_iterator>::value)) ||
+                (std::is_integral<value_type>::value && !std::is_same<value_type, bool>::value &&
+                 (std::is_same<Iterator, typename std::basic_string<value_type>::iterator>::value ||
+                  std::is_same<Iterator, typename std::basic_string<value_type>::const_iterator>::value));
+    };
 
-        int_query(int begin, int end)
-                : _begin(begin)
-                , _end(end)
-        {
+	/*************************************************************//**
+	 * assignable_function
+	 *
+	 * Holds a predicate or generator by value but stays copy assignable
+	 * even when the callable (e.g. a lambda) is not, which forward and
+	 * random access iterators need.
+	 ****************************************************************/
+    template<typename Function>
+    class assignable_function
+    {
+    public:
+        assignable_function(const Function &function) {
+            new(&_storage) Function(function);
         }
 
-        int_query(const int_query &other)
-                : _begin(other._begin)
-                , _end(other._end) {
+        assignable_function(const assignable_function &other) {
+            new(&_storage) Function(other.get());
         }
 
-        ~int_query() {
+        assignable_function(assignable_function &&other) {
+            new(&_storage) Function(std::move(other.get()));
         }
 
-        int_query &operator=(const int_query &);
-
-        bool operator==(const int_query &) const;
-
-        bool operator!=(const int_query &) const;
+        ~assignable_function() {
+            get().~Function();
+        }
 
-        iterator begin() const {
-            return iterator(_begin);
+        assignable_function &operator=(const assignable_function &other) {
+            if(this != &other) {
+                get().~Function();
+                new(&_storage) Function(other.get());
+            }
+            return *this;
         }
 
-        iterator end() const {
-            return iterator(_end);
+        template<typename... Args>
+        auto operator()(Args&&... args) const -> decltype(std::declval<const Function&>()(std::forward<Args>(args)...)) {
+            return get()(std::forward<Args>(args)...);
         }
 
-        void swap(int_query &other) {
-            std::swap(_begin, other._begin);
-            std::swap(_end, other._end);
+        template<typename... Args>
+        auto operator()(Args&&... args) -> decltype(std::declval<Function&>()(std::forward<Args>(args)...)) {
+            return get()(std::forward<Args>(args)...);
         }
 
-        bool empty() const {
-            return _begin == _end;
+        const Function &get() const {
+            return *reinterpret_cast<const Function*>(&_storage);
         }
 
-        template<typename QueryBuilder>
-        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(const QueryBuilder& qb) const {
-            return qb.build(*this);
+        Function &get() {
+            return *reinterpret_cast<Function*>(&_storage);
         }
 
     private:
-        int _begin;
-        int _end;
-    };
 
+        typename std::aligned_storage<sizeof(Function), std::alignment_of<Function>::value>::type _storage;
+    };
 
 	/*************************************************************//**
-	 * where_query
+	 * monotonic_arena
+	 *
+	 * Bump allocator over a chain of blocks that only grows; nothing is
+	 * freed until reset(), release() or destruction returns the blocks
+	 * at once. Blocks double in size up to max_block_size(). Queries that
+	 * allocate from an arena must be destroyed before it is released.
+	 * Not thread safe: share one arena only between stages run on one
+	 * thread.
 	 ****************************************************************/
-	template<typename InputType, typename Predicate, class A = std::allocator<typename InputType::value_type> >
-    class where_query {
+    class monotonic_arena {
     public:
-        typedef A allocator_type;
-        typedef typename A::value_type value_type;
-        typedef typename A::reference reference;
-        typedef typename A::const_reference const_reference;
-        typedef typename A::difference_type difference_type;
-        typedef typename A::size_type size_type;
-
-		typedef where_query<InputType, Predicate, A> this_type;
-		typedef typename InputType::iterator input_iterator;
-
-        class iterator {
-        public:
-            typedef typename A::value_type value_type;
-            typedef typename A::difference_type difference_type;
-            typedef typename A::reference reference;
-            typedef typename A::pointer pointer;
-            typedef std::input_iterator_tag iterator_category;
+        explicit monotonic_arena(std::size_t initial_block_size = 4096)
+                : _blocks(0)
+                , _current(0)
+                , _end(0)
+                , _next_block_size(std::max<std::size_t>(initial_block_size, sizeof(block) * 2))
+                , _allocated(0)
+        {
+        }
 
-			iterator(const input_iterator& current,
-					const input_iterator& last,
-                    const Predicate& pred)
-                    : _current(current)
-                    , _last(last)
-                    , _pred(pred)
-            {
-                if(_pred(*_current))
-                    return;
+        ~monotonic_arena()
+        {
+            release();
+        }
 
-                while(++_current != _last)
-                {
-                    if(_pred(*_current))
-                        break;
-                }
+        // alignment must be a power of two.
+        void *allocate(std::size_t size, std::size_t alignment) {
+            std::size_t padding = padding_for(alignment);
+            if(padding + size > static_cast<std::size_t>(_end - _current)) {
+                add_block(size + alignment);
+                padding = padding_for(alignment);
             }
+            char *result = _current + padding;
+            _current = result + size;
+            _allocated += size;
+            return result;
+        }
 
-            iterator(const iterator &other)
-                    : _current(other._current)
-                    , _last(other._last)
-                    , _pred(other._pred)
-            {
-            }
+        // Frees every block but the last and largest one, and hands out
+        // memory from its start again, so a pipeline run per request
+        // allocates nothing once the arena has grown to its size.
+        void reset() {
+            if(_blocks == 0)
+                return;
+            block *kept = _blocks;
+            _blocks = kept->next;
+            release();
+            kept->next = 0;
+            _blocks = kept;
+            _current = reinterpret_cast<char*>(kept) + sizeof(block);
+            _end = reinterpret_cast<char*>(kept) + kept->size;
+        }
 
-            bool operator==(const iterator &other) const {
-                return _current == other._current;
+        // Frees every block. Memory handed out before becomes invalid.
+        void release() {
+            while(_blocks != 0) {
+                block *next = _blocks->next;
+                ::operator delete(_blocks);
+                _blocks = next;
             }
+            _current = 0;
+            _end = 0;
+            _allocated = 0;
+        }
 
-            bool operator!=(const iterator &other) const {
-                return _current != other._current;
-            }
+        // Bytes handed out since construction or the last release().
+        std::size_t allocated() const {
+            return _allocated;
+        }
 
-            iterator &operator++() {
-                assert(_current != _last);
-                while(++_current != _last)
-                {
-                    if(_pred(*_current))
-                        break;
-                }
-                return *this;
-            }
+        static std::size_t max_block_size() {
+            return 1U << 24;
+        }
 
-            value_type operator*() const {
-                assert(_current != _last);
-                return *_current;
-            }
+    private:
+        struct block {
+            block *next;
+            std::size_t size;
+        };
 
-            pointer operator->() const {
-                assert(_current != _last);
-                return _current.operator->();
-            }
+        monotonic_arena(const monotonic_arena &);
 
-        private:
-			input_iterator _current;
-			input_iterator _last;
-            Predicate _pred;
-        };
+        monotonic_arena &operator=(const monotonic_arena &);
 
-        where_query(
-                const InputType &container,
-                const Predicate &pred)
-				: _container(container), _pred(pred) {
+        std::size_t padding_for(std::size_t alignment) const {
+            return static_cast<std::size_t>(0U - reinterpret_cast<std::uintptr_t>(_current)) & (alignment - 1);
         }
 
-        where_query(const where_query &other)
-				: _container(other._container), _pred(other._pred) {
+        void add_block(std::size_t minimum) {
+            std::size_t size = std::max(_next_block_size, minimum + sizeof(block));
+            block *added = static_cast<block*>(::operator new(size));
+            added->next = _blocks;
+            added->size = size;
+            _blocks = added;
+            _current = reinterpret_cast<char*>(added) + sizeof(block);
+            _end = reinterpret_cast<char*>(added) + size;
+            _next_block_size = std::min(_next_block_size * 2, max_block_size());
         }
 
-        ~where_query() {
-        }
+        block *_blocks;
+        char *_current;
+        char *_end;
+        std::size_t _next_block_size;
+        std::size_t _allocated;
+    };
 
-        where_query &operator=(const where_query &);
+	/*************************************************************//**
+	 * arena_allocator
+	 *
+	 * Standard allocator over a monotonic_arena. deallocate() does
+	 * nothing; the memory comes back with the arena's release(). Pass
+	 * one to with_allocator() on a materializing stage.
+	 ****************************************************************/
+    template<typename T>
+    class arena_allocator {
+    public:
+        typedef T value_type;
 
-        bool operator==(const where_query &) const;
+        arena_allocator(monotonic_arena &arena)
+                : _arena(&arena)
+        {
+        }
 
-        bool operator!=(const where_query &) const;
+        template<typename U>
+        arena_allocator(const arena_allocator<U> &other)
+                : _arena(other.arena())
+        {
+        }
 
-        iterator begin() const {
-			return iterator(_container.begin(), _container.end(), _pred);
+        T *allocate(std::size_t count) {
+            if(count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+                throw std::bad_alloc();
+            return static_cast<T*>(_arena->allocate(count * sizeof(T), std::alignment_of<T>::value));
         }
 
-        iterator end() const {
-			return iterator(_container.end(), _container.end(), _pred);
+        void deallocate(T *, std::size_t) {
         }
 
-        void swap(where_query &other) {
-			std::swap(_container, other._container);
-            std::swap(_pred, other._pred);
+        monotonic_arena *arena() const {
+            return _arena;
         }
 
-        bool empty() const {
-			return _container.empty();
+        template<typename U>
+        bool operator==(const arena_allocator<U> &other) const {
+            return _arena == other.arena();
         }
 
-        template<typename QueryBuilder>
-        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(const QueryBuilder& qb) const {
-            return qb.build(*this);
+        template<typename U>
+        bool operator!=(const arena_allocator<U> &other) const {
+            return _arena != other.arena();
         }
 
     private:
-        InputType _container;
-        Predicate _pred;
+        monotonic_arena *_arena;
     };
 
 	/*************************************************************//**
-	 * where_query_builder
+	 * rebind_allocator
 	 ****************************************************************/
-	template<typename Predicate>
-    class where_query_builder {
+    template<class Alloc, typename T>
+    struct rebind_allocator
+    {
+        typedef typename std::allocator_traits<Alloc>::template rebind_alloc<T> type;
+    };
+
+	/*************************************************************//**
+	 * allocator_query_builder
+	 *
+	 * Returned by with_allocator() on the materializing builders: builds
+	 * the same stage, with its storage allocated through allocator.
+	 ****************************************************************/
+    template<typename QueryBuilder, class Alloc>
+    class allocator_query_builder {
     public:
-        where_query_builder(const Predicate& pred) : _pred(pred) {
+        allocator_query_builder(const QueryBuilder &builder, const Alloc &allocator)
+                : _builder(builder)
+                , _allocator(allocator)
+        {
         }
 
         template<typename Query>
-        where_query<Query, Predicate> build(const Query& query) const {
-            return where_query<Query, Predicate>(query, _pred);
-
+        auto build(Query&& query) const
+                -> decltype(std::declval<const QueryBuilder&>().build(std::forward<Query>(query), std::declval<const Alloc&>())) {
+            return _builder.build(std::forward<Query>(query), _allocator);
         }
-    private:
-        Predicate _pred;
 
+    private:
+        QueryBuilder _builder;
+        Alloc _allocator;
     };
 
 	/*************************************************************//**
-	 * select_query
+	 * flat_hash_table
+	 *
+	 * Open addressing (linear probing) index over a dense vector of
+	 * key/value entries kept in insertion order. The hashing stages use
+	 * it to find a key's entry without a node allocation per key.
 	 ****************************************************************/
-    template<typename InputType, typename Generator>
-    class select_query {
+    template<typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>,
+             class A = std::allocator<std::pair<Key, Value> > >
+    class flat_hash_table {
     public:
-		static typename InputType::value_type get_source();
-        static Generator get_generator();
-
-        typedef decltype(get_generator()(get_source())) raw_value_type;
-        typedef std::allocator<raw_value_type> A;
+        typedef std::pair<Key, Value> entry_type;
+        typedef std::vector<entry_type, typename rebind_allocator<A, entry_type>::type> entries_type;
+        typedef typename entries_type::iterator iterator;
+        typedef typename entries_type::const_iterator const_iterator;
 
+        static std::size_t npos() {
+            return std::numeric_limits<std::size_t>::max();
+        }
 
-        typedef A allocator_type;
-        typedef typename A::value_type value_type;
-        typedef typename A::reference reference;
-        typedef typename A::const_reference const_reference;
-        typedef typename A::difference_type difference_type;
-        typedef typename A::size_type size_type;
-
-		typedef select_query<InputType, Generator> this_type;
-		typedef typename InputType::iterator input_iterator;
-
-        class iterator {
-        public:
-            typedef typename A::value_type value_type;
-            typedef typename A::difference_type difference_type;
-            typedef typename A::reference reference;
-            typedef typename A::pointer pointer;
-            typedef std::input_iterator_tag iterator_category;
+        explicit flat_hash_table(const Hash &hash = Hash(), const KeyEqual &equal = KeyEqual(), const A &allocator = A())
+                : _slots(allocator)
+                , _shift(64)
+                , _entries(allocator)
+                , _hash(hash)
+                , _equal(equal)
+        {
+        }
 
-			iterator(const input_iterator& current,
-					const input_iterator& last,
-                    const Generator& generator)
-                    : _current(current)
-                    , _last(last)
-                    , _generator(generator)
-            {
-            }
+        explicit flat_hash_table(const A &allocator)
+                : _slots(allocator)
+                , _shift(64)
+                , _entries(allocator)
+                , _hash()
+                , _equal()
+        {
+        }
 
-            iterator(const iterator &other)
-                    : _current(other._current)
-                    , _last(other._last)
-                    , _generator(other._generator)
-            {
-            }
+        std::size_t size() const {
+            return _entries.size();
+        }
 
-            bool operator==(const iterator &other) const {
-                return _current == other._current;
-            }
+        bool empty() const {
+            return _entries.empty();
+        }
 
-            bool operator!=(const iterator &other) const {
-                return _current != other._current;
-            }
+        void clear() {
+            _slots.clear();
+            _shift = 64;
+            _entries.clear();
+        }
 
-            iterator &operator++() {
-                assert(_current != _last);
-                ++_current;
-                return *this;
-            }
+        void reserve(std::size_t count) {
+            _entries.reserve(count);
+            if(count * 4 > _slots.size() * 3)
+                rehash(count * 4 / 3 + 1);
+        }
 
-            value_type operator*() const {
-                assert(_current != _last);
-                return _generator(*_current);
+        // Index of the entry for key, or npos() when there is none.
+        std::size_t find(const Key &key) const {
+            if(_entries.empty())
+                return npos();
+            std::size_t hash = _hash(key);
+            std::size_t mask = _slots.size() - 1;
+            for(std::size_t i = home(hash); _slots[i].index != 0; i = (i + 1) & mask) {
+                if(_slots[i].hash == hash && _equal(_entries[_slots[i].index - 1].first, key))
+                    return _slots[i].index - 1;
             }
+            return npos();
+        }
 
-            pointer operator->() const {
-                assert(_current != _last);
-                return _current.operator->();
+        // Index of the entry for key and whether it was just appended with
+        // make_value() as its value.
+        template<typename K, typename MakeValue>
+        std::pair<std::size_t, bool> insert(K &&key, MakeValue make_value) {
+            if((_entries.size() + 1) * 4 > _slots.size() * 3)
+                rehash(std::max<std::size_t>(16U, _slots.size() * 2));
+
+            std::size_t hash = _hash(key);
+            std::size_t mask = _slots.size() - 1;
+            std::size_t i = home(hash);
+            for(; _slots[i].index != 0; i = (i + 1) & mask) {
+                if(_slots[i].hash == hash && _equal(_entries[_slots[i].index - 1].first, key))
+                    return std::make_pair(_slots[i].index - 1, false);
             }
-
-        private:
-			input_iterator _current;
-			input_iterator _last;
-            Generator _generator;
-        };
-
-        select_query(
-                const InputType &container,
-                const Generator &generator)
-				: _container(container), _generator(generator) {
+            _entries.push_back(entry_type(std::forward<K>(key), make_value()));
+            _slots[i].index = _entries.size();
+            _slots[i].hash = hash;
+            return std::make_pair(_entries.size() - 1, true);
         }
 
-        select_query(const select_query &other)
-				: _container(other._container), _generator(other._generator) {
+        entry_type &entry(std::size_t index) {
+            return _entries[index];
         }
 
-        ~select_query() {
+        const entry_type &entry(std::size_t index) const {
+            return _entries[index];
         }
 
-        select_query &operator=(const select_query &);
-
-        bool operator==(const select_query &) const;
-
-        bool operator!=(const select_query &) const;
-
-        iterator begin() const {
-			return iterator(_container.begin(), _container.end(), _generator);
+        entries_type &entries() {
+            return _entries;
         }
 
-        iterator end() const {
-			return iterator(_container.end(), _container.end(), _generator);
+        const entries_type &entries() const {
+            return _entries;
         }
 
-        void swap(select_query &other) {
-			std::swap(_container, other._container);
-            std::swap(_generator, other._generator);
-        }
+    private:
+        struct slot {
+            std::size_t index;  // entry index + 1, 0 when empty
+            std::size_t hash;
+        };
 
-        bool empty() const {
-            return _container.empty();
+        // Fibonacci hashing spreads weak hashes such as std::hash<int>
+        // over the top bits, which pick the home slot.
+        std::size_t home(std::size_t hash) const {
+            return static_cast<std::size_t>(
+                    (static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ULL) >> _shift);
         }
 
-        template<typename QueryBuilder>
-        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(const QueryBuilder& qb) const {
-            return qb.build(*this);
+        void rehash(std::size_t minimum) {
+            std::size_t count = 16U;
+            unsigned shift = 60;
+            while(count < minimum) {
+                count *= 2;
+                --shift;
+            }
+            if(count <= _slots.size())
+                return;
+
+            _slots.assign(count, slot());
+            _shift = shift;
+            std::size_t mask = count - 1;
+            for(std::size_t index = 0; index < _entries.size(); ++index) {
+                std::size_t hash = _hash(_entries[index].first);
+                std::size_t i = home(hash);
+                while(_slots[i].index != 0)
+                    i = (i + 1) & mask;
+                _slots[i].index = index + 1;
+                _slots[i].hash = hash;
+            }
         }
 
-    private:
-		InputType _container;
-        Generator _generator;
+        std::vector<slot, typename rebind_allocator<A, slot>::type> _slots;
+        unsigned _shift;
+        entries_type _entries;
+        Hash _hash;
+        KeyEqual _equal;
     };
 
 	/*************************************************************//**
-	 * select_query_builder
+	 * base_query
 	 ****************************************************************/
-    template<typename Generator>
-    class select_query_builder {
-    public:
-
-        typedef char output_type;
-
-        select_query_builder(const Generator& generator) : _generator(generator) {
-        }
-
-        template<typename Query>
-        select_query<Query, Generator>
-        build(const Query& query) const {
-			return select_query<
-                    Query, Generator>(query, _generator);
-        }
-    private:
-        Generator _generator;
-
+    class base_query
+    {
+    protected:
+        base_query() {}
+        base_query(const base_query &) {}
+        base_query(base_query&&) {}
+        ~base_query() {}
     };
 
 	/*************************************************************//**
-	 * sorting_query_builder
+	 * base_query_builder
 	 ****************************************************************/
-    class sorting_query_builder
+    class base_query_builder
     {
     protected:
-        sorting_query_builder() {}
-        sorting_query_builder(const sorting_query_builder &) {}
-        sorting_query_builder(sorting_query_builder&&) {}
-        ~sorting_query_builder() {}
+        base_query_builder() {}
+        base_query_builder(const base_query_builder &) {}
+        base_query_builder(base_query_builder&&) {}
+        ~base_query_builder() {}
     };
 
 
 	/*************************************************************//**
-	 * orderby_query
+	 * simple_query
 	 ****************************************************************/
-	template<typename InputType, typename Predicate, class A = std::allocator<typename InputType::value_type> >
-    class orderby_query {
+    template<typename InputIterator, class A = std::allocator<typename std::iterator_traits<InputIterator>::value_type> >
+    class simple_query {
     public:
         typedef A allocator_type;
         typedef typename A::value_type value_type;
-        typedef typename A::reference reference;
-        typedef typename A::const_reference const_reference;
-        typedef typename A::difference_type difference_type;
-        typedef typename A::size_type size_type;
-
-		typedef orderby_query<InputType, Predicate, A> this_type;
-		typedef typename InputType::iterator input_iterator;
-        typedef typename std::vector<value_type>::iterator output_iterator;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
 
+        typedef simple_query<InputIterator, A> this_type;
 
         class iterator {
         public:
             typedef typename A::value_type value_type;
-            typedef typename A::difference_type difference_type;
-            typedef typename A::reference reference;
-            typedef typename A::pointer pointer;
-            typedef std::input_iterator_tag iterator_category;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef typename value_reference<InputIterator, value_type>::type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<InputIterator>::type iterator_category;
 
-            iterator(const output_iterator& current)
-                    : _current(current)
-            {
+            iterator(const InputIterator& current)
+                    : _current(current) {
             }
 
             iterator(const iterator &other)
-                    : _current(other._current)
-            {
+                    : _current(other._current) {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                return *this;
             }
 
             bool operator==(const iterator &other) const {
@@ -631,277 +904,8997 @@ namespace query {
                 return *this;
             }
 
-            value_type operator*() const {
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return _current - other._current;
+            }
+
+            reference operator[](difference_type n) const {
+                return _current[n];
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            reference operator*() const {
                 return *_current;
             }
 
             pointer operator->() const {
-                return _current.operator->();
+                return &*_current;
+            }
+
+            const InputIterator &base() const {
+                return _current;
             }
 
         private:
-            output_iterator _current;
+            InputIterator _current;
         };
 
-        orderby_query(
-                const InputType &container,
-                const Predicate &pred,
-                bool sort_ascending)
-				: _container(container)
-                , _pred(pred)
-                , _sort_ascending(sort_ascending)
-                , _sorted_values()
-                , _initialized(false)
-        {
+        class batch_cursor {
+        public:
+            batch_cursor(const InputIterator &first, const InputIterator &last)
+                    : _current(first)
+                    , _last(last)
+            {
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                return next_batch(out, capacity, typename iterator_category_of<InputIterator>::type());
+            }
+
+        private:
+            std::size_t next_batch(value_type *out, std::size_t capacity, std::random_access_iterator_tag) {
+                std::size_t count = std::min(capacity, static_cast<std::size_t>(_last - _current));
+                std::copy(_current, _current + count, out);
+                _current += count;
+                return count;
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity, std::input_iterator_tag) {
+                std::size_t count = 0;
+                for(; count < capacity && _current != _last; ++_current)
+                    out[count++] = *_current;
+                return count;
+            }
+
+            InputIterator _current;
+            InputIterator _last;
+        };
+
+        simple_query(
+                const InputIterator &first,
+                const InputIterator &last)
+                : _first(first), _last(last) {
         }
 
-        orderby_query(const orderby_query &other)
-				: _container(other._container)
-                , _pred(other._pred)
-                , _sort_ascending(other._sort_ascending)
-                , _sorted_values(other._sorted_values)
-                , _initialized(other._initialized)
-        {
+        simple_query(const simple_query &other)
+                : _first(other._first), _last(other._last) {
         }
 
-        ~orderby_query()
-        {
+        simple_query(simple_query &&other)
+                : _first(std::move(other._first)), _last(std::move(other._last)) {
         }
 
-        orderby_query &operator=(const orderby_query &);
+        ~simple_query() {
+        }
 
-        bool operator==(const orderby_query &) const;
+        simple_query &operator=(const simple_query &);
 
-        bool operator!=(const orderby_query &) const;
+        bool operator==(const simple_query &) const;
+
+        bool operator!=(const simple_query &) const;
 
         iterator begin() const {
-            if(!_initialized)
-                initialize();
-            return iterator(_sorted_values.begin());
+            return iterator(_first);
         }
 
         iterator end() const {
-            if(!_initialized)
-                initialize();
-            return iterator(_sorted_values.end());
+            return iterator(_last);
         }
 
-        void swap(orderby_query &other) {
-			std::swap(_container, other._container);
-            std::swap(_pred, other._pred);
-            std::swap(_sort_ascending, other._sort_ascending);
-            std::swap(_sorted_values, other._sorted_values);
-            std::swap(_initialized, other._initialized);
+        batch_cursor batches() const {
+            return batch_cursor(_first, _last);
+        }
+
+        void swap(simple_query &other) {
+            std::swap(_first, other._first);
+            std::swap(_last, other._last);
         }
 
         bool empty() const {
-            return _container.emtpy();
+            return _first == _last;
+        }
+
+        size_type size() const {
+            return static_cast<size_type>(std::distance(_first, _last));
+        }
+
+        value_type operator[](size_type n) const {
+            return _first[n];
+        }
+
+        size_bounds size_hint() const {
+            return hint(typename iterator_category_of<InputIterator>::type());
+        }
+
+        size_type source_size() const {
+            return static_cast<size_type>(std::distance(_first, _last));
+        }
+
+        const InputIterator &source_begin() const {
+            return _first;
+        }
+
+        const InputIterator &source_end() const {
+            return _last;
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            InputIterator begin = _first;
+            std::advance(begin, first);
+            InputIterator end = begin;
+            std::advance(end, last - first);
+            return this_type(begin, end);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
         }
 
         template<typename QueryBuilder>
-        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(const QueryBuilder& qb) const {
-            return qb.build(*this);
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
         }
 
     private:
-        bool compare_ascending(const value_type & lhs, const value_type & rhs) const
-        {
-            return _pred(lhs, rhs);
+        size_bounds hint(std::random_access_iterator_tag) const {
+            return size_bounds::exact(size());
         }
 
-        bool compare_descending(const value_type & lhs, const value_type & rhs) const
-        {
-            return _pred(rhs, lhs);
+        size_bounds hint(std::input_iterator_tag) const {
+            return empty() ? size_bounds::exact(0) : size_bounds::between(1, size_bounds::unbounded());
         }
 
-        void initialize() const
-        {
-            _initialized = true;
-            _sorted_values.clear();
-            if(_container.empty())
-                return;
+        InputIterator _first;
+        InputIterator _last;
+    };
 
-            _sorted_values.reserve(16U);
-            _sorted_values.insert(_sorted_values.end(), _container.begin(), _container.end());
-            if(_sort_ascending) {
-                std::sort(
-                        _sorted_values.begin(),
-                        _sorted_values.end(),
-                        [this](const value_type &lhs, const value_type &rhs) {
-                            return this->compare_ascending(lhs, rhs);
-                        });
-            } else {
-                std::sort(
-                        _sorted_values.begin(),
-                        _sorted_values.end(),
-                        [this](const value_type &lhs, const value_type &rhs) {
-                            return this->compare_descending(lhs, rhs);
-                        });
-            }
-        }
+    template<typename InputIterator, class A>
+    struct is_partitionable<simple_query<InputIterator, A> >
+            : std::is_base_of<std::random_access_iterator_tag,
+                              typename std::iterator_traits<InputIterator>::iterator_category>
+    {
+    };
 
-        InputType _container;
-        Predicate _pred;
-        bool _sort_ascending;
-        mutable std::vector<value_type> _sorted_values;
-        mutable bool _initialized;
+    template<typename InputIterator, class A>
+    struct is_position_aligned<simple_query<InputIterator, A> > : std::true_type
+    {
+    };
+
+    template<typename InputIterator, class A>
+    struct native_batches<simple_query<InputIterator, A> > : std::true_type
+    {
     };
 
 	/*************************************************************//**
-	 * orderby_query_builder
+	 * simple_query_builder
 	 ****************************************************************/
-    template<typename Predicate>
-    class orderby_query_builder : public sorting_query_builder {
+    class simple_query_builder {
     public:
-        orderby_query_builder(const Predicate& pred, bool sort_ascending)
-                : _pred(pred)
-                , _sort_ascending(sort_ascending)
-        {
-        }
 
         template<typename Query>
-        orderby_query<Query, Predicate> build(const Query& query) const {
-            return orderby_query<Query, Predicate>(query, _pred, _sort_ascending);
+        simple_query<typename Query::iterator> build(const Query& query) const {
+            return simple_query<typename Query::iterator>(query.begin(), query.end());
 
         }
-    private:
-        Predicate _pred;
-        bool _sort_ascending;
     };
 
 
 	/*************************************************************//**
-	 * zip_with_query
+	 * contiguous_source
+	 *
+	 * Lifted ranges of arithmetic values in contiguous storage. The
+	 * scalar aggregates below run over them as raw pointers, in
+	 * unrolled loops with independent accumulators the compiler can
+	 * keep in vector registers.
 	 ****************************************************************/
-    template<typename InputType, typename OtherInputType,
-		class A = std::allocator<std::pair<typename InputType::value_type, typename OtherInputType::value_type > > >
-    class zip_with_query {
-    public:
-        typedef A allocator_type;
-        typedef typename A::value_type value_type;
-        typedef typename A::reference reference;
-        typedef typename A::const_reference const_reference;
-        typedef typename A::difference_type difference_type;
-        typedef typename A::size_type size_type;
+    template<typename Query>
+    struct contiguous_source : std::false_type
+    {
+    };
 
-        typedef zip_with_query<InputType, OtherInputType, A> this_type;
-		typedef typename InputType::iterator input_iterator;
-		typedef typename OtherInputType::iterator other_input_iterator;
+    template<typename InputIterator, class A>
+    struct contiguous_source<simple_query<InputIterator, A> >
+            : std::integral_constant<bool,
+                    is_contiguous_iterator<InputIterator>::value &&
+                    std::is_arithmetic<typename std::iterator_traits<InputIterator>::value_type>::value>
+    {
+    };
 
-        class iterator {
-        public:
-            typedef typename A::value_type value_type;
-            typedef typename A::difference_type difference_type;
-            typedef typename A::reference reference;
-            typedef typename A::pointer pointer;
-            typedef std::input_iterator_tag iterator_category;
+    template<typename InputIterator, class A>
+    std::pair<const typename std::iterator_traits<InputIterator>::value_type*,
+              const typename std::iterator_traits<InputIterator>::value_type*>
+    contiguous_range(const simple_query<InputIterator, A> &query)
+    {
+        typedef const typename std::iterator_traits<InputIterator>::value_type* pointer;
+        if(query.empty())
+            return std::pair<pointer, pointer>(pointer(), pointer());
+        pointer first = std::addressof(*query.source_begin());
+        return std::pair<pointer, pointer>(first, first + (query.source_end() - query.source_begin()));
+    }
 
-			iterator(const input_iterator& current,
-					const other_input_iterator& other_current)
-                    : _current(current)
-                    , _other_current(other_current)
-            {
-            }
+	/*************************************************************//**
+	 * char predicates
+	 *
+	 * Character classes usable as ordinary where() predicates. Besides
+	 * operator() each one can match a whole SSE2 or AVX2 block, which
+	 * where_query and the sinks use to scan contiguous char sources.
+	 ****************************************************************/
+    struct char_predicate
+    {
+    };
 
-            iterator(const iterator &other)
-                    : _current(other._current)
-                    , _other_current(other._other_current)
-            {
-            }
+    template<typename Predicate>
+    struct is_char_predicate : std::is_base_of<char_predicate, Predicate>
+    {
+    };
 
-            bool operator==(const iterator &other) const {
-                return _current == other._current ||
-                       _other_current == other._other_current;
-            }
+    class char_equal_predicate : public char_predicate {
+    public:
+        explicit char_equal_predicate(char c)
+                : _c(c)
+        {
+        }
 
-            bool operator!=(const iterator &other) const {
-                return _current != other._current &&
-                       _other_current != other._other_current;
-            }
+        bool operator()(char c) const {
+            return c == _c;
+        }
 
-            iterator &operator++() {
-                ++_current;
-                ++_other_current;
-                return *this;
-            }
+#ifdef QUERY_SIMD_SSE2
+        __m128i match(__m128i block) const {
+            return _mm_cmpeq_epi8(block, _mm_set1_epi8(_c));
+        }
+#endif
 
-            value_type operator*() const {
-                return std::make_pair(*_current, *_other_current);
-            }
+#ifdef QUERY_SIMD_AVX2
+        __attribute__((target("avx2"))) __m256i match(__m256i block) const {
+            return _mm256_cmpeq_epi8(block, _mm256_set1_epi8(_c));
+        }
+#endif
 
-        private:
-            input_iterator _current;
-			other_input_iterator _other_current;
-        };
+    private:
+        char _c;
+    };
 
-        zip_with_query(
-                const InputType &container,
-                const OtherInputType &otherContainer)
-                : _container(container)
-                , _otherContainer(otherContainer)
+    // Matches lo <= c <= hi, comparing as unsigned char.
+    class char_in_range_predicate : public char_predicate {
+    public:
+        char_in_range_predicate(char lo, char hi)
+                : _lo(lo)
+                , _width(static_cast<char>(static_cast<unsigned char>(hi) - static_cast<unsigned char>(lo)))
         {
         }
 
-        zip_with_query(const zip_with_query &other)
-				: _container(other._container)
-				, _otherContainer(other._otherContainer)
+        bool operator()(char c) const {
+            return static_cast<unsigned char>(c - _lo) <= static_cast<unsigned char>(_width);
+        }
+
+#ifdef QUERY_SIMD_SSE2
+        __m128i match(__m128i block) const {
+            __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8(_lo));
+            return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(_width)), offset);
+        }
+#endif
+
+#ifdef QUERY_SIMD_AVX2
+        __attribute__((target("avx2"))) __m256i match(__m256i block) const {
+            __m256i offset = _mm256_sub_epi8(block, _mm256_set1_epi8(_lo));
+            return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(_width)), offset);
+        }
+#endif
+
+    private:
+        char _lo;
+        char _width;
+    };
+
+    class char_any_of_predicate : public char_predicate {
+    public:
+        explicit char_any_of_predicate(const std::string &chars)
+                : _chars(chars)
         {
+            std::fill(_bits, _bits + 8, 0);
+            for(std::size_t i = 0; i < chars.size(); ++i) {
+                unsigned char c = static_cast<unsigned char>(chars[i]);
+                _bits[c >> 5] |= std::uint32_t(1) << (c & 31);
+            }
         }
 
-        ~zip_with_query() {
+        bool operator()(char c) const {
+            unsigned char u = static_cast<unsigned char>(c);
+            return (_bits[u >> 5] >> (u & 31)) & 1;
         }
 
-        zip_with_query &operator=(const zip_with_query &);
+#ifdef QUERY_SIMD_SSE2
+        __m128i match(__m128i block) const {
+            __m128i result = _mm_setzero_si128();
+            for(std::size_t i = 0; i < _chars.size(); ++i)
+                result = _mm_or_si128(result, _mm_cmpeq_epi8(block, _mm_set1_epi8(_chars[i])));
+            return result;
+        }
+#endif
+
+#ifdef QUERY_SIMD_AVX2
+        __attribute__((target("avx2"))) __m256i match(__m256i block) const {
+            __m256i result = _mm256_setzero_si256();
+            for(std::size_t i = 0; i < _chars.size(); ++i)
+                result = _mm256_or_si256(result, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(_chars[i])));
+            return result;
+        }
+#endif
 
-        bool operator==(const zip_with_query &) const;
+    private:
+        std::string _chars;
+        std::uint32_t _bits[8];
+    };
 
-        bool operator!=(const zip_with_query &) const;
+    template<typename Predicate>
+    class char_not_predicate : public char_predicate {
+    public:
+        explicit char_not_predicate(const Predicate &pred)
+                : _pred(pred)
+        {
+        }
+
+        bool operator()(char c) const {
+            return !_pred(c);
+        }
+
+#ifdef QUERY_SIMD_SSE2
+        __m128i match(__m128i block) const {
+            return _mm_cmpeq_epi8(_pred.match(block), _mm_setzero_si128());
+        }
+#endif
+
+#ifdef QUERY_SIMD_AVX2
+        __attribute__((target("avx2"))) __m256i match(__m256i block) const {
+            return _mm256_cmpeq_epi8(_pred.match(block), _mm256_setzero_si256());
+        }
+#endif
+
+    private:
+        Predicate _pred;
+    };
+
+	/*************************************************************//**
+	 * char kernels
+	 *
+	 * find_first() and copy_matching() over [first, last) with a char
+	 * predicate: AVX2 when the CPU has it, else SSE2, with scalar
+	 * loops for the tail and for builds without either.
+	 ****************************************************************/
+    inline unsigned lowest_bit(unsigned mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+    }
+
+#ifdef QUERY_SIMD_AVX2
+    inline bool cpu_has_avx2()
+    {
+        static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+        return avx2;
+    }
+
+    template<typename Predicate>
+    __attribute__((target("avx2")))
+    const char *find_first_avx2(const char *first, const char *last, const Predicate &pred)
+    {
+        for(; last - first >= 32; first += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+            unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(pred.match(block)));
+            if(mask != 0)
+                return first + lowest_bit(mask);
+        }
+        return first;
+    }
+
+    template<typename Predicate>
+    __attribute__((target("avx2")))
+    char *copy_matching_avx2(const char *&first, const char *last, char *out, const Predicate &pred)
+    {
+        for(; last - first >= 32; first += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+            unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(pred.match(block)));
+            if(mask == 0xFFFFFFFFu) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), block);
+                out += 32;
+                continue;
+            }
+            for(; mask != 0; mask &= mask - 1)
+                *out++ = first[lowest_bit(mask)];
+        }
+        return out;
+    }
+#endif
+
+    // First position in [first, last) matching pred, or last.
+    template<typename Predicate>
+    const char *find_first(const char *first, const char *last, const Predicate &pred)
+    {
+#ifdef QUERY_SIMD_AVX2
+        if(last - first >= 32 && cpu_has_avx2()) {
+            first = find_first_avx2(first, last, pred);
+            if(last - first >= 32)
+                return first;
+        }
+#endif
+#ifdef QUERY_SIMD_SSE2
+        for(; last - first >= 16; first += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(pred.match(block)));
+            if(mask != 0)
+                return first + lowest_bit(mask);
+        }
+#endif
+        for(; first != last; ++first)
+            if(pred(*first))
+                break;
+        return first;
+    }
+
+    // Writes the matching chars of [first, last) to out, which must have
+    // room for last - first chars, and returns the end of the output.
+    template<typename Predicate>
+    char *copy_matching(const char *first, const char *last, char *out, const Predicate &pred)
+    {
+#ifdef QUERY_SIMD_AVX2
+        if(last - first >= 32 && cpu_has_avx2())
+            out = copy_matching_avx2(first, last, out, pred);
+#endif
+#ifdef QUERY_SIMD_SSE2
+        for(; last - first >= 16; first += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(pred.match(block)));
+            if(mask == 0xFFFFu) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), block);
+                out += 16;
+                continue;
+            }
+            for(; mask != 0; mask &= mask - 1)
+                *out++ = first[lowest_bit(mask)];
+        }
+#endif
+        for(; first != last; ++first) {
+            *out = *first;
+            out += static_cast<bool>(pred(*first));
+        }
+        return out;
+    }
+
+	/*************************************************************//**
+	 * char_scan
+	 *
+	 * True when a where() over Query with Predicate can use the char
+	 * kernels: a lifted contiguous range of a char type filtered by a
+	 * char predicate.
+	 ****************************************************************/
+    template<typename Query, typename Predicate>
+    struct char_scan : std::integral_constant<bool,
+            contiguous_source<Query>::value &&
+            is_char_predicate<Predicate>::value &&
+            std::is_integral<typename Query::value_type>::value &&
+            sizeof(typename Query::value_type) == 1>
+    {
+    };
+
+	/*************************************************************//**
+	 * int_query
+	 *
+	 * begin, begin + 1, ... up to but excluding end; empty when end is
+	 * not past begin.
+	 ****************************************************************/
+    class int_query {
+    public:
+        typedef std::allocator<int> A;
+        typedef A allocator_type;
+		typedef CMAKE_TYPENAME A::value_type value_type;
+		typedef value_type &reference;
+		typedef const value_type &const_reference;
+		typedef CMAKE_TYPENAME A::difference_type difference_type;
+		typedef CMAKE_TYPENAME A::size_type size_type;
+
+        typedef int_query this_type;
+
+        class iterator {
+        public:
+			typedef CMAKE_TYPENAME A::value_type value_type;
+			typedef CMAKE_TYPENAME A::difference_type difference_type;
+			typedef value_type reference;
+			typedef CMAKE_TYPENAME std::allocator_traits<A>::pointer pointer;
+            typedef std::random_access_iterator_tag iterator_category;
+
+            iterator(int current)
+                    : _current(current) {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current) {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += static_cast<int>(n);
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= static_cast<int>(n);
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            // Signed; exact for any two ints where difference_type is
+            // wider than int, as on 64-bit targets.
+            difference_type operator-(const iterator &other) const {
+                return difference_type(_current) - difference_type(other._current);
+            }
+
+            value_type operator[](difference_type n) const {
+                return _current + static_cast<int>(n);
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            value_type operator*() const {
+                return _current;
+            }
+
+            pointer operator->() const {
+                assert(false);
+                return 0;
+            }
+
+        private:
+            int _current;
+        };
+
+        class batch_cursor {
+        public:
+            batch_cursor(int begin, int end)
+                    : _current(static_cast<unsigned>(begin))
+                    , _last(static_cast<unsigned>(end))
+            {
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                std::size_t count = std::min<std::size_t>(capacity, _last - _current);
+                for(std::size_t i = 0; i < count; ++i)
+                    out[i] = static_cast<int>(_current + static_cast<unsigned>(i));
+                _current += static_cast<unsigned>(count);
+                return count;
+            }
+
+        private:
+            unsigned _current;
+            unsigned _last;
+        };
+
+        int_query(int begin, int end)
+                : _begin(begin)
+                , _end(end < begin ? begin : end)
+        {
+        }
+
+        int_query(const int_query &other)
+                : _begin(other._begin)
+                , _end(other._end) {
+        }
+
+        int_query(int_query &&other)
+                : _begin(other._begin)
+                , _end(other._end) {
+        }
+
+        ~int_query() {
+        }
+
+        int_query &operator=(const int_query &);
+
+        bool operator==(const int_query &) const;
+
+        bool operator!=(const int_query &) const;
+
+        iterator begin() const {
+            return iterator(_begin);
+        }
+
+        iterator end() const {
+            return iterator(_end);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_begin, _end);
+        }
+
+        void swap(int_query &other) {
+            std::swap(_begin, other._begin);
+            std::swap(_end, other._end);
+        }
+
+        bool empty() const {
+            return _begin == _end;
+        }
+
+        // _end never precedes _begin, so the unsigned difference is exact.
+        size_type size() const {
+            return static_cast<unsigned>(_end) - static_cast<unsigned>(_begin);
+        }
+
+        value_type operator[](size_type n) const {
+            return static_cast<int>(static_cast<unsigned>(_begin) + static_cast<unsigned>(n));
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::exact(size());
+        }
+
+        size_type source_size() const {
+            return static_cast<unsigned>(_end) - static_cast<unsigned>(_begin);
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(
+                    static_cast<int>(static_cast<unsigned>(_begin) + static_cast<unsigned>(first)),
+                    static_cast<int>(static_cast<unsigned>(_begin) + static_cast<unsigned>(last)));
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        int _begin;
+        int _end;
+    };
+
+    template<>
+    struct is_partitionable<int_query> : std::true_type
+    {
+    };
+
+    template<>
+    struct is_position_aligned<int_query> : std::true_type
+    {
+    };
+
+    template<>
+    struct native_batches<int_query> : std::true_type
+    {
+    };
+
+	/*************************************************************//**
+	 * range_arithmetic
+	 *
+	 * The n-th value of a range and the number of steps from first to
+	 * before last. Integers are stepped in unsigned arithmetic, so a
+	 * range may cross zero or wrap without overflow; floating point
+	 * values are computed from the index rather than accumulated.
+	 ****************************************************************/
+    template<typename T, typename Enable = void>
+    struct range_arithmetic
+    {
+        static T at(T first, T step, std::size_t n) {
+            return first + step * static_cast<T>(n);
+        }
+
+        static std::size_t count(T first, T last, T step) {
+            T steps = std::ceil((last - first) / step);
+            if(!(steps > 0))
+                return 0;
+            std::size_t most = static_cast<std::size_t>(std::numeric_limits<std::ptrdiff_t>::max());
+            return steps < static_cast<T>(most) ? static_cast<std::size_t>(steps) : most;
+        }
+    };
+
+    template<typename T>
+    struct range_arithmetic<T, typename std::enable_if<std::is_integral<T>::value>::type>
+    {
+        typedef typename std::conditional<(sizeof(T) < sizeof(unsigned)),
+                unsigned, typename std::make_unsigned<T>::type>::type unsigned_type;
+
+        static T at(T first, T step, std::size_t n) {
+            return static_cast<T>(static_cast<unsigned_type>(first) +
+                                  static_cast<unsigned_type>(step) * static_cast<unsigned_type>(n));
+        }
+
+        static std::size_t count(T first, T last, T step) {
+            if(step > 0 ? !(first < last) : !(last < first))
+                return 0;
+            unsigned_type distance = step > 0
+                    ? static_cast<unsigned_type>(last) - static_cast<unsigned_type>(first)
+                    : static_cast<unsigned_type>(first) - static_cast<unsigned_type>(last);
+            unsigned_type stride = step > 0
+                    ? static_cast<unsigned_type>(step)
+                    : static_cast<unsigned_type>(0) - static_cast<unsigned_type>(step);
+            return static_cast<std::size_t>(distance / stride + (distance % stride != 0));
+        }
+    };
+
+	/*************************************************************//**
+	 * range_query
+	 *
+	 * first, first + step, first + 2 * step, ... for count values, of
+	 * any integral or floating point T. Every value is computed from its
+	 * index, so iterators are random access and size() is O(1). An
+	 * infinite range has infinite_count() values: its end is an index
+	 * no loop reaches, rather than a value the range could wrap around
+	 * to, and its size_hint() is unbounded.
+	 ****************************************************************/
+    template<typename T>
+    class range_query {
+    public:
+        static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value,
+                      "range_query needs an integral or floating point type");
+
+        typedef std::allocator<T> A;
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+        typedef range_query<T> this_type;
+        typedef range_arithmetic<T> arithmetic;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::random_access_iterator_tag iterator_category;
+
+            iterator(T first, T step, size_type index)
+                    : _first(first)
+                    , _step(step)
+                    , _index(index) {
+            }
+
+            iterator(const iterator &other)
+                    : _first(other._first)
+                    , _step(other._step)
+                    , _index(other._index) {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _first = other._first;
+                _step = other._step;
+                _index = other._index;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _index == other._index;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _index != other._index;
+            }
+
+            iterator &operator++() {
+                ++_index;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_index;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _index += static_cast<size_type>(n);
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _index -= static_cast<size_type>(n);
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return static_cast<difference_type>(_index - other._index);
+            }
+
+            value_type operator[](difference_type n) const {
+                return arithmetic::at(_first, _step, _index + static_cast<size_type>(n));
+            }
+
+            bool operator<(const iterator &other) const {
+                return _index < other._index;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            value_type operator*() const {
+                return arithmetic::at(_first, _step, _index);
+            }
+
+            pointer operator->() const {
+                assert(false);
+                return 0;
+            }
+
+        private:
+            T _first;
+            T _step;
+            size_type _index;
+        };
+
+        class batch_cursor {
+        public:
+            batch_cursor(T first, T step, size_type count)
+                    : _first(first)
+                    , _step(step)
+                    , _current(0)
+                    , _last(count)
+            {
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                std::size_t count = std::min<std::size_t>(capacity, _last - _current);
+                for(std::size_t i = 0; i < count; ++i)
+                    out[i] = arithmetic::at(_first, _step, _current + i);
+                _current += count;
+                return count;
+            }
+
+        private:
+            T _first;
+            T _step;
+            size_type _current;
+            size_type _last;
+        };
+
+        // count values from first on; infinite_count() for an infinite
+        // range.
+        range_query(T first, T step, size_type count)
+                : _first(first)
+                , _step(step)
+                , _count(count)
+        {
+        }
+
+        range_query(const range_query &other)
+                : _first(other._first)
+                , _step(other._step)
+                , _count(other._count) {
+        }
+
+        range_query(range_query &&other)
+                : _first(other._first)
+                , _step(other._step)
+                , _count(other._count) {
+        }
+
+        ~range_query() {
+        }
+
+        range_query &operator=(const range_query &);
+
+        bool operator==(const range_query &) const;
+
+        bool operator!=(const range_query &) const;
+
+        iterator begin() const {
+            return iterator(_first, _step, 0);
+        }
+
+        iterator end() const {
+            return iterator(_first, _step, _count);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_first, _step, _count);
+        }
+
+        void swap(range_query &other) {
+            std::swap(_first, other._first);
+            std::swap(_step, other._step);
+            std::swap(_count, other._count);
+        }
+
+        bool empty() const {
+            return _count == 0;
+        }
+
+        // Largest count whose distance still fits a difference_type.
+        static size_type infinite_count() {
+            return static_cast<size_type>(std::numeric_limits<difference_type>::max());
+        }
+
+        bool infinite() const {
+            return _count == infinite_count();
+        }
+
+        size_type size() const {
+            return _count;
+        }
+
+        value_type operator[](size_type n) const {
+            return arithmetic::at(_first, _step, n);
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::exact(infinite() ? size_bounds::unbounded() : _count);
+        }
+
+        size_type source_size() const {
+            return _count;
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(arithmetic::at(_first, _step, first), _step, last - first);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        T _first;
+        T _step;
+        size_type _count;
+    };
+
+    template<typename T>
+    struct is_partitionable<range_query<T> > : std::true_type
+    {
+    };
+
+    template<typename T>
+    struct is_position_aligned<range_query<T> > : std::true_type
+    {
+    };
+
+    template<typename T>
+    struct native_batches<range_query<T> > : std::true_type
+    {
+    };
+
+
+	/*************************************************************//**
+	 * mapped_file
+	 *
+	 * Read-only memory mapping of a whole file (mmap, or
+	 * CreateFileMapping on Windows). Throws std::system_error when the
+	 * file cannot be opened or mapped. An empty file maps to no data.
+	 ****************************************************************/
+    class mapped_file {
+    public:
+        explicit mapped_file(const std::string &path)
+                : _data(0), _size(0)
+        {
+#if defined(_WIN32)
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                                      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+            if(file == INVALID_HANDLE_VALUE)
+                fail("query: cannot open " + path);
+
+            LARGE_INTEGER size;
+            if(!GetFileSizeEx(file, &size)) {
+                CloseHandle(file);
+                fail("query: cannot stat " + path);
+            }
+            _size = static_cast<std::size_t>(size.QuadPart);
+            if(_size == 0) {
+                CloseHandle(file);
+                return;
+            }
+
+            HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+            CloseHandle(file);
+            if(mapping == 0)
+                fail("query: cannot map " + path);
+            _data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+            if(_data == 0)
+                fail("query: cannot map " + path);
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+                fail("query: cannot open " + path);
+
+            struct stat info;
+            if(::fstat(fd, &info) != 0) {
+                int error = errno;
+                ::close(fd);
+                fail(error, "query: cannot stat " + path);
+            }
+            _size = static_cast<std::size_t>(info.st_size);
+            if(_size == 0) {
+                ::close(fd);
+                return;
+            }
+
+            void *data = ::mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            int error = errno;
+            ::close(fd);
+            if(data == MAP_FAILED)
+                fail(error, "query: cannot map " + path);
+            _data = static_cast<const char*>(data);
+#ifdef MADV_SEQUENTIAL
+            ::madvise(data, _size, MADV_SEQUENTIAL);
+#endif
+#endif
+        }
+
+        ~mapped_file()
+        {
+            if(_data == 0)
+                return;
+#if defined(_WIN32)
+            UnmapViewOfFile(_data);
+#else
+            ::munmap(const_cast<char*>(_data), _size);
+#endif
+        }
+
+        const char *data() const {
+            return _data;
+        }
+
+        std::size_t size() const {
+            return _size;
+        }
+
+    private:
+        mapped_file(const mapped_file &);
+
+        mapped_file &operator=(const mapped_file &);
+
+#if defined(_WIN32)
+        static void fail(const std::string &what) {
+            throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), what);
+        }
+#else
+        static void fail(const std::string &what) {
+            fail(errno, what);
+        }
+
+        static void fail(int error, const std::string &what) {
+            throw std::system_error(error, std::generic_category(), what);
+        }
+#endif
+
+        const char *_data;
+        std::size_t _size;
+    };
+
+	/*************************************************************//**
+	 * file_query
+	 *
+	 * The chars of a memory-mapped file. Copies share the mapping,
+	 * which is released with the last query built on it. Behaves like
+	 * a lifted char range, so the char kernels, batches and parallel
+	 * slicing all apply.
+	 ****************************************************************/
+    class file_query {
+    public:
+        typedef simple_query<const char*> range_type;
+        typedef range_type::iterator iterator;
+        typedef range_type::batch_cursor batch_cursor;
+
+        typedef range_type::allocator_type allocator_type;
+        typedef range_type::value_type value_type;
+        typedef range_type::reference reference;
+        typedef range_type::const_reference const_reference;
+        typedef range_type::difference_type difference_type;
+        typedef range_type::size_type size_type;
+
+        typedef file_query this_type;
+
+        explicit file_query(const std::string &path)
+                : _file(std::make_shared<mapped_file>(path))
+                , _first(_file->data())
+                , _last(_file->data() + _file->size())
+        {
+        }
+
+        file_query(const file_query &other)
+                : _file(other._file), _first(other._first), _last(other._last)
+        {
+        }
+
+        file_query(file_query &&other)
+                : _file(std::move(other._file)), _first(other._first), _last(other._last)
+        {
+        }
+
+        ~file_query()
+        {
+        }
+
+        file_query &operator=(const file_query &);
+
+        bool operator==(const file_query &) const;
+
+        bool operator!=(const file_query &) const;
+
+        iterator begin() const {
+            return iterator(_first);
+        }
+
+        iterator end() const {
+            return iterator(_last);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_first, _last);
+        }
+
+        void swap(file_query &other) {
+            std::swap(_file, other._file);
+            std::swap(_first, other._first);
+            std::swap(_last, other._last);
+        }
+
+        bool empty() const {
+            return _first == _last;
+        }
+
+        size_type size() const {
+            return static_cast<size_type>(_last - _first);
+        }
+
+        value_type operator[](size_type n) const {
+            return _first[n];
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::exact(size());
+        }
+
+        size_type source_size() const {
+            return size();
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(_file, _first + first, _first + last);
+        }
+
+        const char *const &source_begin() const {
+            return _first;
+        }
+
+        const char *const &source_end() const {
+            return _last;
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        file_query(const std::shared_ptr<const mapped_file> &file, const char *first, const char *last)
+                : _file(file), _first(first), _last(last)
+        {
+        }
+
+        std::shared_ptr<const mapped_file> _file;
+        const char *_first;
+        const char *_last;
+    };
+
+    template<>
+    struct is_partitionable<file_query> : std::true_type
+    {
+    };
+
+    template<>
+    struct is_position_aligned<file_query> : std::true_type
+    {
+    };
+
+    template<>
+    struct native_batches<file_query> : std::true_type
+    {
+    };
+
+    template<>
+    struct contiguous_source<file_query> : std::true_type
+    {
+    };
+
+    inline std::pair<const char*, const char*> contiguous_range(const file_query &query)
+    {
+        return std::pair<const char*, const char*>(query.source_begin(), query.source_end());
+    }
+
+	/*************************************************************//**
+	 * delimited_query
+	 *
+	 * Splits a contiguous char query into string_ref records at each
+	 * delimiter, as std::getline does: the delimiter is not part of a
+	 * record and a trailing delimiter does not start an empty one.
+	 ****************************************************************/
+	template<typename InputType>
+    class delimited_query {
+    public:
+        static_assert(contiguous_source<InputType>::value && sizeof(typename InputType::value_type) == 1,
+                      "delimited_query needs a contiguous char source");
+
+        typedef std::allocator<string_ref> A;
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef delimited_query<InputType> this_type;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::forward_iterator_tag iterator_category;
+
+			iterator(const char *current, const char *last, char delim)
+                    : _current(current)
+                    , _record_last(current)
+                    , _last(last)
+                    , _delim(delim)
+            {
+                find_record_last();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _record_last(other._record_last)
+                    , _last(other._last)
+                    , _delim(other._delim)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _record_last = other._record_last;
+                _last = other._last;
+                _delim = other._delim;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                _current = _record_last == _last ? _last : _record_last + 1;
+                find_record_last();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            value_type operator*() const {
+                assert(_current != _last);
+                return string_ref(_current, static_cast<std::size_t>(_record_last - _current));
+            }
+
+        private:
+            void find_record_last() {
+                if(_current == _last)
+                    return;
+                const void *found = std::memchr(_current, _delim, static_cast<std::size_t>(_last - _current));
+                _record_last = found ? static_cast<const char*>(found) : _last;
+            }
+
+            const char *_current;
+            const char *_record_last;
+            const char *_last;
+            char _delim;
+        };
+
+        template<typename Input>
+        delimited_query(Input &&container, char delim)
+				: _container(std::forward<Input>(container)), _delim(delim) {
+        }
+
+        delimited_query(const delimited_query &other)
+				: _container(other._container), _delim(other._delim) {
+        }
+
+        delimited_query(delimited_query &&other)
+				: _container(std::move(other._container)), _delim(other._delim) {
+        }
+
+        ~delimited_query() {
+        }
+
+        delimited_query &operator=(const delimited_query &);
+
+        bool operator==(const delimited_query &) const;
+
+        bool operator!=(const delimited_query &) const;
+
+        iterator begin() const {
+            std::pair<const char*, const char*> range = chars();
+			return iterator(range.first, range.second, _delim);
+        }
+
+        iterator end() const {
+            std::pair<const char*, const char*> range = chars();
+			return iterator(range.second, range.second, _delim);
+        }
+
+        void swap(delimited_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_delim, other._delim);
+        }
+
+        bool empty() const {
+			return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            return empty() ? size_bounds::exact(0) : size_bounds::between(1, _container.size());
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        std::pair<const char*, const char*> chars() const {
+            std::pair<const typename InputType::value_type*, const typename InputType::value_type*> range =
+                    contiguous_range(_container);
+            return std::pair<const char*, const char*>(reinterpret_cast<const char*>(range.first),
+                                                       reinterpret_cast<const char*>(range.second));
+        }
+
+        InputType _container;
+        char _delim;
+    };
+
+	/*************************************************************//**
+	 * split_query_builder
+	 ****************************************************************/
+    class split_query_builder {
+    public:
+        explicit split_query_builder(char delim)
+                : _delim(delim)
+        {
+        }
+
+        template<typename Query>
+        delimited_query<typename std::decay<Query>::type> build(Query&& query) const {
+            return delimited_query<typename std::decay<Query>::type>(std::forward<Query>(query), _delim);
+        }
+
+    private:
+        char _delim;
+    };
+
+	/*************************************************************//**
+	 * token_query
+	 *
+	 * The maximal runs of a contiguous char query that contain no
+	 * separator, as string_refs, so empty tokens are never produced.
+	 * Separators are a char predicate and both ends of a token are
+	 * found with the char kernels.
+	 ****************************************************************/
+	template<typename InputType, typename Predicate>
+    class token_query {
+    public:
+        static_assert(contiguous_source<InputType>::value && sizeof(typename InputType::value_type) == 1,
+                      "token_query needs a contiguous char source");
+        static_assert(is_char_predicate<Predicate>::value, "token_query separators must be a char predicate");
+
+        typedef std::allocator<string_ref> A;
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef token_query<InputType, Predicate> this_type;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::forward_iterator_tag iterator_category;
+
+			iterator(const char *current, const char *last, const Predicate &separator)
+                    : _current(current)
+                    , _token_last(current)
+                    , _last(last)
+                    , _separator(separator)
+            {
+                seek(current);
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _token_last(other._token_last)
+                    , _last(other._last)
+                    , _separator(other._separator)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _token_last = other._token_last;
+                _last = other._last;
+                _separator = other._separator;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                seek(_token_last);
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            value_type operator*() const {
+                assert(_current != _last);
+                return string_ref(_current, static_cast<std::size_t>(_token_last - _current));
+            }
+
+        private:
+            // Finds the first token at or after from.
+            void seek(const char *from) {
+                _current = find_first(from, _last, char_not_predicate<const Predicate&>(_separator));
+                _token_last = find_first(_current, _last, _separator);
+            }
+
+            const char *_current;
+            const char *_token_last;
+            const char *_last;
+            // Copied, so the iterator stays valid after the query is gone.
+            Predicate _separator;
+        };
+
+        template<typename Input>
+        token_query(Input &&container, const Predicate &separator)
+				: _container(std::forward<Input>(container))
+                , _separator(separator)
+        {
+        }
+
+        token_query(const token_query &other)
+				: _container(other._container)
+                , _separator(other._separator)
+        {
+        }
+
+        token_query(token_query &&other)
+				: _container(std::move(other._container))
+                , _separator(std::move(other._separator))
+        {
+        }
+
+        ~token_query() {
+        }
+
+        token_query &operator=(const token_query &);
+
+        bool operator==(const token_query &) const;
+
+        bool operator!=(const token_query &) const;
+
+        iterator begin() const {
+            std::pair<const char*, const char*> range = chars();
+			return iterator(range.first, range.second, _separator);
+        }
+
+        iterator end() const {
+            std::pair<const char*, const char*> range = chars();
+			return iterator(range.second, range.second, _separator);
+        }
+
+        void swap(token_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_separator, other._separator);
+        }
+
+        bool empty() const {
+			return begin() == end();
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::between(0, (_container.size() + 1) / 2);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        std::pair<const char*, const char*> chars() const {
+            std::pair<const typename InputType::value_type*, const typename InputType::value_type*> range =
+                    contiguous_range(_container);
+            return std::pair<const char*, const char*>(reinterpret_cast<const char*>(range.first),
+                                                       reinterpret_cast<const char*>(range.second));
+        }
+
+        InputType _container;
+        Predicate _separator;
+    };
+
+	/*************************************************************//**
+	 * tokenize_query_builder
+	 ****************************************************************/
+    template<typename Predicate>
+    class tokenize_query_builder {
+    public:
+        explicit tokenize_query_builder(const Predicate &separator)
+                : _separator(separator)
+        {
+        }
+
+        template<typename Query>
+        token_query<typename std::decay<Query>::type, Predicate> build(Query&& query) const {
+            return token_query<typename std::decay<Query>::type, Predicate>(std::forward<Query>(query), _separator);
+        }
+
+    private:
+        Predicate _separator;
+    };
+
+	/*************************************************************//**
+	 * where_query
+	 ****************************************************************/
+	template<typename InputType, typename Predicate, class A = std::allocator<typename InputType::value_type> >
+    class where_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef where_query<InputType, Predicate, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef typename value_reference<input_iterator, value_type>::type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<
+                    input_iterator, std::bidirectional_iterator_tag>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    const Predicate& pred)
+                    : _current(current)
+                    , _last(last)
+                    , _pred(pred)
+            {
+                seek(char_scan<InputType, Predicate>());
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _pred(other._pred)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _pred = other._pred;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                ++_current;
+                seek(char_scan<InputType, Predicate>());
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                while(!_pred(*--_current))
+                {
+                }
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            reference operator*() const {
+                assert(_current != _last);
+                return *_current;
+            }
+
+            pointer operator->() const {
+                assert(_current != _last);
+                return _current.operator->();
+            }
+
+        private:
+            // Moves _current to the next value the predicate accepts.
+            void seek(std::false_type) {
+                while(_current != _last && !_pred(*_current))
+                    ++_current;
+            }
+
+            void seek(std::true_type) {
+                if(_current == _last)
+                    return;
+                const char *first = reinterpret_cast<const char*>(std::addressof(*_current.base()));
+                const char *last = first + (_last - _current);
+                _current += find_first(first, last, _pred.get()) - first;
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            assignable_function<Predicate> _pred;
+        };
+
+        class batch_cursor {
+        public:
+            typedef typename batch_cursor_of<InputType>::type input_cursor;
+
+            static_assert(std::is_same<value_type, typename InputType::value_type>::value,
+                          "where_query batches are read in place");
+
+            batch_cursor(const InputType &container, const Predicate &pred)
+                    : _input(batch_cursor_of<InputType>::make(container))
+                    , _pred(&pred)
+            {
+            }
+
+            // Reads input values straight into out and moves the accepted
+            // ones to the front.
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                std::size_t count = 0;
+                while(count < capacity) {
+                    std::size_t wanted = capacity - count;
+                    std::size_t read = _input.next_batch(out + count, wanted);
+                    count = compact(out, count, count + read, std::is_scalar<value_type>());
+                    if(read < wanted)
+                        break;
+                }
+                return count;
+            }
+
+        private:
+            std::size_t compact(value_type *out, std::size_t kept, std::size_t last, std::true_type) const {
+                for(std::size_t i = kept; i < last; ++i) {
+                    value_type value = out[i];
+                    out[kept] = value;
+                    kept += static_cast<bool>((*_pred)(value));
+                }
+                return kept;
+            }
+
+            std::size_t compact(value_type *out, std::size_t kept, std::size_t last, std::false_type) const {
+                for(std::size_t i = kept; i < last; ++i) {
+                    if(!(*_pred)(out[i]))
+                        continue;
+                    if(i != kept)
+                        out[kept] = std::move(out[i]);
+                    ++kept;
+                }
+                return kept;
+            }
+
+            input_cursor _input;
+            const Predicate *_pred;
+        };
+
+        template<typename Input, typename Pred>
+        where_query(
+                Input &&container,
+                Pred &&pred)
+				: _container(std::forward<Input>(container)), _pred(std::forward<Pred>(pred)) {
+        }
+
+        where_query(const where_query &other)
+				: _container(other._container), _pred(other._pred) {
+        }
+
+        where_query(where_query &&other)
+				: _container(std::move(other._container)), _pred(std::move(other._pred)) {
+        }
+
+        ~where_query() {
+        }
+
+        where_query &operator=(const where_query &);
+
+        bool operator==(const where_query &) const;
+
+        bool operator!=(const where_query &) const;
+
+        iterator begin() const {
+			return iterator(_container.begin(), _container.end(), _pred);
+        }
+
+        iterator end() const {
+            input_iterator last = _container.end();
+			return iterator(last, last, _pred);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_container, _pred);
+        }
+
+        void swap(where_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_pred, other._pred);
+        }
+
+        bool empty() const {
+			return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::between(0, _container.size_hint().upper);
+        }
+
+        size_type source_size() const {
+            return _container.source_size();
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(_container.slice(first, last), _pred);
+        }
+
+        const InputType &source() const & {
+            return _container;
+        }
+
+        // Moved out by the fusions when the query is a temporary.
+        InputType &&source() && {
+            return std::move(_container);
+        }
+
+        const Predicate &predicate() const & {
+            return _pred;
+        }
+
+        Predicate &&predicate() && {
+            return std::move(_pred);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        Predicate _pred;
+    };
+
+    template<typename InputType, typename Predicate, class A>
+    struct is_partitionable<where_query<InputType, Predicate, A> > : is_partitionable<InputType>
+    {
+    };
+
+    template<typename InputType, typename Predicate, class A>
+    struct native_batches<where_query<InputType, Predicate, A> > : std::true_type
+    {
+    };
+
+	/*************************************************************//**
+	 * where_fusion
+	 *
+	 * The query where(pred) builds over Query: a where_query unless
+	 * one of the specializations under pipeline fusion applies.
+	 ****************************************************************/
+    template<typename Query, typename Predicate, typename Enable = void>
+    struct where_fusion
+    {
+        typedef where_query<Query, Predicate> type;
+
+        template<typename Input, typename Pred>
+        static type make(Input &&query, Pred &&pred) {
+            return type(std::forward<Input>(query), std::forward<Pred>(pred));
+        }
+    };
+
+	/*************************************************************//**
+	 * where_query_builder
+	 ****************************************************************/
+	template<typename Predicate>
+    class where_query_builder {
+    public:
+        where_query_builder(const Predicate& pred) : _pred(pred) {
+        }
+
+        where_query_builder(Predicate&& pred) : _pred(std::move(pred)) {
+        }
+
+        template<typename Query>
+        typename where_fusion<typename std::decay<Query>::type, Predicate>::type build(Query&& query) const & {
+            return where_fusion<typename std::decay<Query>::type, Predicate>::make(std::forward<Query>(query), _pred);
+
+        }
+
+        template<typename Query>
+        typename where_fusion<typename std::decay<Query>::type, Predicate>::type build(Query&& query) && {
+            return where_fusion<typename std::decay<Query>::type, Predicate>::make(std::forward<Query>(query), std::move(_pred));
+
+        }
+    private:
+        Predicate _pred;
+
+    };
+
+	/*************************************************************//**
+	 * select_query
+	 ****************************************************************/
+    template<typename InputType, typename Generator>
+    class select_query {
+    public:
+		static typename InputType::value_type get_source();
+        static Generator get_generator();
+
+        typedef decltype(get_generator()(get_source())) raw_value_type;
+        typedef std::allocator<raw_value_type> A;
+
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef select_query<InputType, Generator> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<input_iterator>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    const Generator& generator)
+                    : _current(current)
+                    , _last(last)
+                    , _generator(generator)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _generator(other._generator)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _generator = other._generator;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return _current - other._current;
+            }
+
+            value_type operator[](difference_type n) const {
+                return _generator(_current[n]);
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            value_type operator*() const {
+                assert(_current != _last);
+                return _generator(*_current);
+            }
+
+            pointer operator->() const {
+                assert(_current != _last);
+                return _current.operator->();
+            }
+
+        private:
+			input_iterator _current;
+			input_iterator _last;
+            assignable_function<Generator> _generator;
+        };
+
+        class batch_cursor {
+        public:
+            typedef typename batch_cursor_of<InputType>::type input_cursor;
+            typedef typename InputType::value_type input_value_type;
+
+            batch_cursor(const InputType &container, const Generator &generator)
+                    : _input(batch_cursor_of<InputType>::make(container))
+                    , _generator(&generator)
+            {
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                std::size_t count = 0;
+                while(count < capacity) {
+                    std::size_t wanted = std::min(capacity - count, batch_size);
+                    std::size_t read = _input.next_batch(_buffer, wanted);
+                    const Generator &generator = *_generator;
+                    for(std::size_t i = 0; i < read; ++i)
+                        out[count + i] = generator(std::move(_buffer[i]));
+                    count += read;
+                    if(read < wanted)
+                        break;
+                }
+                return count;
+            }
+
+        private:
+            input_cursor _input;
+            const Generator *_generator;
+            input_value_type _buffer[batch_size];
+        };
+
+        template<typename Input, typename Gen>
+        select_query(
+                Input &&container,
+                Gen &&generator)
+				: _container(std::forward<Input>(container)), _generator(std::forward<Gen>(generator)) {
+        }
+
+        select_query(const select_query &other)
+				: _container(other._container), _generator(other._generator) {
+        }
+
+        select_query(select_query &&other)
+				: _container(std::move(other._container)), _generator(std::move(other._generator)) {
+        }
+
+        ~select_query() {
+        }
+
+        select_query &operator=(const select_query &);
+
+        bool operator==(const select_query &) const;
+
+        bool operator!=(const select_query &) const;
+
+        iterator begin() const {
+			return iterator(_container.begin(), _container.end(), _generator);
+        }
+
+        iterator end() const {
+            input_iterator last = _container.end();
+			return iterator(last, last, _generator);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_container, _generator);
+        }
+
+        void swap(select_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_generator, other._generator);
+        }
+
+        bool empty() const {
+            return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            return _container.size_hint();
+        }
+
+        size_type source_size() const {
+            return _container.source_size();
+        }
+
+        size_type size() const {
+            return static_cast<size_type>(_container.size());
+        }
+
+        value_type operator[](size_type n) const {
+            return _generator(_container[n]);
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(_container.slice(first, last), _generator);
+        }
+
+        const InputType &source() const & {
+            return _container;
+        }
+
+        InputType &&source() && {
+            return std::move(_container);
+        }
+
+        const Generator &generator() const & {
+            return _generator;
+        }
+
+        Generator &&generator() && {
+            return std::move(_generator);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+		InputType _container;
+        Generator _generator;
+    };
+
+    template<typename InputType, typename Generator>
+    struct is_partitionable<select_query<InputType, Generator> > : is_partitionable<InputType>
+    {
+    };
+
+    template<typename InputType, typename Generator>
+    struct is_position_aligned<select_query<InputType, Generator> > : is_position_aligned<InputType>
+    {
+    };
+
+    template<typename InputType, typename Generator>
+    struct native_batches<select_query<InputType, Generator> >
+            : std::is_default_constructible<typename InputType::value_type>
+    {
+    };
+
+	/*************************************************************//**
+	 * select_fusion
+	 *
+	 * The query select(generator) builds over Query: a select_query
+	 * unless one of the specializations under pipeline fusion applies.
+	 ****************************************************************/
+    template<typename Query, typename Generator, typename Enable = void>
+    struct select_fusion
+    {
+        typedef select_query<Query, Generator> type;
+
+        template<typename Input, typename Gen>
+        static type make(Input &&query, Gen &&generator) {
+            return type(std::forward<Input>(query), std::forward<Gen>(generator));
+        }
+    };
+
+	/*************************************************************//**
+	 * select_query_builder
+	 ****************************************************************/
+    template<typename Generator>
+    class select_query_builder {
+    public:
+
+        typedef char output_type;
+
+        select_query_builder(const Generator& generator) : _generator(generator) {
+        }
+
+        select_query_builder(Generator&& generator) : _generator(std::move(generator)) {
+        }
+
+        template<typename Query>
+        typename select_fusion<typename std::decay<Query>::type, Generator>::type
+        build(Query&& query) const & {
+			return select_fusion<
+                    typename std::decay<Query>::type, Generator>::make(std::forward<Query>(query), _generator);
+        }
+
+        template<typename Query>
+        typename select_fusion<typename std::decay<Query>::type, Generator>::type
+        build(Query&& query) && {
+			return select_fusion<
+                    typename std::decay<Query>::type, Generator>::make(std::forward<Query>(query), std::move(_generator));
+        }
+    private:
+        Generator _generator;
+
+    };
+
+	/*************************************************************//**
+	 * pipeline fusion
+	 *
+	 * where() and select() merge with the stage they are applied to
+	 * when the pipeline is built, so a chain of them is iterated as one
+	 * loop over its source instead of a stack of nested iterators:
+	 *  - where over where tests one and_predicate;
+	 *  - select over select calls one composed_function;
+	 *  - any other mix becomes a fused_query running a kernel_chain of
+	 *    filter_kernel and map_kernel steps on each source value.
+	 * where_fusion and select_fusion pick the result for a builder and
+	 * an upstream query. Where the upstream uses the char kernels, or
+	 * a value cannot be written into a batch (fusable_value), stages
+	 * stay apart.
+	 ****************************************************************/
+    template<typename First, typename Second>
+    class and_predicate {
+    public:
+        template<typename F, typename S>
+        and_predicate(F &&first, S &&second)
+                : _first(std::forward<F>(first))
+                , _second(std::forward<S>(second))
+        {
+        }
+
+        template<typename T>
+        bool operator()(const T &value) const {
+            return _first(value) && _second(value);
+        }
+
+    private:
+        First _first;
+        Second _second;
+    };
+
+    template<typename First, typename Second>
+    class composed_function {
+    public:
+        template<typename F, typename S>
+        composed_function(F &&first, S &&second)
+                : _first(std::forward<F>(first))
+                , _second(std::forward<S>(second))
+        {
+        }
+
+        template<typename T>
+        auto operator()(T &&value) const
+                -> decltype(std::declval<const Second&>()(std::declval<const First&>()(std::forward<T>(value)))) {
+            return _second(_first(std::forward<T>(value)));
+        }
+
+    private:
+        First _first;
+        Second _second;
+    };
+
+    // Kernel steps take a value and a continuation, and return whether
+    // the value made it through the continuation. Steps that keep the
+    // value type (in_place) can also run over a whole batch at once with
+    // apply_batch, which returns how many values are left at the front.
+    // Iterators use accepts() and produce() instead, so a generator
+    // only runs for the values that are read.
+    template<typename Predicate>
+    class filter_kernel {
+    public:
+        static const bool filters = true;
+
+        template<typename T>
+        struct result
+        {
+            typedef T type;
+        };
+
+        template<typename T>
+        struct in_place : std::true_type
+        {
+        };
+
+        filter_kernel(const Predicate &pred)
+                : _pred(pred)
+        {
+        }
+
+        filter_kernel(Predicate &&pred)
+                : _pred(std::move(pred))
+        {
+        }
+
+        template<typename T, typename Next>
+        bool operator()(T &&value, Next &next) const {
+            return _pred(value) && next(std::forward<T>(value));
+        }
+
+        template<typename T>
+        bool accepts(const T &value) const {
+            return _pred(value);
+        }
+
+        template<typename T>
+        T produce(T &&value) const {
+            return std::forward<T>(value);
+        }
+
+        template<typename T>
+        std::size_t apply_batch(T *values, std::size_t count) const {
+            return compact(values, count, std::is_scalar<T>());
+        }
+
+    private:
+        template<typename T>
+        std::size_t compact(T *values, std::size_t count, std::true_type) const {
+            std::size_t kept = 0;
+            for(std::size_t i = 0; i < count; ++i) {
+                T value = values[i];
+                values[kept] = value;
+                kept += static_cast<bool>(_pred(value));
+            }
+            return kept;
+        }
+
+        template<typename T>
+        std::size_t compact(T *values, std::size_t count, std::false_type) const {
+            std::size_t kept = 0;
+            for(std::size_t i = 0; i < count; ++i) {
+                if(!_pred(values[i]))
+                    continue;
+                if(i != kept)
+                    values[kept] = std::move(values[i]);
+                ++kept;
+            }
+            return kept;
+        }
+
+        Predicate _pred;
+    };
+
+    template<typename Generator>
+    class map_kernel {
+    public:
+        static const bool filters = false;
+
+        template<typename T>
+        struct result
+        {
+            typedef typename std::decay<decltype(std::declval<const Generator&>()(std::declval<T>()))>::type type;
+        };
+
+        template<typename T>
+        struct in_place : std::is_same<typename result<T>::type, T>
+        {
+        };
+
+        map_kernel(const Generator &generator)
+                : _generator(generator)
+        {
+        }
+
+        map_kernel(Generator &&generator)
+                : _generator(std::move(generator))
+        {
+        }
+
+        template<typename T, typename Next>
+        bool operator()(T &&value, Next &next) const {
+            return next(_generator(std::forward<T>(value)));
+        }
+
+        template<typename T>
+        bool accepts(const T &) const {
+            return true;
+        }
+
+        template<typename T>
+        auto produce(T &&value) const -> decltype(std::declval<const Generator&>()(std::forward<T>(value))) {
+            return _generator(std::forward<T>(value));
+        }
+
+        template<typename T>
+        std::size_t apply_batch(T *values, std::size_t count) const {
+            for(std::size_t i = 0; i < count; ++i)
+                values[i] = _generator(std::move(values[i]));
+            return count;
+        }
+
+    private:
+        Generator _generator;
+    };
+
+    template<typename First, typename Second>
+    class kernel_chain {
+    public:
+        static const bool filters = First::filters || Second::filters;
+
+        template<typename T>
+        struct result
+        {
+            typedef typename Second::template result<typename First::template result<T>::type>::type type;
+        };
+
+        template<typename T>
+        struct in_place : std::integral_constant<bool,
+                First::template in_place<T>::value &&
+                Second::template in_place<typename First::template result<T>::type>::value>
+        {
+        };
+
+        template<typename F, typename S>
+        kernel_chain(F &&first, S &&second)
+                : _first(std::forward<F>(first))
+                , _second(std::forward<S>(second))
+        {
+        }
+
+        template<typename T, typename Next>
+        bool operator()(T &&value, Next &next) const {
+            continuation<Next> then(_second, next);
+            return _first(std::forward<T>(value), then);
+        }
+
+        // Steps before a filter run again in produce(), as they would
+        // in a stack of where and select iterators.
+        template<typename T>
+        bool accepts(const T &value) const {
+            return _first.accepts(value) && (!Second::filters || _second.accepts(_first.produce(value)));
+        }
+
+        template<typename T>
+        auto produce(T &&value) const
+                -> decltype(std::declval<const Second&>().produce(std::declval<const First&>().produce(std::forward<T>(value)))) {
+            return _second.produce(_first.produce(std::forward<T>(value)));
+        }
+
+        template<typename T>
+        std::size_t apply_batch(T *values, std::size_t count) const {
+            return _second.apply_batch(values, _first.apply_batch(values, count));
+        }
+
+    private:
+        template<typename Next>
+        class continuation {
+        public:
+            continuation(const Second &second, Next &next)
+                    : _second(second)
+                    , _next(next)
+            {
+            }
+
+            template<typename T>
+            bool operator()(T &&value) const {
+                return _second(std::forward<T>(value), _next);
+            }
+
+        private:
+            const Second &_second;
+            Next &_next;
+        };
+
+        First _first;
+        Second _second;
+    };
+
+    // fused_query batches write values into default-constructed slots.
+    template<typename T>
+    struct fusable_value : std::integral_constant<bool,
+            std::is_default_constructible<T>::value && std::is_copy_assignable<T>::value>
+    {
+    };
+
+	/*************************************************************//**
+	 * fused_query
+	 *
+	 * A run of where() and select() stages over InputType, applied to
+	 * each source value by one Kernel. The iterator keeps only its
+	 * position: it skips values the filters reject and runs the
+	 * generators when it is dereferenced, as select_query does. Batches
+	 * run the whole kernel once per source value.
+	 ****************************************************************/
+    template<typename InputType, typename Kernel>
+    class fused_query {
+    public:
+        typedef std::allocator<typename Kernel::template result<typename InputType::value_type>::type> A;
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef fused_query<InputType, Kernel> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<
+                    input_iterator, std::forward_iterator_tag>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    const Kernel& kernel)
+                    : _current(current)
+                    , _last(last)
+                    , _kernel(kernel)
+            {
+                seek();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _kernel(other._kernel)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _kernel = other._kernel;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                ++_current;
+                seek();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            value_type operator*() const {
+                assert(_current != _last);
+                return _kernel.get().produce(*_current);
+            }
+
+            // Holds the value made for operator->, which has no other
+            // place to live.
+            class arrow {
+            public:
+                explicit arrow(value_type &&value)
+                        : _value(std::move(value))
+                {
+                }
+
+                const value_type *operator->() const {
+                    return &_value;
+                }
+
+            private:
+                value_type _value;
+            };
+
+            arrow operator->() const {
+                assert(_current != _last);
+                return arrow(**this);
+            }
+
+        private:
+            // Moves _current to the next source value the kernel lets through.
+            void seek() {
+                const Kernel &kernel = _kernel.get();
+                while(_current != _last && !kernel.accepts(*_current))
+                    ++_current;
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            assignable_function<Kernel> _kernel;
+        };
+
+        class batch_cursor {
+        public:
+            typedef typename batch_cursor_of<InputType>::type input_cursor;
+            typedef typename InputType::value_type input_value_type;
+
+            batch_cursor(const InputType &container, const Kernel &kernel)
+                    : _input(batch_cursor_of<InputType>::make(container))
+                    , _kernel(&kernel)
+            {
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                return next_batch(out, capacity, typename Kernel::template in_place<input_value_type>());
+            }
+
+        private:
+            // Every step keeps the value type: input values are read
+            // straight into out and each step runs over the whole batch.
+            std::size_t next_batch(value_type *out, std::size_t capacity, std::true_type) {
+                std::size_t count = 0;
+                while(count < capacity) {
+                    std::size_t wanted = capacity - count;
+                    std::size_t read = _input.next_batch(out + count, wanted);
+                    count += _kernel->apply_batch(out + count, read);
+                    if(read < wanted)
+                        break;
+                }
+                return count;
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity, std::false_type) {
+                append next = { out, 0 };
+                while(next.count < capacity) {
+                    std::size_t wanted = std::min(capacity - next.count, batch_size);
+                    std::size_t read = _input.next_batch(_buffer, wanted);
+                    const Kernel &kernel = *_kernel;
+                    for(std::size_t i = 0; i < read; ++i)
+                        kernel(std::move(_buffer[i]), next);
+                    if(read < wanted)
+                        break;
+                }
+                return next.count;
+            }
+
+            // Room for a whole input batch is left in out, as no step
+            // yields more than one value per source value.
+            struct append {
+                value_type *out;
+                std::size_t count;
+
+                template<typename T>
+                bool operator()(T &&result) {
+                    out[count++] = std::forward<T>(result);
+                    return true;
+                }
+            };
+
+            input_cursor _input;
+            const Kernel *_kernel;
+            input_value_type _buffer[batch_size];
+        };
+
+        template<typename Input, typename K>
+        fused_query(
+                Input &&container,
+                K &&kernel)
+				: _container(std::forward<Input>(container)), _kernel(std::forward<K>(kernel)) {
+        }
+
+        fused_query(const fused_query &other)
+				: _container(other._container), _kernel(other._kernel) {
+        }
+
+        fused_query(fused_query &&other)
+				: _container(std::move(other._container)), _kernel(std::move(other._kernel)) {
+        }
+
+        ~fused_query() {
+        }
+
+        fused_query &operator=(const fused_query &);
+
+        bool operator==(const fused_query &) const;
+
+        bool operator!=(const fused_query &) const;
+
+        iterator begin() const {
+			return iterator(_container.begin(), _container.end(), _kernel);
+        }
+
+        iterator end() const {
+            input_iterator last = _container.end();
+			return iterator(last, last, _kernel);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_container, _kernel);
+        }
+
+        void swap(fused_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_kernel, other._kernel);
+        }
+
+        bool empty() const {
+            return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            return Kernel::filters ? size_bounds::between(0, bounds.upper) : bounds;
+        }
+
+        size_type source_size() const {
+            return _container.source_size();
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(_container.slice(first, last), _kernel);
+        }
+
+        const InputType &source() const & {
+            return _container;
+        }
+
+        InputType &&source() && {
+            return std::move(_container);
+        }
+
+        const Kernel &kernel() const & {
+            return _kernel;
+        }
+
+        Kernel &&kernel() && {
+            return std::move(_kernel);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+		InputType _container;
+        Kernel _kernel;
+    };
+
+    template<typename InputType, typename Kernel>
+    struct is_partitionable<fused_query<InputType, Kernel> > : is_partitionable<InputType>
+    {
+    };
+
+    template<typename InputType, typename Kernel>
+    struct native_batches<fused_query<InputType, Kernel> >
+            : std::is_default_constructible<typename InputType::value_type>
+    {
+    };
+
+    template<typename InputType, typename P0, class A, typename Predicate>
+    struct where_fusion<where_query<InputType, P0, A>, Predicate,
+            typename std::enable_if<!char_scan<InputType, P0>::value>::type>
+    {
+        typedef where_query<InputType, and_predicate<P0, Predicate>, A> type;
+
+        template<typename Input, typename Pred>
+        static type make(Input &&query, Pred &&pred) {
+            return type(std::forward<Input>(query).source(), and_predicate<P0, Predicate>(std::forward<Input>(query).predicate(), std::forward<Pred>(pred)));
+        }
+    };
+
+    template<typename InputType, typename Generator, typename Predicate>
+    struct where_fusion<select_query<InputType, Generator>, Predicate,
+            typename std::enable_if<fusable_value<typename select_query<InputType, Generator>::value_type>::value>::type>
+    {
+        typedef kernel_chain<map_kernel<Generator>, filter_kernel<Predicate> > kernel_type;
+        typedef fused_query<InputType, kernel_type> type;
+
+        template<typename Input, typename Pred>
+        static type make(Input &&query, Pred &&pred) {
+            return type(std::forward<Input>(query).source(), kernel_type(std::forward<Input>(query).generator(), std::forward<Pred>(pred)));
+        }
+    };
+
+    template<typename InputType, typename Kernel, typename Predicate>
+    struct where_fusion<fused_query<InputType, Kernel>, Predicate>
+    {
+        typedef kernel_chain<Kernel, filter_kernel<Predicate> > kernel_type;
+        typedef fused_query<InputType, kernel_type> type;
+
+        template<typename Input, typename Pred>
+        static type make(Input &&query, Pred &&pred) {
+            return type(std::forward<Input>(query).source(), kernel_type(std::forward<Input>(query).kernel(), std::forward<Pred>(pred)));
+        }
+    };
+
+    template<typename InputType, typename G0, typename Generator>
+    struct select_fusion<select_query<InputType, G0>, Generator>
+    {
+        typedef select_query<InputType, composed_function<G0, Generator> > type;
+
+        template<typename Input, typename Gen>
+        static type make(Input &&query, Gen &&generator) {
+            return type(std::forward<Input>(query).source(), composed_function<G0, Generator>(std::forward<Input>(query).generator(), std::forward<Gen>(generator)));
+        }
+    };
+
+    template<typename InputType, typename Predicate, class A, typename Generator>
+    struct select_fusion<where_query<InputType, Predicate, A>, Generator,
+            typename std::enable_if<!char_scan<InputType, Predicate>::value && fusable_value<
+                    typename map_kernel<Generator>::template result<typename InputType::value_type>::type>::value>::type>
+    {
+        typedef kernel_chain<filter_kernel<Predicate>, map_kernel<Generator> > kernel_type;
+        typedef fused_query<InputType, kernel_type> type;
+
+        template<typename Input, typename Gen>
+        static type make(Input &&query, Gen &&generator) {
+            return type(std::forward<Input>(query).source(), kernel_type(std::forward<Input>(query).predicate(), std::forward<Gen>(generator)));
+        }
+    };
+
+    template<typename InputType, typename Kernel, typename Generator>
+    struct select_fusion<fused_query<InputType, Kernel>, Generator,
+            typename std::enable_if<fusable_value<
+                    typename map_kernel<Generator>::template result<
+                            typename fused_query<InputType, Kernel>::value_type>::type>::value>::type>
+    {
+        typedef kernel_chain<Kernel, map_kernel<Generator> > kernel_type;
+        typedef fused_query<InputType, kernel_type> type;
+
+        template<typename Input, typename Gen>
+        static type make(Input &&query, Gen &&generator) {
+            return type(std::forward<Input>(query).source(), kernel_type(std::forward<Input>(query).kernel(), std::forward<Gen>(generator)));
+        }
+    };
+
+
+	/*************************************************************//**
+	 * sorting_query_builder
+	 ****************************************************************/
+    class sorting_query_builder
+    {
+    protected:
+        sorting_query_builder() {}
+        sorting_query_builder(const sorting_query_builder &) {}
+        sorting_query_builder(sorting_query_builder&&) {}
+        ~sorting_query_builder() {}
+    };
+
+
+	/*************************************************************//**
+	 * orderby_query
+	 ****************************************************************/
+	template<typename InputType, typename Predicate, class A = std::allocator<typename InputType::value_type> >
+    class orderby_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef orderby_query<InputType, Predicate, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+        typedef typename std::vector<value_type, A>::iterator output_iterator;
+
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef const value_type &reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::random_access_iterator_tag iterator_category;
+
+            iterator(const output_iterator& current)
+                    : _current(current)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return _current - other._current;
+            }
+
+            reference operator[](difference_type n) const {
+                return _current[n];
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            reference operator*() const {
+                return *_current;
+            }
+
+            pointer operator->() const {
+                return _current.operator->();
+            }
+
+        private:
+            output_iterator _current;
+        };
+
+        template<typename Input, typename Pred>
+        orderby_query(
+                Input &&container,
+                Pred &&pred,
+                bool sort_ascending,
+                size_type limit = no_limit(),
+                bool stable = false,
+                const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _pred(std::forward<Pred>(pred))
+                , _sort_ascending(sort_ascending)
+                , _limit(limit)
+                , _stable(stable)
+                , _allocator(allocator)
+                , _state(std::allocate_shared<sorted_state>(allocator, allocator))
+        {
+        }
+
+        // Copies share the sorted values, so the input is sorted at most once
+        // however many stages hold on to this query, even when copies are
+        // read on several threads.
+        orderby_query(const orderby_query &other)
+				: _container(other._container)
+                , _pred(other._pred)
+                , _sort_ascending(other._sort_ascending)
+                , _limit(other._limit)
+                , _stable(other._stable)
+                , _allocator(other._allocator)
+                , _state(other._state)
+        {
+        }
+
+        orderby_query(orderby_query &&other)
+				: _container(std::move(other._container))
+                , _pred(std::move(other._pred))
+                , _sort_ascending(other._sort_ascending)
+                , _limit(other._limit)
+                , _stable(other._stable)
+                , _allocator(other._allocator)
+                , _state(std::move(other._state))
+        {
+        }
+
+        // Same ordering, but only the first limit values are produced.
+        // An already sorted query hands over its prefix instead of resorting.
+        orderby_query(const orderby_query &other, size_type limit)
+				: _container(other._container)
+                , _pred(other._pred)
+                , _sort_ascending(other._sort_ascending)
+                , _limit(std::min(limit, other._limit))
+                , _stable(other._stable)
+                , _allocator(other._allocator)
+                , _state(other._state)
+        {
+            restrict_state();
+        }
+
+        orderby_query(orderby_query &&other, size_type limit)
+				: _container(std::move(other._container))
+                , _pred(std::move(other._pred))
+                , _sort_ascending(other._sort_ascending)
+                , _limit(std::min(limit, other._limit))
+                , _stable(other._stable)
+                , _allocator(other._allocator)
+                , _state(std::move(other._state))
+        {
+            restrict_state();
+        }
+
+        ~orderby_query()
+        {
+        }
+
+        orderby_query &operator=(const orderby_query &);
+
+        bool operator==(const orderby_query &) const;
+
+        bool operator!=(const orderby_query &) const;
+
+        iterator begin() const {
+            initialize();
+            return iterator(_state->values.begin());
+        }
+
+        iterator end() const {
+            initialize();
+            return iterator(_state->values.end());
+        }
+
+        void swap(orderby_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_pred, other._pred);
+            std::swap(_sort_ascending, other._sort_ascending);
+            std::swap(_limit, other._limit);
+            std::swap(_stable, other._stable);
+            std::swap(_allocator, other._allocator);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            return _limit == 0 || _container.empty();
+        }
+
+        size_type size() const {
+            initialize();
+            return _state->values.size();
+        }
+
+        value_type operator[](size_type n) const {
+            initialize();
+            return _state->values[n];
+        }
+
+        size_bounds size_hint() const {
+            if(_state->ready())
+                return size_bounds::exact(_state->values.size());
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(std::min(bounds.lower, _limit), std::min(bounds.upper, _limit));
+        }
+
+        // Hands over the materialized values, moving them out when no other
+        // copy of this query shares them.
+        std::vector<value_type, A> extract_values() && {
+            initialize();
+            if(sole_owner(_state))
+                return std::move(_state->values);
+            return _state->values;
+        }
+
+        const InputType &source() const {
+            return _container;
+        }
+
+        const Predicate &predicate() const {
+            return _pred;
+        }
+
+        bool ascending() const {
+            return _sort_ascending;
+        }
+
+        size_type limit() const {
+            return _limit;
+        }
+
+        // Whether equal values keep their input order.
+        bool stable() const {
+            return _stable;
+        }
+
+        allocator_type get_allocator() const {
+            return _allocator;
+        }
+
+        static size_type no_limit() {
+            return std::numeric_limits<size_type>::max();
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        struct sorted_state : lazy_state {
+            explicit sorted_state(const allocator_type &allocator) : values(allocator) {}
+
+            std::vector<value_type, A> values;
+        };
+
+        // Drops the shared state unless its values are already sorted and fit
+        // within _limit. Sole owners trim in place, shared ones copy the prefix.
+        void restrict_state()
+        {
+            if(!_state || !_state->ready()) {
+                _state = std::allocate_shared<sorted_state>(_allocator, _allocator);
+                return;
+            }
+            if(_state->values.size() <= _limit)
+                return;
+
+            if(sole_owner(_state)) {
+                _state->values.resize(_limit);
+                return;
+            }
+            std::shared_ptr<sorted_state> prefix = std::allocate_shared<sorted_state>(_allocator, _allocator);
+            prefix->values.assign(_state->values.begin(), _state->values.begin() + _limit);
+            prefix->set_ready();
+            _state = prefix;
+        }
+
+        bool compare_ascending(const value_type & lhs, const value_type & rhs) const
+        {
+            return _pred(lhs, rhs);
+        }
+
+        bool compare_descending(const value_type & lhs, const value_type & rhs) const
+        {
+            return _pred(rhs, lhs);
+        }
+
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            _state->values.clear();
+            if(_limit == 0 || _container.empty())
+                return;
+
+            if(_sort_ascending) {
+                fill_sorted([this](const value_type &lhs, const value_type &rhs) {
+                    return this->compare_ascending(lhs, rhs);
+                });
+            } else {
+                fill_sorted([this](const value_type &lhs, const value_type &rhs) {
+                    return this->compare_descending(lhs, rhs);
+                });
+            }
+        }
+
+        template<typename Compare>
+        void fill_sorted(Compare comp) const
+        {
+            std::vector<value_type, A> &sorted_values = _state->values;
+            sorted_values.reserve(_container.size_hint().reserve_size(_limit));
+            if(_limit == no_limit()) {
+                sorted_values.insert(sorted_values.end(), _container.begin(), _container.end());
+                if(_stable)
+                    std::stable_sort(sorted_values.begin(), sorted_values.end(), comp);
+                else
+                    std::sort(sorted_values.begin(), sorted_values.end(), comp);
+                return;
+            }
+            if(_stable) {
+                fill_stable_top(comp);
+                return;
+            }
+
+            // Bounded max-heap: the front is the worst of the best _limit values
+            // seen so far, so memory stays at _limit and each value costs O(log k).
+            input_iterator last = _container.end();
+            for(input_iterator it = _container.begin(); it != last; ++it) {
+                if(sorted_values.size() < _limit) {
+                    sorted_values.push_back(*it);
+                    std::push_heap(sorted_values.begin(), sorted_values.end(), comp);
+                } else {
+                    value_type value = *it;
+                    if(comp(value, sorted_values.front())) {
+                        std::pop_heap(sorted_values.begin(), sorted_values.end(), comp);
+                        sorted_values.back() = std::move(value);
+                        std::push_heap(sorted_values.begin(), sorted_values.end(), comp);
+                    }
+                }
+            }
+            std::sort_heap(sorted_values.begin(), sorted_values.end(), comp);
+        }
+
+        // The bounded heap above, over values ranked by input position so
+        // that ties go to the earlier value.
+        template<typename Compare>
+        void fill_stable_top(Compare comp) const
+        {
+            typedef std::pair<value_type, size_type> ranked;
+            auto ranked_comp = [&comp](const ranked &lhs, const ranked &rhs) {
+                return comp(lhs.first, rhs.first) || (!comp(rhs.first, lhs.first) && lhs.second < rhs.second);
+            };
+
+            std::vector<ranked, typename rebind_allocator<A, ranked>::type> heap(_allocator);
+            heap.reserve(_state->values.capacity());
+            size_type position = 0;
+            input_iterator last = _container.end();
+            for(input_iterator it = _container.begin(); it != last; ++it, ++position) {
+                ranked value(*it, position);
+                if(heap.size() < _limit) {
+                    heap.push_back(std::move(value));
+                    std::push_heap(heap.begin(), heap.end(), ranked_comp);
+                } else if(ranked_comp(value, heap.front())) {
+                    std::pop_heap(heap.begin(), heap.end(), ranked_comp);
+                    heap.back() = std::move(value);
+                    std::push_heap(heap.begin(), heap.end(), ranked_comp);
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end(), ranked_comp);
+            for(size_type i = 0; i < heap.size(); ++i)
+                _state->values.push_back(std::move(heap[i].first));
+        }
+
+        InputType _container;
+        Predicate _pred;
+        bool _sort_ascending;
+        size_type _limit;
+        bool _stable;
+        allocator_type _allocator;
+        std::shared_ptr<sorted_state> _state;
+    };
+
+	/*************************************************************//**
+	 * spill_traits
+	 *
+	 * How external_orderby_query writes values to its run files, reads
+	 * them back, and counts the memory a value holds while a run is
+	 * collected. Trivially copyable types are copied as bytes and
+	 * std::string and std::pair are provided; other types need a
+	 * specialization.
+	 ****************************************************************/
+    template<typename T>
+    struct spill_traits
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "query: specialize spill_traits to spill this type");
+
+        static std::size_t memory(const T &) {
+            return sizeof(T);
+        }
+
+        template<typename Writer>
+        static void write(Writer &out, const T &value) {
+            out.write(&value, sizeof(T));
+        }
+
+        template<typename Reader>
+        static bool read(Reader &in, T &value) {
+            return in.read(&value, sizeof(T));
+        }
+    };
+
+    template<typename C, typename Traits, class A>
+    struct spill_traits<std::basic_string<C, Traits, A> >
+    {
+        typedef std::basic_string<C, Traits, A> string_type;
+
+        static std::size_t memory(const string_type &value) {
+            return sizeof(string_type) + value.capacity() * sizeof(C);
+        }
+
+        template<typename Writer>
+        static void write(Writer &out, const string_type &value) {
+            std::uint64_t size = value.size();
+            out.write(&size, sizeof(size));
+            out.write(value.data(), value.size() * sizeof(C));
+        }
+
+        template<typename Reader>
+        static bool read(Reader &in, string_type &value) {
+            std::uint64_t size;
+            if(!in.read(&size, sizeof(size)))
+                return false;
+            value.resize(static_cast<std::size_t>(size));
+            return size == 0 || in.read(&value[0], value.size() * sizeof(C));
+        }
+    };
+
+    template<typename First, typename Second>
+    struct spill_traits<std::pair<First, Second> >
+    {
+        static std::size_t memory(const std::pair<First, Second> &value) {
+            return spill_traits<First>::memory(value.first) + spill_traits<Second>::memory(value.second);
+        }
+
+        template<typename Writer>
+        static void write(Writer &out, const std::pair<First, Second> &value) {
+            spill_traits<First>::write(out, value.first);
+            spill_traits<Second>::write(out, value.second);
+        }
+
+        template<typename Reader>
+        static bool read(Reader &in, std::pair<First, Second> &value) {
+            return spill_traits<First>::read(in, value.first) && spill_traits<Second>::read(in, value.second);
+        }
+    };
+
+	/*************************************************************//**
+	 * spill_file
+	 *
+	 * Anonymous temporary file (std::tmpfile), removed when closed.
+	 * Written once, then read through any number of spill_readers,
+	 * each at its own offset. I/O failures throw std::system_error.
+	 ****************************************************************/
+    class spill_file {
+    public:
+        spill_file()
+                : _file(std::tmpfile())
+                , _size(0)
+        {
+            if(_file == 0)
+                fail("query: cannot create spill file");
+        }
+
+        ~spill_file()
+        {
+            std::fclose(_file);
+        }
+
+        void write(const void *data, std::size_t size) {
+            if(std::fwrite(data, 1, size, _file) != size)
+                fail("query: cannot write spill file");
+            _size += size;
+        }
+
+        void flush() {
+            if(std::fflush(_file) != 0)
+                fail("query: cannot write spill file");
+        }
+
+        // Seek and read as one step, so merges over copies of a query can
+        // share the file.
+        std::size_t read_at(std::size_t offset, void *data, std::size_t size) const {
+            std::lock_guard<std::mutex> lock(_mutex);
+#if defined(_WIN32)
+            int moved = _fseeki64(_file, static_cast<__int64>(offset), SEEK_SET);
+#else
+            int moved = fseeko(_file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+            if(moved != 0)
+                fail("query: cannot read spill file");
+            std::size_t read = std::fread(data, 1, size, _file);
+            if(read != size && std::ferror(_file))
+                fail("query: cannot read spill file");
+            return read;
+        }
+
+        std::size_t size() const {
+            return _size;
+        }
+
+    private:
+        spill_file(const spill_file &);
+
+        spill_file &operator=(const spill_file &);
+
+        static void fail(const char *what) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+
+        std::FILE *_file;
+        std::size_t _size;
+        mutable std::mutex _mutex;
+    };
+
+    class spill_reader {
+    public:
+        explicit spill_reader(const spill_file *file)
+                : _file(file)
+                , _offset(0)
+                , _buffer(buffer_size())
+                , _position(0)
+                , _end(0)
+        {
+        }
+
+        bool read(void *data, std::size_t size) {
+            char *out = static_cast<char*>(data);
+            while(size != 0) {
+                if(_position == _end && !refill())
+                    return false;
+                std::size_t count = std::min(size, _end - _position);
+                std::memcpy(out, &_buffer[_position], count);
+                _position += count;
+                out += count;
+                size -= count;
+            }
+            return true;
+        }
+
+        static std::size_t buffer_size() {
+            return 1U << 16;
+        }
+
+    private:
+        bool refill() {
+            if(_offset >= _file->size())
+                return false;
+            _end = _file->read_at(_offset, &_buffer[0], std::min(_buffer.size(), _file->size() - _offset));
+            _offset += _end;
+            _position = 0;
+            return _end != 0;
+        }
+
+        const spill_file *_file;
+        std::size_t _offset;
+        std::vector<char> _buffer;
+        std::size_t _position;
+        std::size_t _end;
+    };
+
+	/*************************************************************//**
+	 * external_orderby_query
+	 *
+	 * orderby for inputs larger than memory. Values are collected until
+	 * they hold memory_budget bytes (as counted by spill_traits), then
+	 * sorted and written to a temporary file as one run. Iteration
+	 * merges the runs lazily through a heap, so only a read buffer per
+	 * run stays in memory. Inputs that fit the budget are sorted in
+	 * memory as orderby does. When stable, runs are sorted with
+	 * std::stable_sort and ties in the merge go to the earlier run, so
+	 * equal values keep their input order. Built by
+	 * orderby(pred).with_memory_budget().
+	 ****************************************************************/
+	template<typename InputType, typename Predicate, class A = std::allocator<typename InputType::value_type> >
+    class external_orderby_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef external_orderby_query<InputType, Predicate, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+        static_assert(std::is_default_constructible<value_type>::value,
+                      "external_orderby_query reads values back into default-constructed ones");
+
+    private:
+        typedef spill_traits<value_type> traits;
+
+        // Whether lhs sorts before rhs in the requested direction.
+        struct order {
+            order(const Predicate &pred, bool ascending)
+                    : pred(pred), ascending(ascending)
+            {
+            }
+
+            bool operator()(const value_type &lhs, const value_type &rhs) const {
+                return ascending ? pred(lhs, rhs) : pred(rhs, lhs);
+            }
+
+            Predicate pred;
+            bool ascending;
+        };
+
+        // Heap of the next value of every run; ties go to the earlier run.
+        struct merge_state {
+            typedef std::pair<value_type, std::size_t> entry;
+
+            merge_state(const std::vector<std::shared_ptr<spill_file> > &runs, const order &before, size_type limit)
+                    : before(before)
+                    , remaining(limit)
+            {
+                readers.reserve(runs.size());
+                heap.reserve(runs.size());
+                for(std::size_t i = 0; i < runs.size(); ++i) {
+                    readers.push_back(spill_reader(runs[i].get()));
+                    value_type value;
+                    if(traits::read(readers.back(), value))
+                        heap.push_back(entry(std::move(value), i));
+                }
+                std::make_heap(heap.begin(), heap.end(), heap_order(this->before));
+            }
+
+            bool done() const {
+                return heap.empty() || remaining == 0;
+            }
+
+            const value_type &top() const {
+                return heap.front().first;
+            }
+
+            void advance() {
+                std::pop_heap(heap.begin(), heap.end(), heap_order(before));
+                if(traits::read(readers[heap.back().second], heap.back().first))
+                    std::push_heap(heap.begin(), heap.end(), heap_order(before));
+                else
+                    heap.pop_back();
+                --remaining;
+            }
+
+            struct heap_order {
+                explicit heap_order(const order &before) : before(&before) {}
+
+                bool operator()(const entry &lhs, const entry &rhs) const {
+                    if((*before)(rhs.first, lhs.first))
+                        return true;
+                    return !(*before)(lhs.first, rhs.first) && rhs.second < lhs.second;
+                }
+
+                const order *before;
+            };
+
+            std::vector<spill_reader> readers;
+            std::vector<entry> heap;
+            order before;
+            size_type remaining;
+        };
+
+    public:
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef const value_type &reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::input_iterator_tag iterator_category;
+
+            iterator()
+                    : _current(0), _last(0), _state()
+            {
+            }
+
+            iterator(const value_type *current, const value_type *last)
+                    : _current(current), _last(last), _state()
+            {
+            }
+
+            explicit iterator(const std::shared_ptr<merge_state> &state)
+                    : _current(0), _last(0), _state(state)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current), _last(other._last), _state(other._state)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _state = other._state;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                bool done = at_end();
+                if(done || other.at_end())
+                    return done == other.at_end();
+                return _state == other._state && _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !(*this == other);
+            }
+
+            iterator &operator++() {
+                assert(!at_end());
+                if(_state)
+                    _state->advance();
+                else
+                    ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            reference operator*() const {
+                assert(!at_end());
+                return _state ? _state->top() : *_current;
+            }
+
+            pointer operator->() const {
+                assert(!at_end());
+                return const_cast<pointer>(_state ? &_state->top() : _current);
+            }
+
+        private:
+            bool at_end() const {
+                return _state ? _state->done() : _current == _last;
+            }
+
+            const value_type *_current;
+            const value_type *_last;
+            std::shared_ptr<merge_state> _state;
+        };
+
+        template<typename Input, typename Pred>
+        external_orderby_query(
+                Input &&container,
+                Pred &&pred,
+                bool sort_ascending,
+                size_type limit,
+                bool stable,
+                std::size_t memory_budget,
+                const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _pred(std::forward<Pred>(pred))
+                , _sort_ascending(sort_ascending)
+                , _limit(limit)
+                , _stable(stable)
+                , _memory_budget(memory_budget)
+                , _state(std::allocate_shared<sorted_state>(allocator, allocator))
+        {
+        }
+
+        external_orderby_query(const external_orderby_query &other)
+				: _container(other._container)
+                , _pred(other._pred)
+                , _sort_ascending(other._sort_ascending)
+                , _limit(other._limit)
+                , _stable(other._stable)
+                , _memory_budget(other._memory_budget)
+                , _state(other._state)
+        {
+        }
+
+        external_orderby_query(external_orderby_query &&other)
+				: _container(std::move(other._container))
+                , _pred(std::move(other._pred))
+                , _sort_ascending(other._sort_ascending)
+                , _limit(other._limit)
+                , _stable(other._stable)
+                , _memory_budget(other._memory_budget)
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~external_orderby_query() {
+        }
+
+        external_orderby_query &operator=(const external_orderby_query &);
+
+        bool operator==(const external_orderby_query &) const;
+
+        bool operator!=(const external_orderby_query &) const;
+
+        // Each call starts a new merge over the runs.
+        iterator begin() const {
+            initialize();
+            if(_state->runs.empty()) {
+                const value_type *first = _state->values.data();
+                return iterator(first, first + std::min<size_type>(_state->values.size(), _limit));
+            }
+            return iterator(std::make_shared<merge_state>(_state->runs, order(_pred, _sort_ascending), _limit));
+        }
+
+        iterator end() const {
+            initialize();
+            if(_state->runs.empty()) {
+                const value_type *last = _state->values.data() + std::min<size_type>(_state->values.size(), _limit);
+                return iterator(last, last);
+            }
+            return iterator();
+        }
+
+        void swap(external_orderby_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_pred, other._pred);
+            std::swap(_sort_ascending, other._sort_ascending);
+            std::swap(_limit, other._limit);
+            std::swap(_stable, other._stable);
+            std::swap(_memory_budget, other._memory_budget);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+			return _container.empty() || _limit == 0;
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(std::min<std::size_t>(bounds.lower, _limit),
+                                        std::min<std::size_t>(bounds.upper, _limit));
+        }
+
+        // Number of spilled runs; zero when the input fit the budget.
+        std::size_t run_count() const {
+            initialize();
+            return _state->runs.size();
+        }
+
+        static std::size_t max_merge_width() {
+            return 64;
+        }
+
+        allocator_type get_allocator() const {
+            return _state->values.get_allocator();
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        struct sorted_state : lazy_state {
+            explicit sorted_state(const allocator_type &allocator) : values(allocator), runs() {}
+
+            std::vector<value_type, A> values;
+            std::vector<std::shared_ptr<spill_file> > runs;
+        };
+
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            sorted_state &state = *_state;
+            state.values.clear();
+            state.runs.clear();
+
+            order before(_pred, _sort_ascending);
+            state.values.reserve(std::min(_container.size_hint().reserve_size(),
+                                          _memory_budget / sizeof(value_type) + 1));
+            std::size_t used = 0;
+            input_iterator last = _container.end();
+            for(input_iterator it = _container.begin(); it != last; ++it) {
+                state.values.push_back(*it);
+                used += traits::memory(state.values.back());
+                if(used >= _memory_budget) {
+                    spill(state.values, before);
+                    used = 0;
+                }
+            }
+
+            if(state.runs.empty()) {
+                sort_values(state.values, before);
+            } else {
+                if(!state.values.empty())
+                    spill(state.values, before);
+                std::vector<value_type, A>(state.values.get_allocator()).swap(state.values);
+            }
+
+            // Keep the number of files read at once bounded. Neighbouring
+            // runs are merged in place so the runs stay in input order.
+            std::size_t first = 0;
+            while(state.runs.size() > max_merge_width()) {
+                std::size_t last = std::min(first + max_merge_width(), state.runs.size());
+                if(last - first < 2) {
+                    first = 0;
+                    continue;
+                }
+                std::vector<std::shared_ptr<spill_file> > group(state.runs.begin() + first,
+                                                                state.runs.begin() + last);
+                std::shared_ptr<spill_file> merged = std::make_shared<spill_file>();
+                for(merge_state merge(group, before, no_limit()); !merge.done(); merge.advance())
+                    traits::write(*merged, merge.top());
+                merged->flush();
+                state.runs.erase(state.runs.begin() + first + 1, state.runs.begin() + last);
+                state.runs[first++] = merged;
+            }
+        }
+
+        void sort_values(std::vector<value_type, A> &values, const order &before) const
+        {
+            if(_stable)
+                std::stable_sort(values.begin(), values.end(), before);
+            else
+                std::sort(values.begin(), values.end(), before);
+        }
+
+        void spill(std::vector<value_type, A> &values, const order &before) const
+        {
+            sort_values(values, before);
+            std::shared_ptr<spill_file> run = std::make_shared<spill_file>();
+            for(std::size_t i = 0; i < values.size(); ++i)
+                traits::write(*run, values[i]);
+            run->flush();
+            _state->runs.push_back(run);
+            values.clear();
+        }
+
+        static size_type no_limit() {
+            return std::numeric_limits<size_type>::max();
+        }
+
+        InputType _container;
+        Predicate _pred;
+        bool _sort_ascending;
+        size_type _limit;
+        bool _stable;
+        std::size_t _memory_budget;
+        std::shared_ptr<sorted_state> _state;
+    };
+
+	/*************************************************************//**
+	 * external_orderby_query_builder
+	 ****************************************************************/
+	template<typename Predicate>
+    class external_orderby_query_builder : public sorting_query_builder {
+    public:
+        external_orderby_query_builder(const Predicate& pred, bool sort_ascending,
+                                       std::size_t limit, bool stable, std::size_t memory_budget)
+                : _pred(pred)
+                , _sort_ascending(sort_ascending)
+                , _limit(limit)
+                , _stable(stable)
+                , _memory_budget(memory_budget)
+        {
+        }
+
+        template<typename Query>
+        external_orderby_query<typename std::decay<Query>::type, Predicate> build(Query&& query) const & {
+            return external_orderby_query<typename std::decay<Query>::type, Predicate>(
+                    std::forward<Query>(query), _pred, _sort_ascending, _limit, _stable, _memory_budget);
+        }
+
+        template<typename Query>
+        external_orderby_query<typename std::decay<Query>::type, Predicate> build(Query&& query) && {
+            return external_orderby_query<typename std::decay<Query>::type, Predicate>(
+                    std::forward<Query>(query), std::move(_pred), _sort_ascending, _limit, _stable, _memory_budget);
+        }
+
+        template<typename Query, class Alloc>
+        external_orderby_query<typename std::decay<Query>::type, Predicate,
+                               typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            return external_orderby_query<typename std::decay<Query>::type, Predicate,
+                                          typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>(
+                    std::forward<Query>(query), _pred, _sort_ascending, _limit, _stable, _memory_budget, allocator);
+        }
+
+        template<class Alloc>
+        allocator_query_builder<external_orderby_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<external_orderby_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        Predicate _pred;
+        bool _sort_ascending;
+        std::size_t _limit;
+        bool _stable;
+        std::size_t _memory_budget;
+    };
+
+	/*************************************************************//**
+	 * lazy_orderby_query
+	 *
+	 * orderby that sorts on demand. begin() collects the input and
+	 * builds a heap in O(n); every value read past the sorted prefix
+	 * pops one more off it in O(log n), so a consumer that stops after
+	 * k values pays O(n + k log n) instead of a full sort. Popped values
+	 * stay at the back of the same vector, so copies of the query and
+	 * later passes reuse the prefix. Copies may be read on several
+	 * threads: reading the sorted prefix takes no lock, popping past it
+	 * takes the heap's lock. When stable, the heap holds input positions
+	 * instead of values and ties go to the earlier one, so equal values
+	 * keep their input order. Built by orderby(pred).lazy().
+	 ****************************************************************/
+	template<typename InputType, typename Predicate, class A = std::allocator<typename InputType::value_type> >
+    class lazy_orderby_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef lazy_orderby_query<InputType, Predicate, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+    private:
+        // Heap order that puts the value sorting first on top.
+        struct heap_order {
+            heap_order(const Predicate &pred, bool ascending)
+                    : pred(pred), ascending(ascending)
+            {
+            }
+
+            bool operator()(const value_type &lhs, const value_type &rhs) const {
+                return ascending ? pred(rhs, lhs) : pred(lhs, rhs);
+            }
+
+            Predicate pred;
+            bool ascending;
+        };
+
+        typedef std::vector<value_type, A> values_type;
+        typedef std::vector<size_type, typename rebind_allocator<A, size_type>::type> ranks_type;
+
+        // Heap order on input positions; ties put the earlier one on top.
+        struct rank_order {
+            rank_order(const values_type &values, const heap_order &order)
+                    : values(&values), order(&order)
+            {
+            }
+
+            bool operator()(size_type lhs, size_type rhs) const {
+                const value_type &left = (*values)[lhs];
+                const value_type &right = (*values)[rhs];
+                return (*order)(left, right) || (!(*order)(right, left) && rhs < lhs);
+            }
+
+            const values_type *values;
+            const heap_order *order;
+        };
+
+        // values[0, values.size() - popped) is the heap; the i-th sorted
+        // value is values[values.size() - 1 - i] once i < popped. When
+        // stable the values stay in input order and ranks is the heap.
+        struct heap_state : lazy_state {
+            heap_state(const Predicate &pred, bool ascending, bool stable, const allocator_type &allocator)
+                    : values(allocator), ranks(allocator), popped(0), total(0), order(pred, ascending), stable(stable)
+            {
+            }
+
+            // Popped values never move again, so they are read without
+            // the lock once popped says they are there.
+            const value_type &at(size_type n) {
+                assert(n < total);
+                if(n >= popped.load(std::memory_order_acquire)) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    size_type count = popped.load(std::memory_order_relaxed);
+                    for(; count <= n; ++count) {
+                        if(stable)
+                            std::pop_heap(ranks.begin(), ranks.end() - count, rank_order(values, order));
+                        else
+                            std::pop_heap(values.begin(), values.end() - count, order);
+                    }
+                    popped.store(count, std::memory_order_release);
+                }
+                if(stable)
+                    return values[ranks[ranks.size() - 1 - n]];
+                return values[values.size() - 1 - n];
+            }
+
+            values_type values;
+            ranks_type ranks;
+            std::atomic<size_type> popped;
+            size_type total;
+            heap_order order;
+            bool stable;
+            std::mutex mutex;
+        };
+
+    public:
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef const value_type &reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::forward_iterator_tag iterator_category;
+
+            iterator()
+                    : _state(0), _index(0)
+            {
+            }
+
+            iterator(heap_state *state, size_type index)
+                    : _state(state), _index(index)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _state(other._state), _index(other._index)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _state = other._state;
+                _index = other._index;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _index == other._index;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _index != other._index;
+            }
+
+            iterator &operator++() {
+                ++_index;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            reference operator*() const {
+                return _state->at(_index);
+            }
+
+            pointer operator->() const {
+                return const_cast<pointer>(&_state->at(_index));
+            }
+
+        private:
+            heap_state *_state;
+            size_type _index;
+        };
+
+        template<typename Input, typename Pred>
+        lazy_orderby_query(
+                Input &&container,
+                Pred &&pred,
+                bool sort_ascending,
+                size_type limit = no_limit(),
+                bool stable = false,
+                const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _pred(std::forward<Pred>(pred))
+                , _sort_ascending(sort_ascending)
+                , _limit(limit)
+                , _stable(stable)
+                , _state(std::allocate_shared<heap_state>(allocator, _pred, _sort_ascending, _stable, allocator))
+        {
+        }
+
+        lazy_orderby_query(const lazy_orderby_query &other)
+				: _container(other._container)
+                , _pred(other._pred)
+                , _sort_ascending(other._sort_ascending)
+                , _limit(other._limit)
+                , _stable(other._stable)
+                , _state(other._state)
+        {
+        }
+
+        lazy_orderby_query(lazy_orderby_query &&other)
+				: _container(std::move(other._container))
+                , _pred(std::move(other._pred))
+                , _sort_ascending(other._sort_ascending)
+                , _limit(other._limit)
+                , _stable(other._stable)
+                , _state(std::move(other._state))
+        {
+        }
+
+        // Same ordering, limited to the first limit values. The heap is
+        // shared, since a shorter prefix needs no other order.
+        lazy_orderby_query(const lazy_orderby_query &other, size_type limit)
+				: _container(other._container)
+                , _pred(other._pred)
+                , _sort_ascending(other._sort_ascending)
+                , _limit(std::min(limit, other._limit))
+                , _stable(other._stable)
+                , _state(other._state)
+        {
+        }
+
+        lazy_orderby_query(lazy_orderby_query &&other, size_type limit)
+				: _container(std::move(other._container))
+                , _pred(std::move(other._pred))
+                , _sort_ascending(other._sort_ascending)
+                , _limit(std::min(limit, other._limit))
+                , _stable(other._stable)
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~lazy_orderby_query()
+        {
+        }
+
+        lazy_orderby_query &operator=(const lazy_orderby_query &);
+
+        bool operator==(const lazy_orderby_query &) const;
+
+        bool operator!=(const lazy_orderby_query &) const;
+
+        iterator begin() const {
+            initialize();
+            return iterator(_state.get(), 0);
+        }
+
+        iterator end() const {
+            initialize();
+            return iterator(_state.get(), std::min(_state->total, _limit));
+        }
+
+        void swap(lazy_orderby_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_pred, other._pred);
+            std::swap(_sort_ascending, other._sort_ascending);
+            std::swap(_limit, other._limit);
+            std::swap(_stable, other._stable);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            return _limit == 0 || _container.empty();
+        }
+
+        size_type size() const {
+            initialize();
+            return std::min(_state->total, _limit);
+        }
+
+        size_bounds size_hint() const {
+            if(_state->ready())
+                return size_bounds::exact(std::min(_state->total, _limit));
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(std::min(bounds.lower, _limit), std::min(bounds.upper, _limit));
+        }
+
+        // Number of values sorted so far.
+        size_type sorted_count() const {
+            return _state->popped.load(std::memory_order_acquire);
+        }
+
+        bool ascending() const {
+            return _sort_ascending;
+        }
+
+        size_type limit() const {
+            return _limit;
+        }
+
+        bool stable() const {
+            return _stable;
+        }
+
+        allocator_type get_allocator() const {
+            return _state->values.get_allocator();
+        }
+
+        static size_type no_limit() {
+            return std::numeric_limits<size_type>::max();
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            heap_state &state = *_state;
+            state.values.clear();
+            state.ranks.clear();
+            state.popped.store(0, std::memory_order_relaxed);
+            if(_limit != 0) {
+                state.values.reserve(_container.size_hint().reserve_size());
+                state.values.insert(state.values.end(), _container.begin(), _container.end());
+                if(_stable) {
+                    state.ranks.reserve(state.values.size());
+                    for(size_type i = 0; i < state.values.size(); ++i)
+                        state.ranks.push_back(i);
+                    std::make_heap(state.ranks.begin(), state.ranks.end(), rank_order(state.values, state.order));
+                } else {
+                    std::make_heap(state.values.begin(), state.values.end(), state.order);
+                }
+            }
+            state.total = state.values.size();
+        }
+
+        InputType _container;
+        Predicate _pred;
+        bool _sort_ascending;
+        size_type _limit;
+        bool _stable;
+        std::shared_ptr<heap_state> _state;
+    };
+
+	/*************************************************************//**
+	 * lazy_orderby_query_builder
+	 ****************************************************************/
+	template<typename Predicate>
+    class lazy_orderby_query_builder : public sorting_query_builder {
+    public:
+        lazy_orderby_query_builder(const Predicate& pred, bool sort_ascending, std::size_t limit, bool stable)
+                : _pred(pred)
+                , _sort_ascending(sort_ascending)
+                , _limit(limit)
+                , _stable(stable)
+        {
+        }
+
+        template<typename Query>
+        lazy_orderby_query<typename std::decay<Query>::type, Predicate> build(Query&& query) const & {
+            return lazy_orderby_query<typename std::decay<Query>::type, Predicate>(
+                    std::forward<Query>(query), _pred, _sort_ascending, _limit, _stable);
+        }
+
+        template<typename Query>
+        lazy_orderby_query<typename std::decay<Query>::type, Predicate> build(Query&& query) && {
+            return lazy_orderby_query<typename std::decay<Query>::type, Predicate>(
+                    std::forward<Query>(query), std::move(_pred), _sort_ascending, _limit, _stable);
+        }
+
+        template<typename Query, class Alloc>
+        lazy_orderby_query<typename std::decay<Query>::type, Predicate,
+                           typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            return lazy_orderby_query<typename std::decay<Query>::type, Predicate,
+                                      typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>(
+                    std::forward<Query>(query), _pred, _sort_ascending, _limit, _stable, allocator);
+        }
+
+        template<class Alloc>
+        allocator_query_builder<lazy_orderby_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<lazy_orderby_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        Predicate _pred;
+        bool _sort_ascending;
+        std::size_t _limit;
+        bool _stable;
+    };
+
+	/*************************************************************//**
+	 * sort_key_traits
+	 *
+	 * How orderby_key turns a key into an unsigned code that sorts the
+	 * same way, so it can be radix sorted. Integral and floating point
+	 * keys are encoded exactly; strings by their first eight bytes, with
+	 * ties resolved on the full key. Other keys are not encoded (radix
+	 * is false) and sorted with operator<.
+	 ****************************************************************/
+    template<typename Key, typename Enable = void>
+    struct sort_key_traits
+    {
+        static const bool radix = false;
+    };
+
+    template<typename Key>
+    struct sort_key_traits<Key, typename std::enable_if<
+            std::is_integral<Key>::value && !std::is_same<Key, bool>::value>::type>
+    {
+        static const bool radix = true;
+        static const bool exact = true;
+        typedef typename std::make_unsigned<Key>::type type;
+
+        static type encode(Key key) {
+            const type sign = static_cast<type>(type(1) << (sizeof(type) * 8 - 1));
+            return static_cast<type>(static_cast<type>(key) ^ (std::is_signed<Key>::value ? sign : type(0)));
+        }
+    };
+
+    template<typename Float, typename Bits>
+    struct float_sort_key_traits
+    {
+        static const bool radix = true;
+        static const bool exact = true;
+        typedef Bits type;
+
+        // Negative values have all bits flipped, so larger magnitudes sort
+        // first; positive ones only the sign bit, to sort after them.
+        // -0.0 compares equal to 0.0 and is encoded the same.
+        static type encode(Float key) {
+            const type sign = type(1) << (sizeof(type) * 8 - 1);
+            if(key == Float(0))
+                key = Float(0);
+            type bits;
+            std::memcpy(&bits, &key, sizeof(bits));
+            return (bits & sign) ? ~bits : (bits | sign);
+        }
+    };
+
+    template<>
+    struct sort_key_traits<float> : float_sort_key_traits<float, std::uint32_t>
+    {
+    };
+
+    template<>
+    struct sort_key_traits<double> : float_sort_key_traits<double, std::uint64_t>
+    {
+    };
+
+    struct string_sort_key_traits
+    {
+        static const bool radix = true;
+        static const bool exact = false;
+        typedef std::uint64_t type;
+
+        template<typename String>
+        static type encode(const String &key) {
+            type code = 0;
+            std::size_t size = std::min<std::size_t>(key.size(), sizeof(type));
+            for(std::size_t i = 0; i < sizeof(type); ++i)
+                code = (code << 8) | (i < size ? static_cast<unsigned char>(key[i]) : 0U);
+            return code;
+        }
+    };
+
+    template<typename Traits, class Alloc>
+    struct sort_key_traits<std::basic_string<char, Traits, Alloc> > : string_sort_key_traits
+    {
+    };
+
+    template<>
+    struct sort_key_traits<string_ref> : string_sort_key_traits
+    {
+    };
+
+	/*************************************************************//**
+	 * radix_sort
+	 *
+	 * Stable LSD radix sort of (code, index) entries, a byte per pass.
+	 * All histograms are counted in one pass over the input and bytes
+	 * that are the same for every entry are skipped.
+	 ****************************************************************/
+    template<typename Code, typename Index>
+    struct radix_entry
+    {
+        typedef Index index_type;
+
+        Code code;
+        Index index;
+    };
+
+    template<typename Code, typename Index, class Alloc>
+    void radix_sort(std::vector<radix_entry<Code, Index>, Alloc> &entries)
+    {
+        typedef radix_entry<Code, Index> entry;
+        const std::size_t count = entries.size();
+        if(count < 256) {
+            std::stable_sort(entries.begin(), entries.end(), [](const entry &lhs, const entry &rhs) {
+                return lhs.code < rhs.code;
+            });
+            return;
+        }
+
+        std::vector<std::size_t> histograms(sizeof(Code) * 256, 0);
+        for(std::size_t i = 0; i < count; ++i) {
+            Code code = entries[i].code;
+            for(std::size_t digit = 0; digit < sizeof(Code); ++digit)
+                ++histograms[digit * 256 + ((code >> (digit * 8)) & 0xff)];
+        }
+
+        std::vector<entry, Alloc> buffer(count, entry(), entries.get_allocator());
+        entry *from = entries.data();
+        entry *to = buffer.data();
+        for(std::size_t digit = 0; digit < sizeof(Code); ++digit) {
+            std::size_t *offsets = &histograms[digit * 256];
+            const std::size_t shift = digit * 8;
+            if(offsets[(from[0].code >> shift) & 0xff] == count)
+                continue;
+
+            std::size_t offset = 0;
+            for(std::size_t bucket = 0; bucket < 256; ++bucket) {
+                std::size_t size = offsets[bucket];
+                offsets[bucket] = offset;
+                offset += size;
+            }
+            for(std::size_t i = 0; i < count; ++i)
+                to[offsets[(from[i].code >> shift) & 0xff]++] = from[i];
+            std::swap(from, to);
+        }
+        if(from != entries.data())
+            entries.swap(buffer);
+    }
+
+	/*************************************************************//**
+	 * key_orderby_query
+	 *
+	 * orderby on a key extracted once per value by key_fn, instead of
+	 * a comparator called O(n log n) times. Keys that sort_key_traits
+	 * can encode are radix sorted as (code, index) pairs; others are
+	 * sorted as (key, index) pairs. The values are then moved into
+	 * place once, so large values are not shuffled by the sort. Equal
+	 * keys keep their input order. Built by orderby_key().
+	 ****************************************************************/
+	template<typename InputType, typename KeyFunction, class A = std::allocator<typename InputType::value_type> >
+    class key_orderby_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef key_orderby_query<InputType, KeyFunction, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+        typedef typename std::vector<value_type, A>::iterator output_iterator;
+        typedef typename std::decay<
+                decltype(std::declval<const KeyFunction&>()(std::declval<const value_type&>()))>::type key_type;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            // const value_type &, but a plain bool for std::vector<bool>.
+            typedef typename std::vector<value_type, A>::const_reference reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::random_access_iterator_tag iterator_category;
+
+            iterator(const output_iterator& current)
+                    : _current(current)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return _current - other._current;
+            }
+
+            reference operator[](difference_type n) const {
+                return _current[n];
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            reference operator*() const {
+                return *_current;
+            }
+
+            pointer operator->() const {
+                return _current.operator->();
+            }
+
+        private:
+            output_iterator _current;
+        };
+
+        template<typename Input, typename KeyFn>
+        key_orderby_query(Input &&container, KeyFn &&key_fn, bool sort_ascending,
+                          const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _key_fn(std::forward<KeyFn>(key_fn))
+                , _sort_ascending(sort_ascending)
+                , _state(std::allocate_shared<sorted_state>(allocator, allocator))
+        {
+        }
+
+        key_orderby_query(const key_orderby_query &other)
+				: _container(other._container)
+                , _key_fn(other._key_fn)
+                , _sort_ascending(other._sort_ascending)
+                , _state(other._state)
+        {
+        }
+
+        key_orderby_query(key_orderby_query &&other)
+				: _container(std::move(other._container))
+                , _key_fn(std::move(other._key_fn))
+                , _sort_ascending(other._sort_ascending)
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~key_orderby_query()
+        {
+        }
+
+        key_orderby_query &operator=(const key_orderby_query &);
+
+        bool operator==(const key_orderby_query &) const;
+
+        bool operator!=(const key_orderby_query &) const;
+
+        iterator begin() const {
+            initialize();
+            return iterator(_state->values.begin());
+        }
+
+        iterator end() const {
+            initialize();
+            return iterator(_state->values.end());
+        }
+
+        void swap(key_orderby_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_key_fn, other._key_fn);
+            std::swap(_sort_ascending, other._sort_ascending);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            return _container.empty();
+        }
+
+        size_type size() const {
+            initialize();
+            return _state->values.size();
+        }
+
+        value_type operator[](size_type n) const {
+            initialize();
+            return _state->values[n];
+        }
+
+        size_bounds size_hint() const {
+            if(_state->ready())
+                return size_bounds::exact(_state->values.size());
+            return _container.size_hint();
+        }
+
+        // Hands over the materialized values, moving them out when no other
+        // copy of this query shares them.
+        std::vector<value_type, A> extract_values() && {
+            initialize();
+            if(sole_owner(_state))
+                return std::move(_state->values);
+            return _state->values;
+        }
+
+        bool ascending() const {
+            return _sort_ascending;
+        }
+
+        allocator_type get_allocator() const {
+            return _state->values.get_allocator();
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        typedef sort_key_traits<key_type> traits;
+        typedef typename std::conditional<
+                std::is_lvalue_reference<decltype(std::declval<const KeyFunction&>()(std::declval<const value_type&>()))>::value,
+                const key_type *, key_type>::type stored_key;
+
+        struct sorted_state : lazy_state {
+            explicit sorted_state(const allocator_type &allocator) : values(allocator) {}
+
+            std::vector<value_type, A> values;
+        };
+
+        void initialize() const
+        {
+            _state->ensure([this]() {
+                _state->values.clear();
+                sort_source(_container);
+            });
+        }
+
+        // Lifted random access ranges are keyed and gathered in place
+        // when their iterators yield real lvalues, whose addresses the
+        // sort keeps. Proxies and by-value iterators are copied first.
+        template<typename InputIterator, class Alloc>
+        void sort_source(const simple_query<InputIterator, Alloc> &source) const
+        {
+            sort_source(source, std::integral_constant<bool,
+                    std::is_base_of<std::random_access_iterator_tag,
+                            typename std::iterator_traits<InputIterator>::iterator_category>::value &&
+                    std::is_lvalue_reference<typename std::iterator_traits<InputIterator>::reference>::value>());
+        }
+
+        template<typename InputIterator, class Alloc>
+        void sort_source(const simple_query<InputIterator, Alloc> &source, std::true_type) const
+        {
+            sort_range(source.source_begin(),
+                       static_cast<std::size_t>(source.source_end() - source.source_begin()),
+                       std::false_type());
+        }
+
+        template<typename Query>
+        void sort_source(const Query &source, std::false_type = std::false_type()) const
+        {
+            std::vector<value_type, A> input(_state->values.get_allocator());
+            input.reserve(source.size_hint().reserve_size());
+            input.insert(input.end(), source.begin(), source.end());
+            sort_range(input.begin(), input.size(), std::true_type());
+        }
+
+        // 32-bit indices halve the entries whenever they suffice.
+        template<typename RandomIterator, typename MoveValues>
+        void sort_range(RandomIterator first, std::size_t count, MoveValues move_values) const
+        {
+            if(count <= std::numeric_limits<std::uint32_t>::max())
+                sort_range<std::uint32_t>(first, count, move_values, std::integral_constant<bool, traits::radix>());
+            else
+                sort_range<std::size_t>(first, count, move_values, std::integral_constant<bool, traits::radix>());
+        }
+
+        template<typename Index, typename RandomIterator, typename MoveValues>
+        void sort_range(RandomIterator first, std::size_t count, MoveValues move_values, std::true_type) const
+        {
+            typedef radix_entry<typename traits::type, Index> entry;
+            typedef std::vector<entry, typename rebind_allocator<A, entry>::type> entries_type;
+            typedef std::vector<stored_key, typename rebind_allocator<A, stored_key>::type> keys_type;
+            entries_type entries(count, entry(), _state->values.get_allocator());
+            // Codes only hold a prefix of inexact keys, so those keys are
+            // kept to order equal codes without calling key_fn again.
+            keys_type keys(_state->values.get_allocator());
+            if(!traits::exact)
+                keys.reserve(count);
+            for(std::size_t i = 0; i < count; ++i) {
+                typename traits::type code;
+                if(traits::exact) {
+                    code = traits::encode(_key_fn(first[i]));
+                }
+                else {
+                    keys.push_back(keep(_key_fn(first[i]), std::is_pointer<stored_key>()));
+                    code = traits::encode(stored(keys.back()));
+                }
+                entries[i].code = _sort_ascending ? code : static_cast<typename traits::type>(~code);
+                entries[i].index = static_cast<Index>(i);
+            }
+            radix_sort(entries);
+
+            if(!traits::exact) {
+                const bool ascending = _sort_ascending;
+                typename entries_type::iterator run = entries.begin();
+                while(run != entries.end()) {
+                    typename entries_type::iterator last = run + 1;
+                    while(last != entries.end() && last->code == run->code)
+                        ++last;
+                    if(last - run > 1) {
+                        std::stable_sort(run, last, [&keys, ascending](const entry &lhs, const entry &rhs) {
+                            const key_type &left = stored(keys[lhs.index]);
+                            const key_type &right = stored(keys[rhs.index]);
+                            return ascending ? left < right : right < left;
+                        });
+                    }
+                    run = last;
+                }
+            }
+            gather(first, entries, move_values);
+        }
+
+        template<typename Index, typename RandomIterator, typename MoveValues>
+        void sort_range(RandomIterator first, std::size_t count, MoveValues move_values, std::false_type) const
+        {
+            typedef radix_entry<key_type, Index> entry;
+            std::vector<entry, typename rebind_allocator<A, entry>::type> entries(_state->values.get_allocator());
+            entries.reserve(count);
+            for(std::size_t i = 0; i < count; ++i) {
+                entry keyed = { _key_fn(first[i]), static_cast<Index>(i) };
+                entries.push_back(std::move(keyed));
+            }
+            const bool ascending = _sort_ascending;
+            std::stable_sort(entries.begin(), entries.end(), [ascending](const entry &lhs, const entry &rhs) {
+                return ascending ? lhs.code < rhs.code : rhs.code < lhs.code;
+            });
+            gather(first, entries, move_values);
+        }
+
+        // Keys key_fn returns by reference live in the values, which stay
+        // put until gather, so only their address is kept.
+        template<typename Key>
+        static const key_type *keep(Key &&key, std::true_type)
+        {
+            return std::addressof(key);
+        }
+
+        template<typename Key>
+        static key_type keep(Key &&key, std::false_type)
+        {
+            return std::forward<Key>(key);
+        }
+
+        static const key_type &stored(const key_type *key)
+        {
+            return *key;
+        }
+
+        static const key_type &stored(const key_type &key)
+        {
+            return key;
+        }
+
+        // Appends first[entries[i].index] in entry order. The reads are
+        // random, so upcoming ones are prefetched.
+        template<typename RandomIterator, typename Entries, typename MoveValues>
+        void gather(RandomIterator first, const Entries &entries, MoveValues move_values) const
+        {
+            std::vector<value_type, A> &values = _state->values;
+            values.reserve(entries.size());
+            for(std::size_t i = 0; i < entries.size(); ++i) {
+                if(i + 16 < entries.size())
+                    prefetch(first[entries[i + 16].index]);
+                append(values, first[entries[i].index], move_values);
+            }
+        }
+
+        template<typename Value>
+        static void prefetch(Value &value)
+        {
+#if defined(__GNUC__)
+            __builtin_prefetch(std::addressof(value));
+#endif
+        }
+
+        // Proxies such as std::vector<bool>'s have nothing to fetch.
+        template<typename Value>
+        static void prefetch(const Value &&)
+        {
+        }
+
+        template<typename Value>
+        static void append(std::vector<value_type, A> &values, Value &&value, std::true_type)
+        {
+            values.push_back(std::move(value));
+        }
+
+        template<typename Value>
+        static void append(std::vector<value_type, A> &values, Value &&value, std::false_type)
+        {
+            values.push_back(value);
+        }
+
+        InputType _container;
+        KeyFunction _key_fn;
+        bool _sort_ascending;
+        std::shared_ptr<sorted_state> _state;
+    };
+
+	/*************************************************************//**
+	 * key_orderby_query_builder
+	 ****************************************************************/
+	template<typename KeyFunction>
+    class key_orderby_query_builder : public sorting_query_builder {
+    public:
+        key_orderby_query_builder(const KeyFunction& key_fn, bool sort_ascending)
+                : _key_fn(key_fn)
+                , _sort_ascending(sort_ascending)
+        {
+        }
+
+        template<typename Query>
+        key_orderby_query<typename std::decay<Query>::type, KeyFunction> build(Query&& query) const & {
+            return key_orderby_query<typename std::decay<Query>::type, KeyFunction>(
+                    std::forward<Query>(query), _key_fn, _sort_ascending);
+        }
+
+        template<typename Query>
+        key_orderby_query<typename std::decay<Query>::type, KeyFunction> build(Query&& query) && {
+            return key_orderby_query<typename std::decay<Query>::type, KeyFunction>(
+                    std::forward<Query>(query), std::move(_key_fn), _sort_ascending);
+        }
+
+        template<typename Query, class Alloc>
+        key_orderby_query<typename std::decay<Query>::type, KeyFunction,
+                          typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            return key_orderby_query<typename std::decay<Query>::type, KeyFunction,
+                                     typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>(
+                    std::forward<Query>(query), _key_fn, _sort_ascending, allocator);
+        }
+
+        template<class Alloc>
+        allocator_query_builder<key_orderby_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<key_orderby_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        KeyFunction _key_fn;
+        bool _sort_ascending;
+    };
+
+	/*************************************************************//**
+	 * then_by_predicate
+	 *
+	 * Orders by first and, among values first ranks equal, by second,
+	 * each in its own direction. Lets orderby(...).then_by(...) sort
+	 * once on the combined key.
+	 ****************************************************************/
+    template<typename First, typename Second>
+    class then_by_predicate {
+    public:
+        then_by_predicate(const First& first, bool first_ascending, const Second& second, bool second_ascending)
+                : _first(first)
+                , _second(second)
+                , _first_ascending(first_ascending)
+                , _second_ascending(second_ascending)
+        {
+        }
+
+        template<typename T>
+        bool operator()(const T& lhs, const T& rhs) const {
+            if(_first_ascending ? _first(lhs, rhs) : _first(rhs, lhs))
+                return true;
+            if(_first_ascending ? _first(rhs, lhs) : _first(lhs, rhs))
+                return false;
+            return _second_ascending ? _second(lhs, rhs) : _second(rhs, lhs);
+        }
+
+    private:
+        First _first;
+        Second _second;
+        bool _first_ascending;
+        bool _second_ascending;
+    };
+
+	/*************************************************************//**
+	 * orderby_query_builder
+	 ****************************************************************/
+    template<typename Predicate>
+    class orderby_query_builder : public sorting_query_builder {
+    public:
+        orderby_query_builder(const Predicate& pred, bool sort_ascending,
+                              std::size_t limit = std::numeric_limits<std::size_t>::max(),
+                              bool stable = false)
+                : _pred(pred)
+                , _sort_ascending(sort_ascending)
+                , _limit(limit)
+                , _stable(stable)
+        {
+        }
+
+        template<typename Query>
+        orderby_query<typename std::decay<Query>::type, Predicate> build(Query&& query) const & {
+            return orderby_query<typename std::decay<Query>::type, Predicate>(
+                    std::forward<Query>(query), _pred, _sort_ascending, _limit, _stable);
+
+        }
+
+        template<typename Query>
+        orderby_query<typename std::decay<Query>::type, Predicate> build(Query&& query) && {
+            return orderby_query<typename std::decay<Query>::type, Predicate>(
+                    std::forward<Query>(query), std::move(_pred), _sort_ascending, _limit, _stable);
+
+        }
+
+        template<typename Query, class Alloc>
+        orderby_query<typename std::decay<Query>::type, Predicate,
+                      typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            return orderby_query<typename std::decay<Query>::type, Predicate,
+                                 typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>(
+                    std::forward<Query>(query), _pred, _sort_ascending, _limit, _stable, allocator);
+        }
+
+        // Keeps the sorted values in memory from allocator, e.g. an
+        // arena_allocator.
+        template<class Alloc>
+        allocator_query_builder<orderby_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<orderby_query_builder, Alloc>(*this, allocator);
+        }
+
+        // Breaks ties of this ordering with pred, in the same single sort.
+        template<typename Then>
+        orderby_query_builder<then_by_predicate<Predicate, Then> >
+        then_by(const Then& pred, bool sort_ascending = true) const {
+            return orderby_query_builder<then_by_predicate<Predicate, Then> >(
+                    then_by_predicate<Predicate, Then>(_pred, _sort_ascending, pred, sort_ascending),
+                    true, _limit, _stable);
+        }
+
+        // Keeps equal values in input order, sorting with std::stable_sort.
+        orderby_query_builder stable() const {
+            return orderby_query_builder(_pred, _sort_ascending, _limit, true);
+        }
+
+        // Sorts in runs of at most bytes (see spill_traits), spilling
+        // them to temporary files, instead of all in memory.
+        external_orderby_query_builder<Predicate> with_memory_budget(std::size_t bytes) const & {
+            return external_orderby_query_builder<Predicate>(_pred, _sort_ascending, _limit, _stable, bytes);
+        }
+
+        external_orderby_query_builder<Predicate> with_memory_budget(std::size_t bytes) && {
+            return external_orderby_query_builder<Predicate>(std::move(_pred), _sort_ascending, _limit, _stable, bytes);
+        }
+
+        // Sorts on demand while the result is read, see lazy_orderby_query.
+        lazy_orderby_query_builder<Predicate> lazy() const & {
+            return lazy_orderby_query_builder<Predicate>(_pred, _sort_ascending, _limit, _stable);
+        }
+
+        lazy_orderby_query_builder<Predicate> lazy() && {
+            return lazy_orderby_query_builder<Predicate>(std::move(_pred), _sort_ascending, _limit, _stable);
+        }
+
+    private:
+        Predicate _pred;
+        bool _sort_ascending;
+        std::size_t _limit;
+        bool _stable;
+    };
+
+	/*************************************************************//**
+	 * then_by_query_builder
+	 *
+	 * Adds a tie-breaking key to an orderby query that has not been
+	 * sorted, replacing it with one orderby on the combined key rather
+	 * than sorting a second time.
+	 ****************************************************************/
+    template<typename Predicate>
+    class then_by_query_builder : public sorting_query_builder {
+    public:
+        then_by_query_builder(const Predicate& pred, bool sort_ascending)
+                : _pred(pred)
+                , _sort_ascending(sort_ascending)
+        {
+        }
+
+        template<typename InputType, typename First, class A>
+        orderby_query<InputType, then_by_predicate<First, Predicate>, A>
+        build(const orderby_query<InputType, First, A>& query) const {
+            return orderby_query<InputType, then_by_predicate<First, Predicate>, A>(
+                    query.source(),
+                    then_by_predicate<First, Predicate>(query.predicate(), query.ascending(), _pred, _sort_ascending),
+                    true, query.limit(), query.stable(), query.get_allocator());
+        }
+
+    private:
+        Predicate _pred;
+        bool _sort_ascending;
+    };
+
+	/*************************************************************//**
+	 * take_query
+	 *
+	 * The first count values of the input. The upstream iterator is not
+	 * advanced past the last value taken, so a filtering or generating
+	 * upstream does no work beyond it.
+	 ****************************************************************/
+    template<typename InputType>
+    class take_query {
+    public:
+        typedef std::allocator<typename InputType::value_type> A;
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef take_query<InputType> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef typename value_reference<input_iterator, value_type>::type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<
+                    input_iterator, std::forward_iterator_tag>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    size_type remaining)
+                    : _current(current)
+                    , _last(last)
+                    , _remaining(remaining)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _remaining(other._remaining)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _remaining = other._remaining;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                if(at_end())
+                    return other.at_end();
+                return !other.at_end() && _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !(*this == other);
+            }
+
+            iterator &operator++() {
+                assert(!at_end());
+                if(--_remaining != 0)
+                    ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            reference operator*() const {
+                assert(!at_end());
+                return *_current;
+            }
+
+            pointer operator->() const {
+                assert(!at_end());
+                return _current.operator->();
+            }
+
+        private:
+            bool at_end() const {
+                return _remaining == 0 || _current == _last;
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            size_type _remaining;
+        };
+
+        class batch_cursor {
+        public:
+            typedef typename batch_cursor_of<InputType>::type input_cursor;
+
+            batch_cursor(const InputType &container, size_type count)
+                    : _input(batch_cursor_of<InputType>::make(container))
+                    , _remaining(count)
+            {
+            }
+
+            // Never asks the input for more than the values still to take.
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                std::size_t wanted = std::min<std::size_t>(capacity, _remaining);
+                std::size_t read = wanted != 0 ? _input.next_batch(out, wanted) : 0;
+                _remaining = read < wanted ? 0 : _remaining - read;
+                return read;
+            }
+
+        private:
+            input_cursor _input;
+            size_type _remaining;
+        };
+
+        template<typename Input>
+        take_query(Input &&container, size_type count)
+				: _container(std::forward<Input>(container)), _count(count) {
+        }
+
+        take_query(const take_query &other)
+				: _container(other._container), _count(other._count) {
+        }
+
+        take_query(take_query &&other)
+				: _container(std::move(other._container)), _count(other._count) {
+        }
+
+        ~take_query() {
+        }
+
+        take_query &operator=(const take_query &);
+
+        bool operator==(const take_query &) const;
+
+        bool operator!=(const take_query &) const;
+
+        iterator begin() const {
+            input_iterator last = _container.end();
+            if(_count == 0)
+                return iterator(last, last, 0);
+			return iterator(_container.begin(), last, _count);
+        }
+
+        iterator end() const {
+            input_iterator last = _container.end();
+			return iterator(last, last, 0);
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_container, _count);
+        }
+
+        void swap(take_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_count, other._count);
+        }
+
+        bool empty() const {
+			return _count == 0 || _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(std::min<std::size_t>(bounds.lower, _count),
+                                        std::min<std::size_t>(bounds.upper, _count));
+        }
+
+        size_type count() const {
+            return _count;
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        size_type _count;
+    };
+
+    template<typename InputType>
+    struct native_batches<take_query<InputType> > : native_batches<InputType>
+    {
+    };
+
+	/*************************************************************//**
+	 * take_query_builder
+	 *
+	 * A take_query, except over orderby and lazy orderby, which limit
+	 * their own sort.
+	 ****************************************************************/
+    class take_query_builder {
+    public:
+        take_query_builder(std::size_t count)
+                : _count(count)
+        {
+        }
+
+        template<typename Query>
+        take_query<typename std::decay<Query>::type> build(Query&& query) const {
+            return take_query<typename std::decay<Query>::type>(std::forward<Query>(query), _count);
+        }
+
+        template<typename InputType, typename Predicate, class A>
+        orderby_query<InputType, Predicate, A> build(const orderby_query<InputType, Predicate, A>& query) const {
+            return orderby_query<InputType, Predicate, A>(query, _count);
+        }
+
+        template<typename InputType, typename Predicate, class A>
+        orderby_query<InputType, Predicate, A> build(orderby_query<InputType, Predicate, A>&& query) const {
+            return orderby_query<InputType, Predicate, A>(std::move(query), _count);
+        }
+
+        template<typename InputType, typename Predicate, class A>
+        lazy_orderby_query<InputType, Predicate, A> build(const lazy_orderby_query<InputType, Predicate, A>& query) const {
+            return lazy_orderby_query<InputType, Predicate, A>(query, _count);
+        }
+
+        template<typename InputType, typename Predicate, class A>
+        lazy_orderby_query<InputType, Predicate, A> build(lazy_orderby_query<InputType, Predicate, A>&& query) const {
+            return lazy_orderby_query<InputType, Predicate, A>(std::move(query), _count);
+        }
+
+    private:
+        std::size_t _count;
+    };
+
+	/*************************************************************//**
+	 * skip_query
+	 *
+	 * The input without its first count values. Iterates with the
+	 * input's own iterators; begin() steps over the skipped values in
+	 * O(1) when they are random access.
+	 ****************************************************************/
+    template<typename InputType>
+    class skip_query {
+    public:
+        typedef std::allocator<typename InputType::value_type> A;
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef skip_query<InputType> this_type;
+		typedef typename InputType::iterator iterator;
+
+        template<typename Input>
+        skip_query(Input &&container, size_type count)
+				: _container(std::forward<Input>(container)), _count(count) {
+        }
+
+        skip_query(const skip_query &other)
+				: _container(other._container), _count(other._count) {
+        }
+
+        skip_query(skip_query &&other)
+				: _container(std::move(other._container)), _count(other._count) {
+        }
+
+        ~skip_query() {
+        }
+
+        skip_query &operator=(const skip_query &);
+
+        bool operator==(const skip_query &) const;
+
+        bool operator!=(const skip_query &) const;
+
+        iterator begin() const {
+            iterator first = _container.begin();
+            iterator last = _container.end();
+            advance(first, last, typename iterator_category_of<iterator>::type());
+            return first;
+        }
+
+        iterator end() const {
+			return _container.end();
+        }
+
+        void swap(skip_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_count, other._count);
+        }
+
+        bool empty() const {
+			return _container.empty() || _container.size_hint().upper <= _count;
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(
+                    bounds.lower - std::min<std::size_t>(bounds.lower, _count),
+                    bounds.upper == size_bounds::unbounded()
+                            ? bounds.upper : bounds.upper - std::min<std::size_t>(bounds.upper, _count));
+        }
+
+        size_type count() const {
+            return _count;
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        void advance(iterator &first, const iterator &last, std::random_access_iterator_tag) const {
+            first += static_cast<difference_type>(std::min<size_type>(_count, static_cast<size_type>(last - first)));
+        }
+
+        void advance(iterator &first, const iterator &last, std::input_iterator_tag) const {
+            for(size_type i = 0; i < _count && first != last; ++i)
+                ++first;
+        }
+
+        InputType _container;
+        size_type _count;
+    };
+
+	/*************************************************************//**
+	 * skip_query_builder
+	 ****************************************************************/
+    class skip_query_builder {
+    public:
+        skip_query_builder(std::size_t count)
+                : _count(count)
+        {
+        }
+
+        template<typename Query>
+        skip_query<typename std::decay<Query>::type> build(Query&& query) const {
+            return skip_query<typename std::decay<Query>::type>(std::forward<Query>(query), _count);
+        }
+
+    private:
+        std::size_t _count;
+    };
+
+	/*************************************************************//**
+	 * take_while_query
+	 *
+	 * The values of the input up to the first one the predicate
+	 * rejects, which is read but not yielded; nothing after it is read.
+	 ****************************************************************/
+	template<typename InputType, typename Predicate>
+    class take_while_query {
+    public:
+        typedef std::allocator<typename InputType::value_type> A;
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef take_while_query<InputType, Predicate> this_type;
+		typedef typename InputType::iterator input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef typename value_reference<input_iterator, value_type>::type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<
+                    input_iterator, std::forward_iterator_tag>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    const Predicate& pred)
+                    : _current(current)
+                    , _last(last)
+                    , _pred(pred)
+                    , _done(true)
+            {
+                check();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _pred(other._pred)
+                    , _done(other._done)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _pred = other._pred;
+                _done = other._done;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                if(_done)
+                    return other._done;
+                return !other._done && _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !(*this == other);
+            }
+
+            iterator &operator++() {
+                assert(!_done);
+                ++_current;
+                check();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            reference operator*() const {
+                assert(!_done);
+                return *_current;
+            }
+
+            pointer operator->() const {
+                assert(!_done);
+                return _current.operator->();
+            }
+
+        private:
+            void check() {
+                _done = _current == _last || !_pred(*_current);
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            assignable_function<Predicate> _pred;
+            bool _done;
+        };
+
+        template<typename Input, typename Pred>
+        take_while_query(Input &&container, Pred &&pred)
+				: _container(std::forward<Input>(container)), _pred(std::forward<Pred>(pred)) {
+        }
+
+        take_while_query(const take_while_query &other)
+				: _container(other._container), _pred(other._pred) {
+        }
+
+        take_while_query(take_while_query &&other)
+				: _container(std::move(other._container)), _pred(std::move(other._pred)) {
+        }
+
+        ~take_while_query() {
+        }
+
+        take_while_query &operator=(const take_while_query &);
+
+        bool operator==(const take_while_query &) const;
+
+        bool operator!=(const take_while_query &) const;
+
+        iterator begin() const {
+			return iterator(_container.begin(), _container.end(), _pred);
+        }
+
+        iterator end() const {
+            input_iterator last = _container.end();
+			return iterator(last, last, _pred);
+        }
+
+        void swap(take_while_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_pred, other._pred);
+        }
+
+        bool empty() const {
+			return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::between(0, _container.size_hint().upper);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        Predicate _pred;
+    };
+
+	/*************************************************************//**
+	 * take_while_query_builder
+	 ****************************************************************/
+	template<typename Predicate>
+    class take_while_query_builder {
+    public:
+        take_while_query_builder(const Predicate& pred) : _pred(pred) {
+        }
+
+        template<typename Query>
+        take_while_query<typename std::decay<Query>::type, Predicate> build(Query&& query) const {
+            return take_while_query<typename std::decay<Query>::type, Predicate>(std::forward<Query>(query), _pred);
+        }
+
+    private:
+        Predicate _pred;
+    };
+
+	/*************************************************************//**
+	 * skip_while_query
+	 *
+	 * The input from the first value the predicate rejects on, read
+	 * with the input's own iterators.
+	 ****************************************************************/
+	template<typename InputType, typename Predicate>
+    class skip_while_query {
+    public:
+        typedef std::allocator<typename InputType::value_type> A;
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef skip_while_query<InputType, Predicate> this_type;
+		typedef typename InputType::iterator iterator;
+
+        template<typename Input, typename Pred>
+        skip_while_query(Input &&container, Pred &&pred)
+				: _container(std::forward<Input>(container)), _pred(std::forward<Pred>(pred)) {
+        }
+
+        skip_while_query(const skip_while_query &other)
+				: _container(other._container), _pred(other._pred) {
+        }
+
+        skip_while_query(skip_while_query &&other)
+				: _container(std::move(other._container)), _pred(std::move(other._pred)) {
+        }
+
+        ~skip_while_query() {
+        }
+
+        skip_while_query &operator=(const skip_while_query &);
+
+        bool operator==(const skip_while_query &) const;
+
+        bool operator!=(const skip_while_query &) const;
+
+        iterator begin() const {
+            iterator first = _container.begin();
+            iterator last = _container.end();
+            while(first != last && _pred(*first))
+                ++first;
+            return first;
+        }
+
+        iterator end() const {
+			return _container.end();
+        }
+
+        void swap(skip_while_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_pred, other._pred);
+        }
+
+        bool empty() const {
+			return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::between(0, _container.size_hint().upper);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        Predicate _pred;
+    };
+
+	/*************************************************************//**
+	 * skip_while_query_builder
+	 ****************************************************************/
+	template<typename Predicate>
+    class skip_while_query_builder {
+    public:
+        skip_while_query_builder(const Predicate& pred) : _pred(pred) {
+        }
+
+        template<typename Query>
+        skip_while_query<typename std::decay<Query>::type, Predicate> build(Query&& query) const {
+            return skip_while_query<typename std::decay<Query>::type, Predicate>(std::forward<Query>(query), _pred);
+        }
+
+    private:
+        Predicate _pred;
+    };
+
+
+	/*************************************************************//**
+	 * zip_with_query
+	 ****************************************************************/
+    template<typename InputType, typename OtherInputType,
+		class A = std::allocator<std::pair<typename InputType::value_type, typename OtherInputType::value_type > > >
+    class zip_with_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+        typedef zip_with_query<InputType, OtherInputType, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+		typedef typename OtherInputType::iterator other_input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename std::common_type<
+                    typename iterator_category_of<input_iterator>::type,
+                    typename iterator_category_of<other_input_iterator>::type>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const other_input_iterator& other_current)
+                    : _current(current)
+                    , _other_current(other_current)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _other_current(other._other_current)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _other_current = other._other_current;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current ||
+                       _other_current == other._other_current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current &&
+                       _other_current != other._other_current;
+            }
+
+            iterator &operator++() {
+                ++_current;
+                ++_other_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                --_other_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                _other_current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                _other_current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            // The shorter side bounds the distance, as it does for operator==.
+            difference_type operator-(const iterator &other) const {
+                difference_type distance = _current - other._current;
+                difference_type other_distance = _other_current - other._other_current;
+                if(distance < 0)
+                    return std::max(distance, other_distance);
+                return std::min(distance, other_distance);
+            }
+
+            value_type operator[](difference_type n) const {
+                return std::make_pair(_current[n], _other_current[n]);
+            }
+
+            bool operator<(const iterator &other) const {
+                return *this - other < 0;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            value_type operator*() const {
+                return std::make_pair(*_current, *_other_current);
+            }
+
+        private:
+            input_iterator _current;
+			other_input_iterator _other_current;
+        };
+
+        class batch_cursor {
+        public:
+            typedef typename batch_cursor_of<InputType>::type input_cursor;
+            typedef typename batch_cursor_of<OtherInputType>::type other_input_cursor;
+            typedef typename InputType::value_type input_value_type;
+            typedef typename OtherInputType::value_type other_input_value_type;
+
+            batch_cursor(const InputType &container, const OtherInputType &otherContainer)
+                    : _input(batch_cursor_of<InputType>::make(container))
+                    , _other_input(batch_cursor_of<OtherInputType>::make(otherContainer))
+            {
+            }
+
+            std::size_t next_batch(value_type *out, std::size_t capacity) {
+                std::size_t count = 0;
+                while(count < capacity) {
+                    std::size_t wanted = std::min(capacity - count, batch_size);
+                    std::size_t read = std::min(_input.next_batch(_buffer, wanted),
+                                                _other_input.next_batch(_other_buffer, wanted));
+                    for(std::size_t i = 0; i < read; ++i)
+                        out[count + i] = value_type(std::move(_buffer[i]), std::move(_other_buffer[i]));
+                    count += read;
+                    if(read < wanted)
+                        break;
+                }
+                return count;
+            }
+
+        private:
+            input_cursor _input;
+            other_input_cursor _other_input;
+            input_value_type _buffer[batch_size];
+            other_input_value_type _other_buffer[batch_size];
+        };
+
+        template<typename Input, typename OtherInput>
+        zip_with_query(
+                Input &&container,
+                OtherInput &&otherContainer)
+                : _container(std::forward<Input>(container))
+                , _otherContainer(std::forward<OtherInput>(otherContainer))
+        {
+        }
+
+        zip_with_query(const zip_with_query &other)
+				: _container(other._container)
+				, _otherContainer(other._otherContainer)
+        {
+        }
+
+        zip_with_query(zip_with_query &&other)
+				: _container(std::move(other._container))
+				, _otherContainer(std::move(other._otherContainer))
+        {
+        }
+
+        ~zip_with_query() {
+        }
+
+        zip_with_query &operator=(const zip_with_query &);
+
+        bool operator==(const zip_with_query &) const;
+
+        bool operator!=(const zip_with_query &) const;
+
+        iterator begin() const {
+            return iterator(_container.begin(), _otherContainer.begin());
+        }
+
+        iterator end() const {
+			return iterator(_container.end(), _otherContainer.end());
+        }
+
+        batch_cursor batches() const {
+            return batch_cursor(_container, _otherContainer);
+        }
+
+        void swap(zip_with_query &other) {
+			std::swap(_container, other._container);
+			std::swap(_otherContainer, other._otherContainer);
+        }
+
+        bool empty() const {
+			return _container.empty() || _otherContainer.empty();
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            size_bounds other = _otherContainer.size_hint();
+            return size_bounds::between(std::min(bounds.lower, other.lower), std::min(bounds.upper, other.upper));
+        }
+
+        size_type source_size() const {
+            return std::min<size_type>(_container.source_size(), _otherContainer.source_size());
+        }
+
+        size_type size() const {
+            return std::min<size_type>(_container.size(), _otherContainer.size());
+        }
+
+        value_type operator[](size_type n) const {
+            return std::make_pair(_container[n], _otherContainer[n]);
+        }
+
+        this_type slice(size_type first, size_type last) const {
+            return this_type(_container.slice(first, last), _otherContainer.slice(first, last));
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        OtherInputType _otherContainer;
+    };
+
+    template<typename InputType, typename OtherInputType, class A>
+    struct is_partitionable<zip_with_query<InputType, OtherInputType, A> >
+            : std::integral_constant<bool,
+                    is_partitionable<InputType>::value && is_partitionable<OtherInputType>::value &&
+                    is_position_aligned<InputType>::value && is_position_aligned<OtherInputType>::value>
+    {
+    };
+
+    template<typename InputType, typename OtherInputType, class A>
+    struct is_position_aligned<zip_with_query<InputType, OtherInputType, A> >
+            : std::integral_constant<bool,
+                    is_position_aligned<InputType>::value && is_position_aligned<OtherInputType>::value>
+    {
+    };
+
+    template<typename InputType, typename OtherInputType, class A>
+    struct native_batches<zip_with_query<InputType, OtherInputType, A> >
+            : std::integral_constant<bool,
+                    std::is_default_constructible<typename InputType::value_type>::value &&
+                    std::is_default_constructible<typename OtherInputType::value_type>::value>
+    {
+    };
+
+	/*************************************************************//**
+	 * zip_with_query_builder
+	 ****************************************************************/
+    template<typename OtherType>
+    class zip_with_query_builder {
+    public:
+
+        zip_with_query_builder(const OtherType& other)
+                : _other(other) {
+        }
+
+        zip_with_query_builder(OtherType&& other)
+                : _other(std::move(other)) {
+        }
+
+        template<typename Query>
+        zip_with_query<typename std::decay<Query>::type, OtherType> build(Query&& query) const & {
+            return zip_with_query<typename std::decay<Query>::type, OtherType>(std::forward<Query>(query), _other);
+        }
+
+        template<typename Query>
+        zip_with_query<typename std::decay<Query>::type, OtherType> build(Query&& query) && {
+            return zip_with_query<typename std::decay<Query>::type, OtherType>(std::forward<Query>(query), std::move(_other));
+        }
+
+    private:
+        OtherType _other;
+    };
+
+
+	/*************************************************************//**
+	 * parallel_query
+	 *
+	 * Materializes its input on several threads. Partitionable inputs are
+	 * split by source position and the chunks concatenated in order; an
+	 * orderby over a partitionable input sorts each chunk on its own thread
+	 * and merges the sorted runs. Anything else is evaluated sequentially.
+	 ****************************************************************/
+	template<typename InputType, class A = std::allocator<typename InputType::value_type> >
+    class parallel_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef parallel_query<InputType, A> this_type;
+        typedef std::vector<value_type> chunk_type;
+        typedef typename chunk_type::const_iterator output_iterator;
+
+        // Chunks smaller than this are not worth a thread of their own.
+        static size_type min_chunk_size() {
+            return 1U << 14;
+        }
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef const value_type &reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::random_access_iterator_tag iterator_category;
+
+            iterator(const output_iterator& current)
+                    : _current(current)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return _current - other._current;
+            }
+
+            reference operator[](difference_type n) const {
+                return _current[n];
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            reference operator*() const {
+                return *_current;
+            }
+
+            const value_type *operator->() const {
+                return &*_current;
+            }
+
+        private:
+            output_iterator _current;
+        };
+
+        parallel_query(
+                const InputType &container,
+                unsigned threads)
+				: _container(container)
+                , _threads(threads)
+                , _state(std::make_shared<state>())
+        {
+        }
+
+        parallel_query(
+                InputType &&container,
+                unsigned threads)
+				: _container(std::move(container))
+                , _threads(threads)
+                , _state(std::make_shared<state>())
+        {
+        }
+
+        parallel_query(const parallel_query &other)
+				: _container(other._container)
+                , _threads(other._threads)
+                , _state(other._state)
+        {
+        }
+
+        parallel_query(parallel_query &&other)
+				: _container(std::move(other._container))
+                , _threads(other._threads)
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~parallel_query()
+        {
+        }
+
+        parallel_query &operator=(const parallel_query &);
+
+        bool operator==(const parallel_query &) const;
+
+        bool operator!=(const parallel_query &) const;
+
+        iterator begin() const {
+            initialize();
+            return iterator(_state->values.begin());
+        }
+
+        iterator end() const {
+            initialize();
+            return iterator(_state->values.end());
+        }
+
+        void swap(parallel_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_threads, other._threads);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            if(_state->ready())
+                return size_bounds::exact(_state->values.size());
+            return _container.size_hint();
+        }
+
+        // Hands over the materialized values, moving them out when no other
+        // copy of this query shares them.
+        chunk_type extract_values() && {
+            initialize();
+            if(sole_owner(_state))
+                return std::move(_state->values);
+            return _state->values;
+        }
+
+        size_type size() const {
+            initialize();
+            return _state->values.size();
+        }
+
+        value_type operator[](size_type n) const {
+            initialize();
+            return _state->values[n];
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        struct state : lazy_state {
+            state() : values() {}
+
+            chunk_type values;
+        };
+
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            _state->values.clear();
+            if(_container.empty())
+                return;
+
+            evaluate(_container, is_partitionable<InputType>());
+        }
+
+        template<typename Query>
+        void evaluate(const Query &query, std::true_type) const
+        {
+            std::vector<chunk_type> chunks = run_chunks(query.source_size(),
+                    [&query](size_type first, size_type last, chunk_type &chunk) {
+                        append_values(chunk, query.slice(first, last));
+                    });
+            concatenate(chunks);
+        }
+
+        template<typename Query>
+        void evaluate(const Query &query, std::false_type) const
+        {
+            append_values(_state->values, query);
+        }
+
+        template<typename SortInput, typename Predicate, class SortA>
+        void evaluate(const orderby_query<SortInput, Predicate, SortA> &query, std::false_type) const
+        {
+            evaluate_sorted(query, is_partitionable<SortInput>());
+        }
+
+        template<typename Query>
+        void evaluate_sorted(const Query &query, std::false_type) const
+        {
+            _state->values.insert(_state->values.end(), query.begin(), query.end());
+        }
+
+        template<typename SortInput, typename Predicate, class SortA>
+        void evaluate_sorted(const orderby_query<SortInput, Predicate, SortA> &query, std::true_type) const
+        {
+            // Chunks sort on their own threads, so they keep to the default
+            // allocator even when the query has its own.
+            typedef orderby_query<SortInput, Predicate> sort_type;
+
+            // Every chunk is an orderby of its own, so a top-k limit is also
+            // applied per chunk before the runs are merged.
+            std::vector<chunk_type> chunks = run_chunks(query.source().source_size(),
+                    [&query](size_type first, size_type last, chunk_type &chunk) {
+                        sort_type part(query.source().slice(first, last),
+                                       query.predicate(), query.ascending(), query.limit(), query.stable());
+                        chunk.insert(chunk.end(), part.begin(), part.end());
+                    });
+
+            std::vector<size_type> bounds(1, 0U);
+            for(size_type i = 0; i < chunks.size(); ++i)
+                bounds.push_back(bounds.back() + chunks[i].size());
+            concatenate(chunks);
+
+            const Predicate &pred = query.predicate();
+            if(query.ascending()) {
+                merge_runs(bounds, [&pred](const value_type &lhs, const value_type &rhs) {
+                    return pred(lhs, rhs);
+                });
+            } else {
+                merge_runs(bounds, [&pred](const value_type &lhs, const value_type &rhs) {
+                    return pred(rhs, lhs);
+                });
+            }
+
+            if(_state->values.size() > query.limit())
+                _state->values.resize(query.limit());
+        }
+
+        unsigned thread_count() const
+        {
+            unsigned threads = _threads ? _threads : std::thread::hardware_concurrency();
+            return threads ? threads : 1U;
+        }
+
+        template<typename Function>
+        std::vector<chunk_type> run_chunks(size_type size, Function fn) const
+        {
+            size_type count = std::min<size_type>(thread_count(), size / min_chunk_size());
+            if(count == 0)
+                count = 1;
+
+            std::vector<chunk_type> chunks(count);
+            std::vector<std::exception_ptr> errors(count);
+            std::vector<std::thread> workers;
+            workers.reserve(count - 1);
+
+            auto work = [&](size_type index) {
+                try {
+                    fn(size * index / count, size * (index + 1) / count, chunks[index]);
+                } catch(...) {
+                    errors[index] = std::current_exception();
+                }
+            };
+
+            for(size_type i = 1; i < count; ++i)
+                workers.push_back(std::thread(work, i));
+            work(0);
+            for(size_type i = 0; i < workers.size(); ++i)
+                workers[i].join();
+
+            for(size_type i = 0; i < count; ++i) {
+                if(errors[i])
+                    std::rethrow_exception(errors[i]);
+            }
+            return chunks;
+        }
+
+        void concatenate(std::vector<chunk_type> &chunks) const
+        {
+            if(chunks.size() == 1) {
+                _state->values.swap(chunks.front());
+                return;
+            }
+
+            size_type total = 0;
+            for(size_type i = 0; i < chunks.size(); ++i)
+                total += chunks[i].size();
+            _state->values.reserve(total);
+            for(size_type i = 0; i < chunks.size(); ++i) {
+                _state->values.insert(_state->values.end(),
+                               std::make_move_iterator(chunks[i].begin()),
+                               std::make_move_iterator(chunks[i].end()));
+                chunk_type().swap(chunks[i]);
+            }
+        }
+
+        // Pairwise merges of adjacent sorted runs, each round on its own threads.
+        template<typename Compare>
+        void merge_runs(std::vector<size_type> bounds, Compare comp) const
+        {
+            typedef typename chunk_type::iterator value_iterator;
+            while(bounds.size() > 2) {
+                std::vector<size_type> merged(1, 0U);
+                std::vector<std::thread> workers;
+                for(size_type i = 0; i + 1 < bounds.size(); i += 2) {
+                    if(i + 2 < bounds.size()) {
+                        value_iterator first = _state->values.begin() + bounds[i];
+                        value_iterator middle = _state->values.begin() + bounds[i + 1];
+                        value_iterator last = _state->values.begin() + bounds[i + 2];
+                        workers.push_back(std::thread([first, middle, last, comp]() {
+                            std::inplace_merge(first, middle, last, comp);
+                        }));
+                        merged.push_back(bounds[i + 2]);
+                    } else {
+                        merged.push_back(bounds[i + 1]);
+                    }
+                }
+                for(size_type i = 0; i < workers.size(); ++i)
+                    workers[i].join();
+                bounds.swap(merged);
+            }
+        }
+
+        InputType _container;
+        unsigned _threads;
+        std::shared_ptr<state> _state;
+    };
+
+	/*************************************************************//**
+	 * parallel_query_builder
+	 ****************************************************************/
+    class parallel_query_builder {
+    public:
+        parallel_query_builder(unsigned threads)
+                : _threads(threads)
+        {
+        }
+
+        template<typename Query>
+        parallel_query<typename std::decay<Query>::type> build(Query&& query) const {
+            return parallel_query<typename std::decay<Query>::type>(std::forward<Query>(query), _threads);
+        }
+
+    private:
+        unsigned _threads;
+    };
+
+
+	/*************************************************************//**
+	 * fold_aggregator
+	 *
+	 * Starts every group from seed and folds values in with
+	 * fn(accumulator, value), which returns the new accumulator.
+	 ****************************************************************/
+    template<typename Seed, typename Function>
+    class fold_aggregator {
+    public:
+        typedef Seed result_type;
+
+        fold_aggregator(const Seed &seed, const Function &fn)
+                : _seed(seed)
+                , _fn(fn)
+        {
+        }
+
+        result_type seed() const {
+            return _seed;
+        }
+
+        template<typename Value>
+        void accumulate(result_type &accumulator, Value &&value) const {
+            accumulator = _fn(std::move(accumulator), std::forward<Value>(value));
+        }
+
+    private:
+        Seed _seed;
+        Function _fn;
+    };
+
+	/*************************************************************//**
+	 * collect_aggregator
+	 *
+	 * Keeps every value of a group, in input order.
+	 ****************************************************************/
+    template<typename T>
+    class collect_aggregator {
+    public:
+        typedef std::vector<T> result_type;
+
+        result_type seed() const {
+            return result_type();
+        }
+
+        template<typename Value>
+        void accumulate(result_type &accumulator, Value &&value) const {
+            accumulator.push_back(std::forward<Value>(value));
+        }
+    };
+
+	/*************************************************************//**
+	 * group_by_query
+	 *
+	 * Hashes every input value by key_fn and folds it into its group's
+	 * accumulator in place. Groups come out in order of first occurrence
+	 * as (key, aggregate) pairs.
+	 ****************************************************************/
+    template<typename InputType, typename KeyFunction, typename Aggregator>
+    struct group_by_value
+    {
+        typedef std::pair<typename std::decay<typename function_traits<
+                KeyFunction, typename InputType::value_type>::return_type>::type,
+                typename Aggregator::result_type> type;
+    };
+
+    template<typename InputType, typename KeyFunction, typename Aggregator,
+             class A = std::allocator<typename group_by_value<InputType, KeyFunction, Aggregator>::type> >
+    class group_by_query {
+    public:
+        typedef typename InputType::value_type input_value_type;
+        typedef typename std::decay<
+                typename function_traits<KeyFunction, input_value_type>::return_type>::type key_type;
+        typedef typename Aggregator::result_type aggregate_type;
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef group_by_query<InputType, KeyFunction, Aggregator, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+        typedef flat_hash_table<key_type, aggregate_type, std::hash<key_type>, std::equal_to<key_type>, A> table_type;
+        typedef typename table_type::const_iterator output_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef const value_type &reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::random_access_iterator_tag iterator_category;
+
+            iterator(const output_iterator& current)
+                    : _current(current)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                ++_current;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            iterator &operator--() {
+                --_current;
+                return *this;
+            }
+
+            iterator operator--(int) {
+                iterator previous(*this);
+                --*this;
+                return previous;
+            }
+
+            iterator &operator+=(difference_type n) {
+                _current += n;
+                return *this;
+            }
+
+            iterator &operator-=(difference_type n) {
+                _current -= n;
+                return *this;
+            }
+
+            iterator operator+(difference_type n) const {
+                iterator result(*this);
+                return result += n;
+            }
+
+            friend iterator operator+(difference_type n, const iterator &it) {
+                return it + n;
+            }
+
+            iterator operator-(difference_type n) const {
+                iterator result(*this);
+                return result -= n;
+            }
+
+            difference_type operator-(const iterator &other) const {
+                return _current - other._current;
+            }
+
+            reference operator[](difference_type n) const {
+                return _current[n];
+            }
+
+            bool operator<(const iterator &other) const {
+                return _current < other._current;
+            }
+
+            bool operator>(const iterator &other) const {
+                return other < *this;
+            }
+
+            bool operator<=(const iterator &other) const {
+                return !(other < *this);
+            }
+
+            bool operator>=(const iterator &other) const {
+                return !(*this < other);
+            }
+
+            reference operator*() const {
+                return *_current;
+            }
+
+            const value_type *operator->() const {
+                return &*_current;
+            }
+
+        private:
+            output_iterator _current;
+        };
+
+        template<typename Input, typename KeyFn, typename Agg>
+        group_by_query(
+                Input &&container,
+                KeyFn &&key_fn,
+                Agg &&aggregator,
+                const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _key_fn(std::forward<KeyFn>(key_fn))
+                , _aggregator(std::forward<Agg>(aggregator))
+                , _state(std::allocate_shared<state>(allocator, allocator))
+        {
+        }
+
+        group_by_query(const group_by_query &other)
+				: _container(other._container)
+                , _key_fn(other._key_fn)
+                , _aggregator(other._aggregator)
+                , _state(other._state)
+        {
+        }
+
+        group_by_query(group_by_query &&other)
+				: _container(std::move(other._container))
+                , _key_fn(std::move(other._key_fn))
+                , _aggregator(std::move(other._aggregator))
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~group_by_query()
+        {
+        }
+
+        group_by_query &operator=(const group_by_query &);
+
+        bool operator==(const group_by_query &) const;
+
+        bool operator!=(const group_by_query &) const;
+
+        iterator begin() const {
+            initialize();
+            return iterator(_state->table.entries().begin());
+        }
+
+        iterator end() const {
+            initialize();
+            return iterator(_state->table.entries().end());
+        }
+
+        void swap(group_by_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_key_fn, other._key_fn);
+            std::swap(_aggregator, other._aggregator);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            return _container.empty();
+        }
+
+        size_type size() const {
+            initialize();
+            return _state->table.size();
+        }
+
+        value_type operator[](size_type n) const {
+            initialize();
+            return _state->table.entry(n);
+        }
+
+        size_bounds size_hint() const {
+            if(_state->ready())
+                return size_bounds::exact(_state->table.size());
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(std::min<std::size_t>(bounds.lower, 1U), bounds.upper);
+        }
+
+        // Hands over the groups, moving them out when no other copy of this
+        // query shares them.
+        typename table_type::entries_type extract_values() && {
+            initialize();
+            if(sole_owner(_state))
+                return std::move(_state->table.entries());
+            return _state->table.entries();
+        }
+
+        allocator_type get_allocator() const {
+            return _state->table.entries().get_allocator();
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        struct state : lazy_state {
+            explicit state(const allocator_type &allocator) : table(allocator) {}
+
+            table_type table;
+        };
+
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            _state->table.clear();
+
+            const Aggregator &aggregator = _aggregator;
+            input_iterator last = _container.end();
+            for(input_iterator it = _container.begin(); it != last; ++it) {
+                input_value_type value = *it;
+                std::size_t index = _state->table.insert(_key_fn(value), [&aggregator]() {
+                    return aggregator.seed();
+                }).first;
+                aggregator.accumulate(_state->table.entry(index).second, std::move(value));
+            }
+        }
+
+        InputType _container;
+        KeyFunction _key_fn;
+        Aggregator _aggregator;
+        std::shared_ptr<state> _state;
+    };
+
+	/*************************************************************//**
+	 * group_by_query_builder
+	 ****************************************************************/
+    template<typename KeyFunction, typename Aggregator>
+    class group_by_query_builder {
+    public:
+        group_by_query_builder(const KeyFunction& key_fn, const Aggregator& aggregator)
+                : _key_fn(key_fn)
+                , _aggregator(aggregator)
+        {
+        }
+
+        template<typename Query>
+        group_by_query<typename std::decay<Query>::type, KeyFunction, Aggregator> build(Query&& query) const {
+            return group_by_query<typename std::decay<Query>::type, KeyFunction, Aggregator>(
+                    std::forward<Query>(query), _key_fn, _aggregator);
+        }
+
+        template<typename Query, class Alloc>
+        group_by_query<typename std::decay<Query>::type, KeyFunction, Aggregator,
+                       typename rebind_allocator<Alloc, typename group_by_value<
+                               typename std::decay<Query>::type, KeyFunction, Aggregator>::type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            typedef typename std::decay<Query>::type input_type;
+            typedef typename rebind_allocator<Alloc, typename group_by_value<
+                    input_type, KeyFunction, Aggregator>::type>::type allocator_type;
+            return group_by_query<input_type, KeyFunction, Aggregator, allocator_type>(
+                    std::forward<Query>(query), _key_fn, _aggregator, allocator);
+        }
+
+        // Keeps the groups in memory from allocator, e.g. an arena_allocator.
+        template<class Alloc>
+        allocator_query_builder<group_by_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<group_by_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        KeyFunction _key_fn;
+        Aggregator _aggregator;
+    };
+
+	/*************************************************************//**
+	 * group_collect_query_builder
+	 *
+	 * group_by without an aggregator: the element type is only known
+	 * once the input query is.
+	 ****************************************************************/
+    template<typename KeyFunction>
+    class group_collect_query_builder {
+    public:
+        group_collect_query_builder(const KeyFunction& key_fn)
+                : _key_fn(key_fn)
+        {
+        }
+
+        template<typename Query>
+        group_by_query<typename std::decay<Query>::type, KeyFunction,
+                collect_aggregator<typename std::decay<Query>::type::value_type> >
+        build(Query&& query) const {
+            typedef typename std::decay<Query>::type input_type;
+            return group_by_query<input_type, KeyFunction, collect_aggregator<typename input_type::value_type> >(
+                    std::forward<Query>(query), _key_fn, collect_aggregator<typename input_type::value_type>());
+        }
+
+        template<typename Query, class Alloc>
+        group_by_query<typename std::decay<Query>::type, KeyFunction,
+                collect_aggregator<typename std::decay<Query>::type::value_type>,
+                typename rebind_allocator<Alloc, typename group_by_value<typename std::decay<Query>::type, KeyFunction,
+                        collect_aggregator<typename std::decay<Query>::type::value_type> >::type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            typedef typename std::decay<Query>::type input_type;
+            typedef collect_aggregator<typename input_type::value_type> aggregator_type;
+            typedef typename rebind_allocator<Alloc, typename group_by_value<
+                    input_type, KeyFunction, aggregator_type>::type>::type allocator_type;
+            return group_by_query<input_type, KeyFunction, aggregator_type, allocator_type>(
+                    std::forward<Query>(query), _key_fn, aggregator_type(), allocator);
+        }
+
+        template<class Alloc>
+        allocator_query_builder<group_collect_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<group_collect_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        KeyFunction _key_fn;
+    };
+
+	/*************************************************************//**
+	 * hash_join_query
+	 *
+	 * Build/probe equi-join. The other query is read once into a hash
+	 * table keyed by right_key; the input is then streamed and every
+	 * match yields result_fn(left, right), in left order and then in
+	 * right order.
+	 ****************************************************************/
+    template<typename InputType, typename OtherInputType, typename ResultFunction>
+    struct hash_join_value
+    {
+        typedef typename std::decay<decltype(std::declval<const ResultFunction&>()(
+                std::declval<typename InputType::value_type>(),
+                std::declval<const typename OtherInputType::value_type&>()))>::type type;
+    };
+
+    template<typename InputType, typename OtherInputType,
+            typename LeftKey, typename RightKey, typename ResultFunction,
+            class A = std::allocator<typename hash_join_value<InputType, OtherInputType, ResultFunction>::type> >
+    class hash_join_query {
+    public:
+        typedef typename InputType::value_type left_value_type;
+        typedef typename OtherInputType::value_type right_value_type;
+        typedef typename std::decay<
+                typename function_traits<RightKey, right_value_type>::return_type>::type key_type;
+        typedef typename hash_join_value<InputType, OtherInputType, ResultFunction>::type raw_value_type;
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef hash_join_query<InputType, OtherInputType, LeftKey, RightKey, ResultFunction, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+		typedef typename OtherInputType::iterator other_input_iterator;
+
+        static size_type npos() {
+            return std::numeric_limits<size_type>::max();
+        }
+
+    private:
+        struct state;
+
+    public:
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef typename iterator_category_of<
+                    input_iterator, std::forward_iterator_tag>::type iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    const this_type &query)
+                    : _current(current)
+                    , _last(last)
+                    , _row(npos())
+                    , _state(current != last ? query._state : std::shared_ptr<state>())
+                    , _left_key(query._left_key)
+                    , _result_fn(query._result_fn)
+            {
+                seek();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _row(other._row)
+                    , _state(other._state)
+                    , _left_key(other._left_key)
+                    , _result_fn(other._result_fn)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _row = other._row;
+                _state = other._state;
+                _left_key = other._left_key;
+                _result_fn = other._result_fn;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current && _row == other._row;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !(*this == other);
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                _row = _state->next[_row];
+                if(_row == npos()) {
+                    ++_current;
+                    seek();
+                }
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            value_type operator*() const {
+                assert(_current != _last);
+                return _result_fn(*_current, _state->rows[_row]);
+            }
+
+        private:
+            // Moves to the first right row matching the current or a later
+            // left value.
+            void seek() {
+                _row = npos();
+                if(_current == _last)
+                    return;
+                const table_type &table = _state->table;
+                for(; _current != _last; ++_current) {
+                    std::size_t entry = table.find(_left_key(*_current));
+                    if(entry != table_type::npos()) {
+                        _row = table.entry(entry).second.first;
+                        return;
+                    }
+                }
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            size_type _row;
+            // Owned rather than borrowed from the query, which the
+            // iterator may outlive.
+            std::shared_ptr<state> _state;
+            assignable_function<LeftKey> _left_key;
+            assignable_function<ResultFunction> _result_fn;
+        };
+
+        template<typename Input, typename OtherInput>
+        hash_join_query(
+                Input &&container,
+                OtherInput &&otherContainer,
+                const LeftKey &left_key,
+                const RightKey &right_key,
+                const ResultFunction &result_fn,
+                const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _otherContainer(std::forward<OtherInput>(otherContainer))
+                , _left_key(left_key)
+                , _right_key(right_key)
+                , _result_fn(result_fn)
+                , _state(std::allocate_shared<state>(allocator, allocator))
+        {
+        }
+
+        hash_join_query(const hash_join_query &other)
+				: _container(other._container)
+                , _otherContainer(other._otherContainer)
+                , _left_key(other._left_key)
+                , _right_key(other._right_key)
+                , _result_fn(other._result_fn)
+                , _state(other._state)
+        {
+        }
+
+        hash_join_query(hash_join_query &&other)
+				: _container(std::move(other._container))
+                , _otherContainer(std::move(other._otherContainer))
+                , _left_key(std::move(other._left_key))
+                , _right_key(std::move(other._right_key))
+                , _result_fn(std::move(other._result_fn))
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~hash_join_query()
+        {
+        }
+
+        hash_join_query &operator=(const hash_join_query &);
+
+        bool operator==(const hash_join_query &) const;
+
+        bool operator!=(const hash_join_query &) const;
+
+        iterator begin() const {
+            initialize();
+			return iterator(_container.begin(), _container.end(), *this);
+        }
+
+        iterator end() const {
+            initialize();
+            input_iterator last = _container.end();
+			return iterator(last, last, *this);
+        }
+
+        void swap(hash_join_query &other) {
+			std::swap(_container, other._container);
+			std::swap(_otherContainer, other._otherContainer);
+            std::swap(_left_key, other._left_key);
+            std::swap(_right_key, other._right_key);
+            std::swap(_result_fn, other._result_fn);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+			return _container.empty() || _otherContainer.empty();
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::between(0, empty() ? 0 : size_bounds::unbounded());
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        // Maps a key to the first and last of its rows; next chains the
+        // rows of one key in input order.
+        typedef std::pair<size_type, size_type> chain_type;
+        typedef flat_hash_table<key_type, chain_type, std::hash<key_type>, std::equal_to<key_type>,
+                typename rebind_allocator<A, std::pair<key_type, chain_type> >::type> table_type;
+
+        struct state : lazy_state {
+            explicit state(const allocator_type &allocator)
+                    : rows(allocator), next(allocator), table(allocator)
+            {
+            }
+
+            std::vector<right_value_type, typename rebind_allocator<A, right_value_type>::type> rows;
+            std::vector<size_type, typename rebind_allocator<A, size_type>::type> next;
+            table_type table;
+        };
+
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            state &build = *_state;
+            build.rows.clear();
+            build.next.clear();
+            build.table.clear();
+
+            std::size_t expected = _otherContainer.size_hint().reserve_size();
+            build.rows.reserve(expected);
+            build.next.reserve(expected);
+
+            other_input_iterator last = _otherContainer.end();
+            for(other_input_iterator it = _otherContainer.begin(); it != last; ++it) {
+                right_value_type value = *it;
+                std::size_t entry = build.table.insert(_right_key(value), []() {
+                    return std::make_pair(npos(), npos());
+                }).first;
+
+                size_type row = build.rows.size();
+                build.rows.push_back(std::move(value));
+                build.next.push_back(npos());
+
+                std::pair<size_type, size_type> &chain = build.table.entry(entry).second;
+                if(chain.first == npos())
+                    chain.first = row;
+                else
+                    build.next[chain.second] = row;
+                chain.second = row;
+            }
+        }
+
+        InputType _container;
+        OtherInputType _otherContainer;
+        LeftKey _left_key;
+        RightKey _right_key;
+        ResultFunction _result_fn;
+        std::shared_ptr<state> _state;
+    };
+
+	/*************************************************************//**
+	 * join_query_builder
+	 ****************************************************************/
+    template<typename OtherType, typename LeftKey, typename RightKey, typename ResultFunction>
+    class join_query_builder {
+    public:
+        template<typename Other>
+        join_query_builder(Other&& other, const LeftKey& left_key, const RightKey& right_key,
+                           const ResultFunction& result_fn)
+                : _other(std::forward<Other>(other))
+                , _left_key(left_key)
+                , _right_key(right_key)
+                , _result_fn(result_fn)
+        {
+        }
+
+        template<typename Query>
+        hash_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction>
+        build(Query&& query) const & {
+            return hash_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction>(
+                    std::forward<Query>(query), _other, _left_key, _right_key, _result_fn);
+        }
+
+        template<typename Query>
+        hash_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction>
+        build(Query&& query) && {
+            return hash_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction>(
+                    std::forward<Query>(query), std::move(_other), _left_key, _right_key, _result_fn);
+        }
+
+        template<typename Query, class Alloc>
+        hash_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction,
+                        typename rebind_allocator<Alloc, typename hash_join_value<
+                                typename std::decay<Query>::type, OtherType, ResultFunction>::type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            typedef typename std::decay<Query>::type input_type;
+            typedef typename rebind_allocator<Alloc, typename hash_join_value<
+                    input_type, OtherType, ResultFunction>::type>::type allocator_type;
+            return hash_join_query<input_type, OtherType, LeftKey, RightKey, ResultFunction, allocator_type>(
+                    std::forward<Query>(query), _other, _left_key, _right_key, _result_fn, allocator);
+        }
+
+        // Keeps the build side's table in memory from allocator.
+        template<class Alloc>
+        allocator_query_builder<join_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<join_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        OtherType _other;
+        LeftKey _left_key;
+        RightKey _right_key;
+        ResultFunction _result_fn;
+    };
+
+	/*************************************************************//**
+	 * is_orderby_query
+	 ****************************************************************/
+    template<typename Query>
+    struct is_orderby_query : std::false_type
+    {
+    };
+
+    template<typename InputType, typename Predicate, class A>
+    struct is_orderby_query<orderby_query<InputType, Predicate, A> > : std::true_type
+    {
+    };
+
+	/*************************************************************//**
+	 * merge_join_query
+	 *
+	 * Equi-join of two orderby queries that are both sorted by their
+	 * join key, in the same direction. Walks both sorted sequences once
+	 * and pairs every left value with the run of equal right keys,
+	 * without building a hash table.
+	 ****************************************************************/
+    template<typename InputType, typename OtherInputType,
+            typename LeftKey, typename RightKey, typename ResultFunction>
+    class merge_join_query {
+    public:
+        typedef typename InputType::value_type left_value_type;
+        typedef typename OtherInputType::value_type right_value_type;
+        typedef typename std::decay<decltype(std::declval<const ResultFunction&>()(
+                std::declval<left_value_type>(), std::declval<right_value_type>()))>::type raw_value_type;
+        typedef std::allocator<raw_value_type> A;
+
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef merge_join_query<InputType, OtherInputType, LeftKey, RightKey, ResultFunction> this_type;
+		typedef typename InputType::iterator input_iterator;
+		typedef typename OtherInputType::iterator other_input_iterator;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::forward_iterator_tag iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+					const other_input_iterator& other_current,
+					const other_input_iterator& other_last,
+                    const this_type &query)
+                    : _current(current)
+                    , _last(last)
+                    , _run_first(other_current)
+                    , _run_last(other_current)
+                    , _other_current(other_current)
+                    , _other_last(other_last)
+                    , _left_key(query._left_key)
+                    , _right_key(query._right_key)
+                    , _result_fn(query._result_fn)
+                    , _ascending(query._container.ascending())
+            {
+                seek();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _run_first(other._run_first)
+                    , _run_last(other._run_last)
+                    , _other_current(other._other_current)
+                    , _other_last(other._other_last)
+                    , _left_key(other._left_key)
+                    , _right_key(other._right_key)
+                    , _result_fn(other._result_fn)
+                    , _ascending(other._ascending)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _run_first = other._run_first;
+                _run_last = other._run_last;
+                _other_current = other._other_current;
+                _other_last = other._other_last;
+                _left_key = other._left_key;
+                _right_key = other._right_key;
+                _result_fn = other._result_fn;
+                _ascending = other._ascending;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current &&
+                       (_current == _last || _other_current == other._other_current);
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !(*this == other);
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                if(++_other_current != _run_last)
+                    return *this;
+
+                // Equal left keys reuse the current run of right values.
+                if(++_current != _last && !before(_right_key(*_run_first), _left_key(*_current))) {
+                    _other_current = _run_first;
+                    return *this;
+                }
+                _run_first = _run_last;
+                seek();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            value_type operator*() const {
+                assert(_current != _last);
+                return _result_fn(*_current, *_other_current);
+            }
+
+        private:
+            // Key order in the direction both inputs are sorted in.
+            template<typename Left, typename Right>
+            bool before(const Left &lhs, const Right &rhs) const {
+                return _ascending ? lhs < rhs : rhs < lhs;
+            }
+
+            // Advances both sides until the current left key has a run of
+            // equal right keys starting at _run_first.
+            void seek() {
+                while(_current != _last) {
+                    while(_run_first != _other_last &&
+                          before(_right_key(*_run_first), _left_key(*_current)))
+                        ++_run_first;
+                    if(_run_first == _other_last) {
+                        _current = _last;
+                        return;
+                    }
+                    if(before(_left_key(*_current), _right_key(*_run_first))) {
+                        ++_current;
+                        continue;
+                    }
+
+                    _run_last = _run_first;
+                    while(_run_last != _other_last &&
+                          !before(_left_key(*_current), _right_key(*_run_last)))
+                        ++_run_last;
+                    _other_current = _run_first;
+                    return;
+                }
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            other_input_iterator _run_first;
+            other_input_iterator _run_last;
+            other_input_iterator _other_current;
+            other_input_iterator _other_last;
+            // Copied, so the iterator does not depend on the query object.
+            assignable_function<LeftKey> _left_key;
+            assignable_function<RightKey> _right_key;
+            assignable_function<ResultFunction> _result_fn;
+            bool _ascending;
+        };
+
+        template<typename Input, typename OtherInput>
+        merge_join_query(
+                Input &&container,
+                OtherInput &&otherContainer,
+                const LeftKey &left_key,
+                const RightKey &right_key,
+                const ResultFunction &result_fn)
+				: _container(std::forward<Input>(container))
+                , _otherContainer(std::forward<OtherInput>(otherContainer))
+                , _left_key(left_key)
+                , _right_key(right_key)
+                , _result_fn(result_fn)
+        {
+            assert(_container.ascending() == _otherContainer.ascending());
+        }
+
+        merge_join_query(const merge_join_query &other)
+				: _container(other._container)
+                , _otherContainer(other._otherContainer)
+                , _left_key(other._left_key)
+                , _right_key(other._right_key)
+                , _result_fn(other._result_fn)
+        {
+        }
+
+        merge_join_query(merge_join_query &&other)
+				: _container(std::move(other._container))
+                , _otherContainer(std::move(other._otherContainer))
+                , _left_key(std::move(other._left_key))
+                , _right_key(std::move(other._right_key))
+                , _result_fn(std::move(other._result_fn))
+        {
+        }
+
+        ~merge_join_query()
+        {
+        }
+
+        merge_join_query &operator=(const merge_join_query &);
+
+        bool operator==(const merge_join_query &) const;
+
+        bool operator!=(const merge_join_query &) const;
+
+        iterator begin() const {
+			return iterator(_container.begin(), _container.end(),
+                            _otherContainer.begin(), _otherContainer.end(), *this);
+        }
+
+        iterator end() const {
+            input_iterator last = _container.end();
+            other_input_iterator other_last = _otherContainer.end();
+			return iterator(last, last, other_last, other_last, *this);
+        }
+
+        void swap(merge_join_query &other) {
+			std::swap(_container, other._container);
+			std::swap(_otherContainer, other._otherContainer);
+            std::swap(_left_key, other._left_key);
+            std::swap(_right_key, other._right_key);
+            std::swap(_result_fn, other._result_fn);
+        }
+
+        bool empty() const {
+			return _container.empty() || _otherContainer.empty();
+        }
+
+        size_bounds size_hint() const {
+            return size_bounds::between(0, empty() ? 0 : size_bounds::unbounded());
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        OtherInputType _otherContainer;
+        LeftKey _left_key;
+        RightKey _right_key;
+        ResultFunction _result_fn;
+    };
+
+	/*************************************************************//**
+	 * merge_join_query_builder
+	 ****************************************************************/
+    template<typename OtherType, typename LeftKey, typename RightKey, typename ResultFunction>
+    class merge_join_query_builder {
+    public:
+        static_assert(is_orderby_query<OtherType>::value,
+                      "merge_join needs an orderby query on the right-hand side");
+
+        template<typename Other>
+        merge_join_query_builder(Other&& other, const LeftKey& left_key, const RightKey& right_key,
+                                 const ResultFunction& result_fn)
+                : _other(std::forward<Other>(other))
+                , _left_key(left_key)
+                , _right_key(right_key)
+                , _result_fn(result_fn)
+        {
+        }
+
+        template<typename Query>
+        merge_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction>
+        build(Query&& query) const {
+            static_assert(is_orderby_query<typename std::decay<Query>::type>::value,
+                          "merge_join needs an orderby query on the left-hand side");
+            return merge_join_query<typename std::decay<Query>::type, OtherType, LeftKey, RightKey, ResultFunction>(
+                    std::forward<Query>(query), _other, _left_key, _right_key, _result_fn);
+        }
+
+    private:
+        OtherType _other;
+        LeftKey _left_key;
+        RightKey _right_key;
+        ResultFunction _result_fn;
+    };
+
+	/*************************************************************//**
+	 * value_hash / value_equal
+	 *
+	 * Default hashing and equality of the set operations below, resolved
+	 * once the value type is known.
+	 ****************************************************************/
+    struct value_hash
+    {
+        template<typename T>
+        std::size_t operator()(const T &value) const {
+            return std::hash<T>()(value);
+        }
+    };
+
+    struct value_equal
+    {
+        template<typename T>
+        bool operator()(const T &lhs, const T &rhs) const {
+            return lhs == rhs;
+        }
+    };
+
+    // Mapped value of a flat_hash_table used as a set.
+    struct set_member
+    {
+    };
+
+	/*************************************************************//**
+	 * distinct_query
+	 *
+	 * Streams the input, yielding each value the first time it is seen.
+	 * Every pass records the values it has yielded in a flat_hash_table
+	 * of its own, so a value comes out as soon as it is read and no sort
+	 * is needed.
+	 ****************************************************************/
+	template<typename InputType, typename Hash, typename KeyEqual,
+             class A = std::allocator<typename InputType::value_type> >
+    class distinct_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef distinct_query<InputType, Hash, KeyEqual, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+        typedef flat_hash_table<value_type, set_member, Hash, KeyEqual,
+                typename rebind_allocator<A, std::pair<value_type, set_member> >::type> set_type;
+
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef typename value_reference<input_iterator, value_type>::type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::input_iterator_tag iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+                    const std::shared_ptr<set_type>& seen)
+                    : _current(current)
+                    , _last(last)
+                    , _seen(seen)
+            {
+                seek();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _seen(other._seen)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _seen = other._seen;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return _current != other._current;
+            }
+
+            iterator &operator++() {
+                assert(_current != _last);
+                ++_current;
+                seek();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            reference operator*() const {
+                assert(_current != _last);
+                return *_current;
+            }
+
+            pointer operator->() const {
+                assert(_current != _last);
+                return _current.operator->();
+            }
+
+        private:
+            // Moves _current to the next value not yielded before and records it.
+            void seek() {
+                while(_current != _last && !_seen->insert(*_current, make_member).second)
+                    ++_current;
+            }
+
+            static set_member make_member() {
+                return set_member();
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+            std::shared_ptr<set_type> _seen;
+        };
+
+        template<typename Input>
+        distinct_query(Input &&container, const Hash &hash, const KeyEqual &equal,
+                       const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _hash(hash)
+                , _equal(equal)
+                , _allocator(allocator)
+        {
+        }
+
+        distinct_query(const distinct_query &other)
+				: _container(other._container)
+                , _hash(other._hash)
+                , _equal(other._equal)
+                , _allocator(other._allocator)
+        {
+        }
+
+        distinct_query(distinct_query &&other)
+				: _container(std::move(other._container))
+                , _hash(std::move(other._hash))
+                , _equal(std::move(other._equal))
+                , _allocator(other._allocator)
+        {
+        }
+
+        ~distinct_query() {
+        }
+
+        distinct_query &operator=(const distinct_query &);
+
+        bool operator==(const distinct_query &) const;
+
+        bool operator!=(const distinct_query &) const;
+
+        // Each call starts a pass with nothing seen.
+        iterator begin() const {
+            return iterator(_container.begin(), _container.end(),
+                            std::allocate_shared<set_type>(_allocator, _hash, _equal, _allocator));
+        }
+
+        iterator end() const {
+            return iterator(_container.end(), _container.end(), std::shared_ptr<set_type>());
+        }
+
+        void swap(distinct_query &other) {
+			std::swap(_container, other._container);
+            std::swap(_hash, other._hash);
+            std::swap(_equal, other._equal);
+            std::swap(_allocator, other._allocator);
+        }
+
+        bool empty() const {
+			return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            return size_bounds::between(std::min<std::size_t>(bounds.lower, 1U), bounds.upper);
+        }
+
+        allocator_type get_allocator() const {
+            return _allocator;
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        InputType _container;
+        Hash _hash;
+        KeyEqual _equal;
+        allocator_type _allocator;
+    };
+
+	/*************************************************************//**
+	 * distinct_query_builder
+	 ****************************************************************/
+    template<typename Hash, typename KeyEqual>
+    class distinct_query_builder {
+    public:
+        distinct_query_builder(const Hash& hash, const KeyEqual& equal)
+                : _hash(hash)
+                , _equal(equal)
+        {
+        }
+
+        template<typename Query>
+        distinct_query<typename std::decay<Query>::type, Hash, KeyEqual> build(Query&& query) const {
+            return distinct_query<typename std::decay<Query>::type, Hash, KeyEqual>(
+                    std::forward<Query>(query), _hash, _equal);
+        }
+
+        template<typename Query, class Alloc>
+        distinct_query<typename std::decay<Query>::type, Hash, KeyEqual,
+                       typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            return distinct_query<typename std::decay<Query>::type, Hash, KeyEqual,
+                                  typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>(
+                    std::forward<Query>(query), _hash, _equal, allocator);
+        }
+
+        // Keeps the values seen in memory from allocator.
+        template<class Alloc>
+        allocator_query_builder<distinct_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<distinct_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        Hash _hash;
+        KeyEqual _equal;
+    };
+
+	/*************************************************************//**
+	 * set_query
+	 *
+	 * Set operations between the input and another query of the same
+	 * value type, each value yielded at most once:
+	 *  - set_union streams the input, then the other query, skipping
+	 *    values already yielded;
+	 *  - set_intersection and set_difference read the other query once
+	 *    into a shared flat_hash_table and stream the input against it.
+	 * Values come out in input order (then other order for a union).
+	 ****************************************************************/
+    enum set_operation {
+        set_union,
+        set_intersection,
+        set_difference
+    };
+
+	template<typename InputType, typename OtherType, set_operation Operation, typename Hash, typename KeyEqual,
+             class A = std::allocator<typename InputType::value_type> >
+    class set_query {
+    public:
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+		typedef set_query<InputType, OtherType, Operation, Hash, KeyEqual, A> this_type;
+		typedef typename InputType::iterator input_iterator;
+		typedef typename OtherType::iterator other_input_iterator;
+        typedef flat_hash_table<value_type, set_member, Hash, KeyEqual,
+                typename rebind_allocator<A, std::pair<value_type, set_member> >::type> set_type;
+
+        static_assert(std::is_same<value_type, typename OtherType::value_type>::value,
+                      "set operations need queries of the same value type");
+
+    private:
+        // What one pass has yielded: the values themselves, or for an
+        // intersection a flag per value of the other query.
+        struct pass {
+            pass(const Hash &hash, const KeyEqual &equal, const allocator_type &allocator, std::size_t members)
+                    : seen(hash, equal, allocator)
+                    , emitted(members, 0, allocator)
+            {
+            }
+
+            set_type seen;
+            std::vector<char, typename rebind_allocator<A, char>::type> emitted;
+        };
+
+    public:
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef value_type reference;
+            typedef typename std::allocator_traits<A>::pointer pointer;
+            typedef std::input_iterator_tag iterator_category;
+
+			iterator(const input_iterator& current,
+					const input_iterator& last,
+					const other_input_iterator& other_current,
+					const other_input_iterator& other_last,
+                    const set_type *other_values,
+                    const std::shared_ptr<pass>& state)
+                    : _current(current)
+                    , _last(last)
+                    , _other_current(other_current)
+                    , _other_last(other_last)
+                    , _other_values(other_values)
+                    , _pass(state)
+            {
+                seek();
+            }
+
+            iterator(const iterator &other)
+                    : _current(other._current)
+                    , _last(other._last)
+                    , _other_current(other._other_current)
+                    , _other_last(other._other_last)
+                    , _other_values(other._other_values)
+                    , _pass(other._pass)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _current = other._current;
+                _last = other._last;
+                _other_current = other._other_current;
+                _other_last = other._other_last;
+                _other_values = other._other_values;
+                _pass = other._pass;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _current == other._current && _other_current == other._other_current;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !(*this == other);
+            }
+
+            iterator &operator++() {
+                if(_current != _last)
+                    ++_current;
+                else
+                    ++_other_current;
+                seek();
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous(*this);
+                ++*this;
+                return previous;
+            }
+
+            value_type operator*() const {
+                return _current != _last ? *_current : *_other_current;
+            }
+
+            pointer operator->() const {
+                return _current != _last ? _current.operator->() : _other_current.operator->();
+            }
+
+        private:
+            void seek() {
+                for(; _current != _last; ++_current) {
+                    if(accept(*_current))
+                        return;
+                }
+                if(Operation != set_union)
+                    return;
+                for(; _other_current != _other_last; ++_other_current) {
+                    if(_pass->seen.insert(*_other_current, make_member).second)
+                        return;
+                }
+            }
+
+            bool accept(value_type value) {
+                if(Operation == set_union)
+                    return _pass->seen.insert(std::move(value), make_member).second;
+
+                std::size_t index = _other_values->find(value);
+                if(Operation == set_difference)
+                    return index == set_type::npos() && _pass->seen.insert(std::move(value), make_member).second;
+
+                if(index == set_type::npos() || _pass->emitted[index])
+                    return false;
+                _pass->emitted[index] = 1;
+                return true;
+            }
+
+            static set_member make_member() {
+                return set_member();
+            }
+
+			input_iterator _current;
+			input_iterator _last;
+			other_input_iterator _other_current;
+			other_input_iterator _other_last;
+            const set_type *_other_values;
+            std::shared_ptr<pass> _pass;
+        };
+
+        template<typename Input, typename Other>
+        set_query(Input &&container, Other &&other, const Hash &hash, const KeyEqual &equal,
+                  const allocator_type &allocator = allocator_type())
+				: _container(std::forward<Input>(container))
+                , _other(std::forward<Other>(other))
+                , _hash(hash)
+                , _equal(equal)
+                , _allocator(allocator)
+                , _state(std::allocate_shared<other_state>(allocator, hash, equal, allocator))
+        {
+        }
+
+        set_query(const set_query &other)
+				: _container(other._container)
+                , _other(other._other)
+                , _hash(other._hash)
+                , _equal(other._equal)
+                , _allocator(other._allocator)
+                , _state(other._state)
+        {
+        }
+
+        set_query(set_query &&other)
+				: _container(std::move(other._container))
+                , _other(std::move(other._other))
+                , _hash(std::move(other._hash))
+                , _equal(std::move(other._equal))
+                , _allocator(other._allocator)
+                , _state(std::move(other._state))
+        {
+        }
+
+        ~set_query() {
+        }
+
+        set_query &operator=(const set_query &);
+
+        bool operator==(const set_query &) const;
+
+        bool operator!=(const set_query &) const;
+
+        // Each call starts a pass with nothing yielded.
+        iterator begin() const {
+            std::size_t members = 0;
+            if(Operation != set_union) {
+                initialize();
+                if(Operation == set_intersection)
+                    members = _state->values.size();
+            }
+            std::shared_ptr<pass> state = std::allocate_shared<pass>(_allocator, _hash, _equal, _allocator, members);
+            if(Operation == set_union)
+                return iterator(_container.begin(), _container.end(), _other.begin(), _other.end(), 0, state);
+            other_input_iterator other_last = _other.end();
+            return iterator(_container.begin(), _container.end(), other_last, other_last, &_state->values, state);
+        }
+
+        iterator end() const {
+            other_input_iterator other_last = _other.end();
+            return iterator(_container.end(), _container.end(), other_last, other_last,
+                            &_state->values, std::shared_ptr<pass>());
+        }
+
+        void swap(set_query &other) {
+			std::swap(_container, other._container);
+			std::swap(_other, other._other);
+            std::swap(_hash, other._hash);
+            std::swap(_equal, other._equal);
+            std::swap(_allocator, other._allocator);
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            if(Operation == set_union)
+                return _container.empty() && _other.empty();
+            if(Operation == set_intersection)
+                return _container.empty() || _other.empty();
+            return _container.empty();
+        }
+
+        size_bounds size_hint() const {
+            size_bounds bounds = _container.size_hint();
+            if(Operation != set_union)
+                return size_bounds::between(0, bounds.upper);
+
+            size_bounds other = _other.size_hint();
+            std::size_t upper = bounds.upper > size_bounds::unbounded() - other.upper
+                    ? size_bounds::unbounded() : bounds.upper + other.upper;
+            return size_bounds::between(std::min<std::size_t>(std::max(bounds.lower, other.lower), 1U), upper);
+        }
+
+        allocator_type get_allocator() const {
+            return _allocator;
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        struct other_state : lazy_state {
+            other_state(const Hash &hash, const KeyEqual &equal, const allocator_type &allocator)
+                    : values(hash, equal, allocator)
+            {
+            }
+
+            set_type values;
+        };
+
+        void initialize() const
+        {
+            _state->ensure([this]() { this->fill(); });
+        }
+
+        void fill() const
+        {
+            set_type &values = _state->values;
+            values.clear();
+            values.reserve(_other.size_hint().reserve_size());
+            other_input_iterator last = _other.end();
+            for(other_input_iterator it = _other.begin(); it != last; ++it)
+                values.insert(*it, []() { return set_member(); });
+        }
+
+        InputType _container;
+        OtherType _other;
+        Hash _hash;
+        KeyEqual _equal;
+        allocator_type _allocator;
+        std::shared_ptr<other_state> _state;
+    };
+
+	/*************************************************************//**
+	 * set_query_builder
+	 ****************************************************************/
+    template<typename OtherType, set_operation Operation, typename Hash, typename KeyEqual>
+    class set_query_builder {
+    public:
+        template<typename Other>
+        set_query_builder(Other&& other, const Hash& hash, const KeyEqual& equal)
+                : _other(std::forward<Other>(other))
+                , _hash(hash)
+                , _equal(equal)
+        {
+        }
+
+        template<typename Query>
+        set_query<typename std::decay<Query>::type, OtherType, Operation, Hash, KeyEqual>
+        build(Query&& query) const & {
+            return set_query<typename std::decay<Query>::type, OtherType, Operation, Hash, KeyEqual>(
+                    std::forward<Query>(query), _other, _hash, _equal);
+        }
+
+        template<typename Query>
+        set_query<typename std::decay<Query>::type, OtherType, Operation, Hash, KeyEqual>
+        build(Query&& query) && {
+            return set_query<typename std::decay<Query>::type, OtherType, Operation, Hash, KeyEqual>(
+                    std::forward<Query>(query), std::move(_other), _hash, _equal);
+        }
+
+        template<typename Query, class Alloc>
+        set_query<typename std::decay<Query>::type, OtherType, Operation, Hash, KeyEqual,
+                  typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>
+        build(Query&& query, const Alloc& allocator) const {
+            return set_query<typename std::decay<Query>::type, OtherType, Operation, Hash, KeyEqual,
+                             typename rebind_allocator<Alloc, typename std::decay<Query>::type::value_type>::type>(
+                    std::forward<Query>(query), _other, _hash, _equal, allocator);
+        }
+
+        // Keeps the hash sets in memory from allocator.
+        template<class Alloc>
+        allocator_query_builder<set_query_builder, Alloc> with_allocator(const Alloc& allocator) const {
+            return allocator_query_builder<set_query_builder, Alloc>(*this, allocator);
+        }
+
+    private:
+        OtherType _other;
+        Hash _hash;
+        KeyEqual _equal;
+    };
+
+	/*************************************************************//**
+	 * for_each_batch
+	 *
+	 * Feeds a query to a sink: whole batches to on_batch(first, count)
+	 * when the query has native batches, else one value at a time to
+	 * on_value(value) straight from its iterators.
+	 ****************************************************************/
+    template<typename Query>
+    struct batch_sink : std::integral_constant<bool,
+            native_batches<Query>::value && std::is_default_constructible<typename Query::value_type>::value>
+    {
+    };
+
+    template<typename Query, typename OnBatch, typename OnValue>
+    void for_each_batch(const Query &query, OnBatch on_batch, OnValue, std::true_type)
+    {
+        typename Query::value_type buffer[batch_size];
+        typename batch_cursor_of<Query>::type cursor = batch_cursor_of<Query>::make(query);
+        for(;;) {
+            std::size_t count = cursor.next_batch(buffer, batch_size);
+            if(count != 0)
+                on_batch(buffer, count);
+            if(count < batch_size)
+                break;
+        }
+    }
+
+    template<typename Query, typename OnBatch, typename OnValue>
+    void for_each_batch(const Query &query, OnBatch, OnValue on_value, std::false_type)
+    {
+        typename Query::iterator last = query.end();
+        for(typename Query::iterator it = query.begin(); it != last; ++it)
+            on_value(*it);
+    }
+
+    template<typename Query, typename OnBatch, typename OnValue>
+    void for_each_batch(const Query &query, OnBatch on_batch, OnValue on_value)
+    {
+        for_each_batch(query, on_batch, on_value, batch_sink<Query>());
+    }
+
+	/*************************************************************//**
+	 * reserve_for
+	 *
+	 * Makes room for count more values in containers that support
+	 * reserve(). Capacity at least doubles, so repeated appends stay
+	 * amortized O(1).
+	 ****************************************************************/
+    template<typename Container>
+    auto reserve_for(Container &container, std::size_t count, int)
+            -> decltype(container.reserve(count), void())
+    {
+        std::size_t needed = container.size() + count;
+        if(needed > container.capacity())
+            container.reserve(std::max<std::size_t>(needed, 2 * container.capacity()));
+    }
+
+    template<typename Container>
+    void reserve_for(Container &, std::size_t, long)
+    {
+    }
+
+	/*************************************************************//**
+	 * insert_range
+	 *
+	 * Appends [first, last) with one range insert where the container
+	 * has one (sequences), else value by value (sets, maps).
+	 ****************************************************************/
+    template<typename Container, typename Iterator>
+    auto insert_range(Container &container, Iterator first, Iterator last, int)
+            -> decltype(container.insert(container.end(), first, last), void())
+    {
+        container.insert(container.end(), first, last);
+    }
+
+    template<typename Container, typename Iterator>
+    void insert_range(Container &container, Iterator first, Iterator last, long)
+    {
+        for(; first != last; ++first)
+            container.insert(container.end(), *first);
+    }
+
+	/*************************************************************//**
+	 * append_values
+	 *
+	 * Appends every value of a query to a container; the sinks below
+	 * share it. Filters and transforms over contiguous sources written
+	 * into contiguous containers skip the per-value iterator: a where()
+	 * with a char predicate copies blocks with the char kernels, and a
+	 * select() runs as an indexed loop the compiler can vectorize.
+	 ****************************************************************/
+    template<typename Container>
+    struct is_contiguous_container : std::false_type
+    {
+    };
+
+    template<typename T, class A>
+    struct is_contiguous_container<std::vector<T, A> > : std::integral_constant<bool, !std::is_same<T, bool>::value>
+    {
+    };
+
+    template<typename C, class Traits, class A>
+    struct is_contiguous_container<std::basic_string<C, Traits, A> > : std::true_type
+    {
+    };
+
+    // Inserts a value as the iterator hands it out: moved from a copy,
+    // copied from a reference into the query's storage.
+    template<typename Container>
+    class value_inserter {
+    public:
+        value_inserter(Container &container)
+                : _container(&container)
+        {
+        }
+
+        template<typename T>
+        void operator()(T &&value) const {
+            _container->insert(_container->end(), std::forward<T>(value));
+        }
+
+    private:
+        Container *_container;
+    };
+
+    template<typename Container, typename Query>
+    void append_values(Container &container, const Query &query)
+    {
+        reserve_for(container, query.size_hint().reserve_size(), 0);
+        for_each_batch(query, [&container](typename Query::value_type *first, std::size_t count) {
+            insert_range(container, std::make_move_iterator(first), std::make_move_iterator(first + count), 0);
+        }, value_inserter<Container>(container));
+    }
+
+    template<typename Container, typename InputType, typename Predicate, class A>
+    void append_values(Container &container, const where_query<InputType, Predicate, A> &query, std::false_type)
+    {
+        append_values<Container, where_query<InputType, Predicate, A> >(container, query);
+    }
+
+    template<typename Container, typename InputType, typename Predicate, class A>
+    void append_values(Container &container, const where_query<InputType, Predicate, A> &query, std::true_type)
+    {
+        std::pair<const typename InputType::value_type*, const typename InputType::value_type*> range =
+                contiguous_range(query.source());
+        std::size_t size = static_cast<std::size_t>(range.second - range.first);
+        if(size == 0)
+            return;
+
+        std::size_t old_size = container.size();
+        container.resize(old_size + size);
+        char *out = reinterpret_cast<char*>(&container[old_size]);
+        char *out_last = copy_matching(reinterpret_cast<const char*>(range.first),
+                                       reinterpret_cast<const char*>(range.second), out, query.predicate());
+        container.resize(old_size + static_cast<std::size_t>(out_last - out));
+    }
+
+    template<typename Container, typename InputType, typename Predicate, class A>
+    void append_values(Container &container, const where_query<InputType, Predicate, A> &query)
+    {
+        append_values(container, query, std::integral_constant<bool,
+                char_scan<InputType, Predicate>::value &&
+                is_contiguous_container<Container>::value &&
+                std::is_same<typename Container::value_type, typename InputType::value_type>::value>());
+    }
+
+    template<typename Container, typename InputType, typename Generator>
+    void append_values(Container &container, const select_query<InputType, Generator> &query, std::false_type)
+    {
+        append_values<Container, select_query<InputType, Generator> >(container, query);
+    }
+
+    template<typename Container, typename InputType, typename Generator>
+    void append_values(Container &container, const select_query<InputType, Generator> &query, std::true_type)
+    {
+        std::pair<const typename InputType::value_type*, const typename InputType::value_type*> range =
+                contiguous_range(query.source());
+        std::size_t size = static_cast<std::size_t>(range.second - range.first);
+        if(size == 0)
+            return;
+
+        std::size_t old_size = container.size();
+        container.resize(old_size + size);
+        typename Container::value_type *out = &container[old_size];
+        const typename InputType::value_type *in = range.first;
+        const Generator &generator = query.generator();
+        for(std::size_t i = 0; i < size; ++i)
+            out[i] = generator(in[i]);
+    }
+
+    template<typename Container, typename InputType, typename Generator>
+    void append_values(Container &container, const select_query<InputType, Generator> &query)
+    {
+        append_values(container, query, std::integral_constant<bool,
+                contiguous_source<InputType>::value &&
+                is_contiguous_container<Container>::value &&
+                std::is_arithmetic<typename Container::value_type>::value &&
+                std::is_same<typename Container::value_type,
+                             typename select_query<InputType, Generator>::value_type>::value>());
+    }
+
+	/*************************************************************//**
+	 * to_vector_query_builder
+	 ****************************************************************/
+    class to_vector_query_builder {
+    public:
+        template<typename Query>
+        std::vector<typename std::decay<Query>::type::value_type> build(const Query& query) const {
+            std::vector<typename Query::value_type> values;
+            append_values(values, query);
+            return values;
+        }
+
+        template<typename InputType, typename Predicate, typename T>
+        std::vector<T> build(orderby_query<InputType, Predicate, std::allocator<T> >&& query) const {
+            return std::move(query).extract_values();
+        }
+
+        template<typename InputType, typename KeyFunction, typename T>
+        std::vector<T> build(key_orderby_query<InputType, KeyFunction, std::allocator<T> >&& query) const {
+            return std::move(query).extract_values();
+        }
+
+        template<typename InputType, class A>
+        std::vector<typename A::value_type> build(parallel_query<InputType, A>&& query) const {
+            return std::move(query).extract_values();
+        }
+
+        template<typename InputType, typename KeyFunction, typename Aggregator, typename T>
+        std::vector<T> build(group_by_query<InputType, KeyFunction, Aggregator, std::allocator<T> >&& query) const {
+            return std::move(query).extract_values();
+        }
+    };
+
+	/*************************************************************//**
+	 * to_string_query_builder
+	 ****************************************************************/
+    class to_string_query_builder {
+    public:
+        template<typename Query>
+        std::string build(const Query& query) const {
+            std::string text;
+            append_values(text, query);
+            return text;
+        }
+    };
+
+	/*************************************************************//**
+	 * to_unordered_map_query_builder
+	 *
+	 * Keys each value with key_fn. When several values share a key the
+	 * first one is kept.
+	 ****************************************************************/
+    template<typename KeyFunction>
+    class to_unordered_map_query_builder {
+    public:
+        to_unordered_map_query_builder(const KeyFunction& key_fn)
+                : _key_fn(key_fn)
+        {
+        }
+
+        template<typename Query>
+        std::unordered_map<
+                typename std::decay<typename function_traits<KeyFunction, typename Query::value_type>::return_type>::type,
+                typename Query::value_type>
+        build(const Query& query) const {
+            typedef typename Query::value_type value_type;
+            typedef typename std::decay<typename function_traits<KeyFunction, value_type>::return_type>::type key_type;
+
+            std::unordered_map<key_type, value_type> map;
+            map.reserve(query.size_hint().reserve_size());
+            typename Query::iterator last = query.end();
+            for(typename Query::iterator it = query.begin(); it != last; ++it) {
+                value_type value = *it;
+                key_type key = _key_fn(value);
+                map.emplace(std::move(key), std::move(value));
+            }
+            return map;
+        }
+
+    private:
+        KeyFunction _key_fn;
+    };
+
+	/*************************************************************//**
+	 * into_query_builder
+	 *
+	 * Appends to a caller-owned container, so a reused container keeps
+	 * its capacity across queries.
+	 ****************************************************************/
+    template<typename Container>
+    class into_query_builder {
+    public:
+        into_query_builder(Container& container)
+                : _container(&container)
+        {
+        }
+
+        template<typename Query>
+        Container& build(const Query& query) const {
+            append_values(*_container, query);
+            return *_container;
+        }
+
+    private:
+        Container* _container;
+    };
+
+    template<typename Result, typename T>
+    Result unrolled_sum(const T *first, const T *last)
+    {
+        Result s0 = Result(), s1 = Result(), s2 = Result(), s3 = Result();
+        for(; last - first >= 4; first += 4) {
+            s0 += first[0];
+            s1 += first[1];
+            s2 += first[2];
+            s3 += first[3];
+        }
+        for(; first != last; ++first)
+            s0 += *first;
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    template<typename T, typename Predicate>
+    std::size_t unrolled_count(const T *first, const T *last, const Predicate &pred)
+    {
+        std::size_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+        for(; last - first >= 4; first += 4) {
+            c0 += static_cast<bool>(pred(first[0]));
+            c1 += static_cast<bool>(pred(first[1]));
+            c2 += static_cast<bool>(pred(first[2]));
+            c3 += static_cast<bool>(pred(first[3]));
+        }
+        for(; first != last; ++first)
+            c0 += static_cast<bool>(pred(*first));
+        return (c0 + c1) + (c2 + c3);
+    }
+
+    // Smallest value under comp; first != last.
+    template<typename T, typename Compare>
+    T unrolled_extreme(const T *first, const T *last, Compare comp)
+    {
+        T m0 = *first, m1 = m0, m2 = m0, m3 = m0;
+        for(; last - first >= 4; first += 4) {
+            m0 = comp(first[0], m0) ? first[0] : m0;
+            m1 = comp(first[1], m1) ? first[1] : m1;
+            m2 = comp(first[2], m2) ? first[2] : m2;
+            m3 = comp(first[3], m3) ? first[3] : m3;
+        }
+        for(; first != last; ++first)
+            m0 = comp(*first, m0) ? *first : m0;
+        m0 = comp(m1, m0) ? m1 : m0;
+        m2 = comp(m3, m2) ? m3 : m2;
+        return comp(m2, m0) ? m2 : m0;
+    }
+
+    template<typename Query, typename Predicate>
+    std::size_t count_matching(const Query &query, const Predicate &pred, std::true_type)
+    {
+        auto range = contiguous_range(query);
+        return unrolled_count(range.first, range.second, pred);
+    }
+
+    template<typename Query, typename Predicate>
+    std::size_t count_matching(const Query &query, const Predicate &pred, std::false_type)
+    {
+        std::size_t count = 0;
+        for_each_batch(query, [&](const typename Query::value_type *first, std::size_t size) {
+            count += unrolled_count(first, first + size, pred);
+        }, [&](const typename Query::value_type &value) {
+            count += static_cast<bool>(pred(value));
+        });
+        return count;
+    }
+
+    template<typename Query, typename Predicate>
+    std::size_t count_matching(const Query &query, const Predicate &pred)
+    {
+        return count_matching(query, pred, contiguous_source<Query>());
+    }
+
+	/*************************************************************//**
+	 * count_query_builder
+	 *
+	 * Exact sizes are answered from size_hint() without iterating.
+	 * Counting a where_query tests the predicate on every source value
+	 * and adds the result, without branching on it.
+	 ****************************************************************/
+    class count_query_builder {
+    public:
+        template<typename Query>
+        std::size_t build(const Query& query) const {
+            size_bounds bounds = query.size_hint();
+            if(bounds.is_exact())
+                return bounds.upper;
+
+            std::size_t count = 0;
+            for_each_batch(query, [&count](const typename Query::value_type *, std::size_t size) {
+                count += size;
+            }, [&count](const typename Query::value_type &) {
+                ++count;
+            });
+            return count;
+        }
+
+        template<typename InputType, typename Predicate, class A>
+        std::size_t build(const where_query<InputType, Predicate, A>& query) const {
+            return count_matching(query.source(), query.predicate());
+        }
+    };
+
+	/*************************************************************//**
+	 * count_if_query_builder
+	 ****************************************************************/
+    template<typename Predicate>
+    class count_if_query_builder {
+    public:
+        count_if_query_builder(const Predicate& pred)
+                : _pred(pred)
+        {
+        }
+
+        template<typename Query>
+        std::size_t build(const Query& query) const {
+            return count_matching(query, _pred);
+        }
+
+    private:
+        Predicate _pred;
+    };
+
+	/*************************************************************//**
+	 * sum_query_builder
+	 *
+	 * Sums in the type of value + value, so small integers are promoted
+	 * to int as in plain arithmetic. An empty query sums to zero.
+	 ****************************************************************/
+    class sum_query_builder {
+    public:
+        template<typename Value>
+        struct sum_type
+        {
+            typedef typename std::decay<decltype(std::declval<Value>() + std::declval<Value>())>::type type;
+        };
+
+        template<typename Query>
+        typename sum_type<typename Query::value_type>::type build(const Query& query) const {
+            return sum<typename sum_type<typename Query::value_type>::type>(query, contiguous_source<Query>());
+        }
+
+        template<typename Result, typename Query>
+        static Result sum(const Query& query, std::true_type) {
+            auto range = contiguous_range(query);
+            return unrolled_sum<Result>(range.first, range.second);
+        }
+
+        template<typename Result, typename Query>
+        static Result sum(const Query& query, std::false_type) {
+            Result total = Result();
+            for_each_batch(query, [&total](const typename Query::value_type *first, std::size_t size) {
+                for(std::size_t i = 0; i < size; ++i)
+                    total += first[i];
+            }, [&total](const typename Query::value_type &value) {
+                total += value;
+            });
+            return total;
+        }
+    };
+
+	/*************************************************************//**
+	 * value_less, value_greater
+	 ****************************************************************/
+    struct value_less
+    {
+        template<typename T>
+        bool operator()(const T &lhs, const T &rhs) const {
+            return lhs < rhs;
+        }
+    };
+
+    struct value_greater
+    {
+        template<typename T>
+        bool operator()(const T &lhs, const T &rhs) const {
+            return rhs < lhs;
+        }
+    };
+
+	/*************************************************************//**
+	 * extreme_query_builder
+	 *
+	 * Smallest value under Compare; minimum() and maximum() use less and
+	 * greater. Throws std::out_of_range on an empty query.
+	 ****************************************************************/
+    template<typename Compare>
+    class extreme_query_builder {
+    public:
+        template<typename Query>
+        typename Query::value_type build(const Query& query) const {
+            if(query.empty())
+                throw std::out_of_range("query: minimum/maximum of an empty query");
+            return extreme(query, contiguous_source<Query>());
+        }
+
+    private:
+        template<typename Query>
+        typename Query::value_type extreme(const Query& query, std::true_type) const {
+            auto range = contiguous_range(query);
+            return unrolled_extreme(range.first, range.second, Compare());
+        }
+
+        template<typename Query>
+        typename Query::value_type extreme(const Query& query, std::false_type) const {
+            typename Query::iterator it = query.begin();
+            typename Query::iterator last = query.end();
+            if(it == last)
+                throw std::out_of_range("query: minimum/maximum of an empty query");
+
+            Compare comp;
+            typename Query::value_type result = *it;
+            while(++it != last) {
+                typename Query::value_type value = *it;
+                if(comp(value, result))
+                    result = std::move(value);
+            }
+            return result;
+        }
+    };
+
+	/*************************************************************//**
+	 * average_query_builder
+	 *
+	 * Arithmetic mean as a double. Throws std::out_of_range on an empty
+	 * query.
+	 ****************************************************************/
+    class average_query_builder {
+    public:
+        template<typename Query>
+        double build(const Query& query) const {
+            std::pair<double, std::size_t> total = sum(query, contiguous_source<Query>());
+            if(total.second == 0)
+                throw std::out_of_range("query: average of an empty query");
+            return total.first / static_cast<double>(total.second);
+        }
+
+    private:
+        template<typename Query>
+        static std::pair<double, std::size_t> sum(const Query& query, std::true_type) {
+            auto range = contiguous_range(query);
+            return std::make_pair(unrolled_sum<double>(range.first, range.second),
+                                  static_cast<std::size_t>(range.second - range.first));
+        }
 
-        iterator begin() const {
-            return iterator(_container.begin(), _otherContainer.begin());
+        template<typename Query>
+        static std::pair<double, std::size_t> sum(const Query& query, std::false_type) {
+            double total = 0.0;
+            std::size_t count = 0;
+            for_each_batch(query, [&](const typename Query::value_type *first, std::size_t size) {
+                total += unrolled_sum<double>(first, first + size);
+                count += size;
+            }, [&](const typename Query::value_type &value) {
+                total += static_cast<double>(value);
+                ++count;
+            });
+            return std::make_pair(total, count);
         }
+    };
 
-        iterator end() const {
-			return iterator(_container.end(), _otherContainer.end());
+	/*************************************************************//**
+	 * any_query_builder, all_query_builder
+	 *
+	 * Stop at the first value that decides the answer.
+	 ****************************************************************/
+    template<typename Predicate>
+    class any_query_builder {
+    public:
+        any_query_builder(const Predicate& pred)
+                : _pred(pred)
+        {
         }
 
-        void swap(zip_with_query &other) {
-			std::swap(_container, other._container);
-			std::swap(_otherContainer, other._otherContainer);
+        template<typename Query>
+        bool build(const Query& query) const {
+            typename Query::iterator last = query.end();
+            for(typename Query::iterator it = query.begin(); it != last; ++it)
+                if(_pred(*it))
+                    return true;
+            return false;
         }
 
-        bool empty() const {
-			return _container.empty() || _otherContainer.empty();
+    private:
+        Predicate _pred;
+    };
+
+    template<typename Predicate>
+    class all_query_builder {
+    public:
+        all_query_builder(const Predicate& pred)
+                : _pred(pred)
+        {
         }
 
-        template<typename QueryBuilder>
-        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(const QueryBuilder& qb) const {
-            return qb.build(*this);
+        template<typename Query>
+        bool build(const Query& query) const {
+            typename Query::iterator last = query.end();
+            for(typename Query::iterator it = query.begin(); it != last; ++it)
+                if(!_pred(*it))
+                    return false;
+            return true;
         }
 
     private:
-        InputType _container;
-        OtherInputType _otherContainer;
+        Predicate _pred;
     };
 
 	/*************************************************************//**
-	 * zip_with_query_builder
+	 * first_query_builder, first_or_default_query_builder
+	 *
+	 * The first value, read through take(1), so an orderby upstream
+	 * only selects its smallest value. first() throws std::out_of_range
+	 * on an empty query; first_or_default() returns a value initialized
+	 * value_type, or the fallback it was given.
 	 ****************************************************************/
-    template<typename OtherType>
-    class zip_with_query_builder {
+    class first_query_builder {
     public:
+        template<typename Query>
+        typename Query::value_type build(const Query& query) const {
+            auto limited = take_query_builder(1).build(query);
+            auto it = limited.begin();
+            if(it == limited.end())
+                throw std::out_of_range("query: first of an empty query");
+            return *it;
+        }
+    };
 
-        zip_with_query_builder(const OtherType& other)
-                : _other(other) {
+    template<typename Fallback>
+    class first_or_default_query_builder {
+    public:
+        first_or_default_query_builder(const Fallback& fallback)
+                : _fallback(fallback)
+        {
         }
 
         template<typename Query>
-        zip_with_query<Query, OtherType> build(const Query& query) const {
-            return zip_with_query<Query, OtherType>(query, _other);
+        typename Query::value_type build(const Query& query) const {
+            auto limited = take_query_builder(1).build(query);
+            auto it = limited.begin();
+            if(it == limited.end())
+                return typename Query::value_type(_fallback);
+            return *it;
         }
 
     private:
-        OtherType _other;
+        Fallback _fallback;
+    };
+
+    template<>
+    class first_or_default_query_builder<void> {
+    public:
+        template<typename Query>
+        typename Query::value_type build(const Query& query) const {
+            auto limited = take_query_builder(1).build(query);
+            auto it = limited.begin();
+            if(it == limited.end())
+                return typename Query::value_type();
+            return *it;
+        }
     };
 
 
@@ -926,12 +9919,36 @@ query::int_query from_range(int begin, int end)
     return query::int_query(begin, end);
 }
 
+/*************************************************************//**
+ * range
+ *
+ * begin, begin + step, ... up to but excluding end. Throws
+ * std::invalid_argument when step is zero.
+ ****************************************************************/
+template<typename T>
+query::range_query<T> range(T begin, T end, T step = T(1))
+{
+    if(step == T(0))
+        throw std::invalid_argument("query: range step of zero");
+    return query::range_query<T>(begin, step, query::range_arithmetic<T>::count(begin, end, step));
+}
+
+/*************************************************************//**
+ * range_infinite
+ ****************************************************************/
+template<typename T>
+query::range_query<T> range_infinite(T begin, T step = T(1))
+{
+    return query::range_query<T>(begin, step, query::range_query<T>::infinite_count());
+}
+
 /*************************************************************//**
  * from_range_infinite
  ****************************************************************/
-query::int_query from_range_infinite(int begin)
+template<typename T>
+query::range_query<T> from_range_infinite(T begin)
 {
-    return query::int_query(begin, begin - 1);
+    return range_infinite(begin);
 }
 
 /*************************************************************//**
@@ -946,20 +9963,20 @@ query::simple_query_builder pass_through()
  * where
  ****************************************************************/
 template<typename Predicate>
-query::where_query_builder<Predicate>
-where(const Predicate& pred)
+query::where_query_builder<typename std::decay<Predicate>::type>
+where(Predicate&& pred)
 {
-    return query::where_query_builder<Predicate>(pred);
+    return query::where_query_builder<typename std::decay<Predicate>::type>(std::forward<Predicate>(pred));
 }
 
 /*************************************************************//**
  * select
  ****************************************************************/
 template<typename Generator>
-query::select_query_builder<Generator>
-select(const Generator& generator)
+query::select_query_builder<typename std::decay<Generator>::type>
+select(Generator&& generator)
 {
-    return query::select_query_builder<Generator>(generator);
+    return query::select_query_builder<typename std::decay<Generator>::type>(std::forward<Generator>(generator));
 }
 
 /*************************************************************//**
@@ -972,13 +9989,372 @@ orderby(const Predicate pred, bool sort_ascending = true)
     return query::orderby_query_builder<Predicate>(pred, sort_ascending);
 }
 
+/*************************************************************//**
+ * top_k
+ ****************************************************************/
+template<typename Predicate>
+query::orderby_query_builder<Predicate>
+top_k(std::size_t count, const Predicate pred, bool sort_ascending = true)
+{
+    return query::orderby_query_builder<Predicate>(pred, sort_ascending, count);
+}
+
+/*************************************************************//**
+ * then_by
+ ****************************************************************/
+template<typename Predicate>
+query::then_by_query_builder<Predicate>
+then_by(const Predicate pred, bool sort_ascending = true)
+{
+    return query::then_by_query_builder<Predicate>(pred, sort_ascending);
+}
+
+/*************************************************************//**
+ * orderby_key
+ ****************************************************************/
+template<typename KeyFunction>
+query::key_orderby_query_builder<typename std::decay<KeyFunction>::type>
+orderby_key(KeyFunction&& key_fn, bool sort_ascending = true)
+{
+    return query::key_orderby_query_builder<typename std::decay<KeyFunction>::type>(
+            std::forward<KeyFunction>(key_fn), sort_ascending);
+}
+
+/*************************************************************//**
+ * take
+ ****************************************************************/
+inline query::take_query_builder take(std::size_t count)
+{
+    return query::take_query_builder(count);
+}
+
+/*************************************************************//**
+ * skip
+ ****************************************************************/
+inline query::skip_query_builder skip(std::size_t count)
+{
+    return query::skip_query_builder(count);
+}
+
+/*************************************************************//**
+ * take_while
+ ****************************************************************/
+template<typename Predicate>
+query::take_while_query_builder<typename std::decay<Predicate>::type>
+take_while(Predicate&& pred)
+{
+    return query::take_while_query_builder<typename std::decay<Predicate>::type>(std::forward<Predicate>(pred));
+}
+
+/*************************************************************//**
+ * skip_while
+ ****************************************************************/
+template<typename Predicate>
+query::skip_while_query_builder<typename std::decay<Predicate>::type>
+skip_while(Predicate&& pred)
+{
+    return query::skip_while_query_builder<typename std::decay<Predicate>::type>(std::forward<Predicate>(pred));
+}
+
 /*************************************************************//**
  * zip_with
  ****************************************************************/
 template<typename OtherQuery>
-query::zip_with_query_builder<OtherQuery>
-zip_with(const OtherQuery& other_query)
+query::zip_with_query_builder<typename std::decay<OtherQuery>::type>
+zip_with(OtherQuery&& other_query)
+{
+    return query::zip_with_query_builder<typename std::decay<OtherQuery>::type>(
+            std::forward<OtherQuery>(other_query));
+}
+
+/*************************************************************//**
+ * parallel
+ ****************************************************************/
+inline query::parallel_query_builder parallel(unsigned threads = 0)
+{
+    return query::parallel_query_builder(threads);
+}
+
+/*************************************************************//**
+ * aggregate
+ ****************************************************************/
+template<typename Seed, typename Function>
+query::fold_aggregator<Seed, typename std::decay<Function>::type>
+aggregate(const Seed& seed, Function&& fn)
+{
+    return query::fold_aggregator<Seed, typename std::decay<Function>::type>(seed, std::forward<Function>(fn));
+}
+
+/*************************************************************//**
+ * group_by
+ ****************************************************************/
+template<typename KeyFunction>
+query::group_collect_query_builder<typename std::decay<KeyFunction>::type>
+group_by(KeyFunction&& key_fn)
+{
+    return query::group_collect_query_builder<typename std::decay<KeyFunction>::type>(
+            std::forward<KeyFunction>(key_fn));
+}
+
+template<typename KeyFunction, typename Aggregator>
+query::group_by_query_builder<typename std::decay<KeyFunction>::type, Aggregator>
+group_by(KeyFunction&& key_fn, const Aggregator& aggregator)
+{
+    return query::group_by_query_builder<typename std::decay<KeyFunction>::type, Aggregator>(
+            std::forward<KeyFunction>(key_fn), aggregator);
+}
+
+/*************************************************************//**
+ * join
+ ****************************************************************/
+template<typename OtherQuery, typename LeftKey, typename RightKey, typename ResultFunction>
+query::join_query_builder<typename std::decay<OtherQuery>::type, LeftKey, RightKey, ResultFunction>
+join(OtherQuery&& other_query, const LeftKey left_key, const RightKey right_key, const ResultFunction result_fn)
+{
+    return query::join_query_builder<typename std::decay<OtherQuery>::type, LeftKey, RightKey, ResultFunction>(
+            std::forward<OtherQuery>(other_query), left_key, right_key, result_fn);
+}
+
+/*************************************************************//**
+ * merge_join
+ ****************************************************************/
+template<typename OtherQuery, typename LeftKey, typename RightKey, typename ResultFunction>
+query::merge_join_query_builder<typename std::decay<OtherQuery>::type, LeftKey, RightKey, ResultFunction>
+merge_join(OtherQuery&& other_query, const LeftKey left_key, const RightKey right_key, const ResultFunction result_fn)
+{
+    return query::merge_join_query_builder<typename std::decay<OtherQuery>::type, LeftKey, RightKey, ResultFunction>(
+            std::forward<OtherQuery>(other_query), left_key, right_key, result_fn);
+}
+
+/*************************************************************//**
+ * distinct
+ ****************************************************************/
+inline query::distinct_query_builder<query::value_hash, query::value_equal> distinct()
+{
+    return query::distinct_query_builder<query::value_hash, query::value_equal>(
+            query::value_hash(), query::value_equal());
+}
+
+template<typename Hash, typename KeyEqual = query::value_equal>
+query::distinct_query_builder<Hash, KeyEqual>
+distinct(const Hash hash, const KeyEqual equal = KeyEqual())
+{
+    return query::distinct_query_builder<Hash, KeyEqual>(hash, equal);
+}
+
+/*************************************************************//**
+ * union_with
+ ****************************************************************/
+template<typename Other, typename Hash = query::value_hash, typename KeyEqual = query::value_equal>
+query::set_query_builder<typename std::decay<Other>::type, query::set_union, Hash, KeyEqual>
+union_with(Other&& other, const Hash hash = Hash(), const KeyEqual equal = KeyEqual())
+{
+    return query::set_query_builder<typename std::decay<Other>::type, query::set_union, Hash, KeyEqual>(
+            std::forward<Other>(other), hash, equal);
+}
+
+/*************************************************************//**
+ * intersect
+ ****************************************************************/
+template<typename Other, typename Hash = query::value_hash, typename KeyEqual = query::value_equal>
+query::set_query_builder<typename std::decay<Other>::type, query::set_intersection, Hash, KeyEqual>
+intersect(Other&& other, const Hash hash = Hash(), const KeyEqual equal = KeyEqual())
+{
+    return query::set_query_builder<typename std::decay<Other>::type, query::set_intersection, Hash, KeyEqual>(
+            std::forward<Other>(other), hash, equal);
+}
+
+/*************************************************************//**
+ * except
+ ****************************************************************/
+template<typename Other, typename Hash = query::value_hash, typename KeyEqual = query::value_equal>
+query::set_query_builder<typename std::decay<Other>::type, query::set_difference, Hash, KeyEqual>
+except(Other&& other, const Hash hash = Hash(), const KeyEqual equal = KeyEqual())
+{
+    return query::set_query_builder<typename std::decay<Other>::type, query::set_difference, Hash, KeyEqual>(
+            std::forward<Other>(other), hash, equal);
+}
+
+/*************************************************************//**
+ * to_vector
+ ****************************************************************/
+inline query::to_vector_query_builder to_vector()
+{
+    return query::to_vector_query_builder();
+}
+
+/*************************************************************//**
+ * to_string
+ ****************************************************************/
+inline query::to_string_query_builder to_string()
+{
+    return query::to_string_query_builder();
+}
+
+/*************************************************************//**
+ * to_unordered_map
+ ****************************************************************/
+template<typename KeyFunction>
+query::to_unordered_map_query_builder<typename std::decay<KeyFunction>::type>
+to_unordered_map(KeyFunction&& key_fn)
+{
+    return query::to_unordered_map_query_builder<typename std::decay<KeyFunction>::type>(
+            std::forward<KeyFunction>(key_fn));
+}
+
+/*************************************************************//**
+ * into
+ ****************************************************************/
+template<typename Container>
+query::into_query_builder<Container>
+into(Container& container)
+{
+    return query::into_query_builder<Container>(container);
+}
+
+/*************************************************************//**
+ * count
+ ****************************************************************/
+inline query::count_query_builder count()
+{
+    return query::count_query_builder();
+}
+
+template<typename Predicate>
+query::count_if_query_builder<typename std::decay<Predicate>::type>
+count(Predicate&& pred)
+{
+    return query::count_if_query_builder<typename std::decay<Predicate>::type>(std::forward<Predicate>(pred));
+}
+
+/*************************************************************//**
+ * sum
+ ****************************************************************/
+inline query::sum_query_builder sum()
+{
+    return query::sum_query_builder();
+}
+
+/*************************************************************//**
+ * minimum, maximum
+ ****************************************************************/
+inline query::extreme_query_builder<query::value_less > minimum()
+{
+    return query::extreme_query_builder<query::value_less >();
+}
+
+inline query::extreme_query_builder<query::value_greater > maximum()
+{
+    return query::extreme_query_builder<query::value_greater >();
+}
+
+/*************************************************************//**
+ * average
+ ****************************************************************/
+inline query::average_query_builder average()
+{
+    return query::average_query_builder();
+}
+
+/*************************************************************//**
+ * any, all
+ ****************************************************************/
+template<typename Predicate>
+query::any_query_builder<typename std::decay<Predicate>::type>
+any(Predicate&& pred)
+{
+    return query::any_query_builder<typename std::decay<Predicate>::type>(std::forward<Predicate>(pred));
+}
+
+template<typename Predicate>
+query::all_query_builder<typename std::decay<Predicate>::type>
+all(Predicate&& pred)
+{
+    return query::all_query_builder<typename std::decay<Predicate>::type>(std::forward<Predicate>(pred));
+}
+
+/*************************************************************//**
+ * first, first_or_default
+ ****************************************************************/
+inline query::first_query_builder first()
+{
+    return query::first_query_builder();
+}
+
+inline query::first_or_default_query_builder<void> first_or_default()
+{
+    return query::first_or_default_query_builder<void>();
+}
+
+template<typename Fallback>
+query::first_or_default_query_builder<typename std::decay<const Fallback>::type>
+first_or_default(const Fallback& fallback)
+{
+    return query::first_or_default_query_builder<typename std::decay<const Fallback>::type>(fallback);
+}
+
+/*************************************************************//**
+ * char_equal, char_in_range, char_any_of, char_not
+ ****************************************************************/
+inline query::char_equal_predicate char_equal(char c)
+{
+    return query::char_equal_predicate(c);
+}
+
+inline query::char_in_range_predicate char_in_range(char lo, char hi)
+{
+    return query::char_in_range_predicate(lo, hi);
+}
+
+inline query::char_any_of_predicate char_any_of(const std::string& chars)
+{
+    return query::char_any_of_predicate(chars);
+}
+
+template<typename Predicate>
+query::char_not_predicate<Predicate> char_not(const Predicate& pred)
+{
+    static_assert(query::is_char_predicate<Predicate>::value, "char_not needs a char predicate");
+    return query::char_not_predicate<Predicate>(pred);
+}
+
+/*************************************************************//**
+ * from_file
+ ****************************************************************/
+inline query::file_query from_file(const std::string& path)
+{
+    return query::file_query(path);
+}
+
+/*************************************************************//**
+ * lines
+ ****************************************************************/
+inline query::delimited_query<query::file_query> lines(const std::string& path, char delim = '\n')
+{
+    return query::delimited_query<query::file_query>(query::file_query(path), delim);
+}
+
+/*************************************************************//**
+ * split, tokenize, words
+ ****************************************************************/
+inline query::split_query_builder split(char delim)
+{
+    return query::split_query_builder(delim);
+}
+
+inline query::tokenize_query_builder<query::char_any_of_predicate> tokenize(const std::string& separators)
+{
+    return query::tokenize_query_builder<query::char_any_of_predicate>(query::char_any_of_predicate(separators));
+}
+
+template<typename Predicate>
+typename std::enable_if<query::is_char_predicate<Predicate>::value, query::tokenize_query_builder<Predicate> >::type
+tokenize(const Predicate& separator)
 {
-    return query::zip_with_query_builder<OtherQuery>(other_query);
+    return query::tokenize_query_builder<Predicate>(separator);
 }
 
+inline query::tokenize_query_builder<query::char_any_of_predicate> words()
+{
+    return tokenize(" \t\n\v\f\r");
+}
@@ -0,0 +1,345 @@
+#pragma once
+#include "query.h"
+
+#if !defined(__cpp_impl_coroutine) && !defined(__cpp_coroutines)
+#error "query_coro.h needs C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+
+namespace query {
+
+	/*************************************************************//**
+	 * generator
+	 *
+	 * Coroutine that produces values lazily with co_yield. The body runs
+	 * only when the next value is asked for and stops at each co_yield,
+	 * so a producer (reading a socket or a file chunk by chunk) never
+	 * has to buffer its whole input. Exceptions thrown by the body
+	 * come out of next(). Move only; owns the coroutine frame.
+	 ****************************************************************/
+    template<typename T>
+    class generator {
+    public:
+        static_assert(!std::is_reference<T>::value, "generator yields values");
+
+        struct promise_type {
+            generator get_return_object() {
+                return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept {
+                return std::suspend_always();
+            }
+
+            std::suspend_always final_suspend() noexcept {
+                return std::suspend_always();
+            }
+
+            // The yielded value lives in the coroutine frame until the
+            // body is resumed, so only its address is kept.
+            std::suspend_always yield_value(const T &value) noexcept {
+                current = std::addressof(value);
+                return std::suspend_always();
+            }
+
+            void return_void() {
+            }
+
+            void unhandled_exception() {
+                error = std::current_exception();
+            }
+
+            // Generators run synchronously; use async_for_each to wait.
+            template<typename U>
+            std::suspend_never await_transform(U &&) = delete;
+
+            const T *current = nullptr;
+            std::exception_ptr error;
+        };
+
+        generator(generator &&other) noexcept
+                : _handle(other._handle)
+        {
+            other._handle = nullptr;
+        }
+
+        ~generator() {
+            if(_handle)
+                _handle.destroy();
+        }
+
+        generator(const generator &) = delete;
+
+        generator &operator=(const generator &) = delete;
+
+        // Runs the body to its next co_yield; false once it has returned.
+        bool next() {
+            _handle.resume();
+            if(_handle.promise().error)
+                std::rethrow_exception(_handle.promise().error);
+            return !_handle.done();
+        }
+
+        const T &value() const {
+            return *_handle.promise().current;
+        }
+
+    private:
+        explicit generator(std::coroutine_handle<promise_type> handle)
+                : _handle(handle)
+        {
+        }
+
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+	/*************************************************************//**
+	 * generator_query
+	 *
+	 * The values of a generator, as a single pass source. Copies share
+	 * the coroutine; a later begin() continues where the last pass
+	 * stopped instead of starting over.
+	 ****************************************************************/
+    template<typename T>
+    class generator_query {
+    public:
+        typedef std::allocator<T> A;
+        typedef A allocator_type;
+        typedef typename A::value_type value_type;
+        typedef value_type &reference;
+        typedef const value_type &const_reference;
+        typedef typename std::allocator_traits<A>::difference_type difference_type;
+        typedef typename std::allocator_traits<A>::size_type size_type;
+
+        typedef generator_query<T> this_type;
+
+    private:
+        struct state {
+            explicit state(generator<T> &&source)
+                    : source(std::move(source)), started(false), done(false)
+            {
+            }
+
+            generator<T> source;
+            bool started;
+            bool done;
+        };
+
+    public:
+        class iterator {
+        public:
+            typedef typename A::value_type value_type;
+            typedef typename std::allocator_traits<A>::difference_type difference_type;
+            typedef const value_type &reference;
+            typedef typename std::allocator_traits<A>::const_pointer pointer;
+            typedef std::input_iterator_tag iterator_category;
+
+            explicit iterator(state *source)
+                    : _state(source)
+            {
+            }
+
+            iterator(const iterator &other)
+                    : _state(other._state)
+            {
+            }
+
+            iterator &operator=(const iterator &other) {
+                _state = other._state;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return at_end() == other.at_end();
+            }
+
+            bool operator!=(const iterator &other) const {
+                return at_end() != other.at_end();
+            }
+
+            iterator &operator++() {
+                assert(!at_end());
+                _state->done = !_state->source.next();
+                return *this;
+            }
+
+            void operator++(int) {
+                ++*this;
+            }
+
+            reference operator*() const {
+                assert(!at_end());
+                return _state->source.value();
+            }
+
+            pointer operator->() const {
+                assert(!at_end());
+                return &_state->source.value();
+            }
+
+        private:
+            bool at_end() const {
+                return _state == nullptr || _state->done;
+            }
+
+            state *_state;
+        };
+
+        explicit generator_query(generator<T> &&source)
+                : _state(std::make_shared<state>(std::move(source)))
+        {
+        }
+
+        generator_query(const generator_query &other)
+                : _state(other._state)
+        {
+        }
+
+        generator_query(generator_query &&other)
+                : _state(std::move(other._state))
+        {
+        }
+
+        ~generator_query() {
+        }
+
+        generator_query &operator=(const generator_query &);
+
+        bool operator==(const generator_query &) const;
+
+        bool operator!=(const generator_query &) const;
+
+        // Runs the generator to its first value on the first call.
+        iterator begin() const {
+            if(!_state->started) {
+                _state->started = true;
+                _state->done = !_state->source.next();
+            }
+            return iterator(_state.get());
+        }
+
+        iterator end() const {
+            return iterator(nullptr);
+        }
+
+        void swap(generator_query &other) {
+            std::swap(_state, other._state);
+        }
+
+        bool empty() const {
+            return begin() == end();
+        }
+
+        size_bounds size_hint() const {
+            if(_state->started && _state->done)
+                return size_bounds::exact(0);
+            return size_bounds::between(0, size_bounds::unbounded());
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) const & {
+            return std::forward<QueryBuilder>(qb).build(*this);
+        }
+
+        template<typename QueryBuilder>
+        typename get_builtup_type<QueryBuilder, this_type>::type operator>>(QueryBuilder&& qb) && {
+            return std::forward<QueryBuilder>(qb).build(std::move(*this));
+        }
+
+    private:
+        std::shared_ptr<state> _state;
+    };
+
+	/*************************************************************//**
+	 * async_for_each_awaitable
+	 *
+	 * What query >> async_for_each(fn) returns. co_await runs the whole
+	 * pipeline, calling fn on each value, on a thread of its own and
+	 * resumes the awaiting coroutine on that thread when it is done, so
+	 * the caller's thread is free while the producer and the stages
+	 * run. An exception from the pipeline or from fn is rethrown by
+	 * co_await. The query and fn must not be shared with other threads
+	 * while it runs.
+	 ****************************************************************/
+    template<typename Query, typename Function>
+    class async_for_each_awaitable {
+    public:
+        template<typename Input>
+        async_for_each_awaitable(Input &&query, const Function &fn)
+                : _query(std::forward<Input>(query))
+                , _fn(fn)
+        {
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            std::thread([this, awaiting]() {
+                try {
+                    typename Query::iterator last = _query.end();
+                    for(typename Query::iterator it = _query.begin(); it != last; ++it)
+                        _fn(*it);
+                }
+                catch(...) {
+                    _error = std::current_exception();
+                }
+                awaiting.resume();
+            }).detach();
+        }
+
+        void await_resume() {
+            if(_error)
+                std::rethrow_exception(_error);
+        }
+
+    private:
+        Query _query;
+        Function _fn;
+        std::exception_ptr _error;
+    };
+
+	/*************************************************************//**
+	 * async_for_each_query_builder
+	 ****************************************************************/
+    template<typename Function>
+    class async_for_each_query_builder {
+    public:
+        async_for_each_query_builder(const Function& fn)
+                : _fn(fn)
+        {
+        }
+
+        template<typename Query>
+        async_for_each_awaitable<typename std::decay<Query>::type, Function> build(Query&& query) const {
+            return async_for_each_awaitable<typename std::decay<Query>::type, Function>(
+                    std::forward<Query>(query), _fn);
+        }
+
+    private:
+        Function _fn;
+    };
+
+}
+
+
+/*************************************************************//**
+ * from_generator
+ ****************************************************************/
+template<typename T>
+query::generator_query<T> from_generator(query::generator<T>&& source)
+{
+    return query::generator_query<T>(std::move(source));
+}
+
+/*************************************************************//**
+ * async_for_each
+ ****************************************************************/
+template<typename Function>
+query::async_for_each_query_builder<typename std::decay<Function>::type>
+async_for_each(Function&& fn)
+{
+    return query::async_for_each_query_builder<typename std::decay<Function>::type>(std::forward<Function>(fn));
+}